@@ -638,6 +638,9 @@ uint32_t parse_argb(char **p)
 //static const char *append = NULL;
 extern const char *append;
 extern uint16_t PXERetry;
+extern uint16_t ReadAhead;
+extern uint16_t TFTPBlkSize;
+extern uint32_t __weak XfsDirCache;
 static struct labeldata ld;
 
 static int parse_main_config(const char *filename);
@@ -1305,6 +1308,18 @@ static void parse_config_file(FILE * f)
 	else if (looking_at(p, "pxeretry"))
 		PXERetry = atoi(skipspace(p + 8));
 
+	else if (looking_at(p, "readahead"))
+		ReadAhead = atoi(skipspace(p + 9));
+
+	else if (looking_at(p, "tftpblksize"))
+		TFTPBlkSize = atoi(skipspace(p + 11));
+
+	else if (looking_at(p, "xfsdircache")) {
+		/* Only cores with the XFS driver have it */
+		if (&XfsDirCache)
+			XfsDirCache = atoi(skipspace(p + 11));
+	}
+
 	/* serial setting, bps, flow control */
 	else if (looking_at(p, "serial")) {
 		uint16_t port, flow;
@@ -1429,6 +1444,27 @@ static void parse_config_file(FILE * f)
 			SendCookies = strtoul(skipspace(p), NULL, 10);
 			http_bake_cookies();
 		}
+	} else if (looking_at(p, "httpranges")) {
+		p += strlen("httpranges");
+
+		/* Only lpxelinux has HTTP */
+		if (&HttpRanges)
+			HttpRanges = strtoul(skipspace(p), NULL, 10);
+	} else if (looking_at(p, "httpkeepalive")) {
+		p += strlen("httpkeepalive");
+
+		if (&HttpKeepAlive)
+			HttpKeepAlive = strtoul(skipspace(p), NULL, 10);
+	} else if (looking_at(p, "tcpwindow")) {
+		p += strlen("tcpwindow");
+
+		if (&TcpWindow)
+			TcpWindow = strtoul(skipspace(p), NULL, 10);
+	} else if (looking_at(p, "tcpoptions")) {
+		p += strlen("tcpoptions");
+
+		if (&TcpOptions)
+			TcpOptions = strtoul(skipspace(p), NULL, 10);
 	}
     }
 }
@@ -0,0 +1,78 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   Copyright 2026 The Syslinux Project - All Rights Reserved
+ *
+ *   Permission is hereby granted, free of charge, to any person
+ *   obtaining a copy of this software and associated documentation
+ *   files (the "Software"), to deal in the Software without
+ *   restriction, including without limitation the rights to use,
+ *   copy, modify, merge, publish, distribute, sublicense, and/or
+ *   sell copies of the Software, and to permit persons to whom
+ *   the Software is furnished to do so, subject to the following
+ *   conditions:
+ *
+ *   The above copyright notice and this permission notice shall
+ *   be included in all copies or substantial portions of the Software.
+ *
+ *   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ *   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ *   OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ *   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ *   HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ *   WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ *   OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * syslinux/diskprof.h
+ *
+ * I/O profile of the disk the core is booting from, as learned by
+ * the firmware disk driver.
+ */
+
+#ifndef _SYSLINUX_DISKPROF_H
+#define _SYSLINUX_DISKPROF_H
+
+#include <stdint.h>
+
+/*
+ * Transfer size classes: class n covers transfers of 2^n to
+ * 2^(n+1)-1 sectors, the last class everything above.
+ */
+#define DISK_XFER_CLASSES	8
+
+struct disk_xfer_class {
+    uint32_t calls;		/* Successful transfers */
+    uint32_t errors;		/* Failed attempts */
+    uint32_t ms;		/* Accumulated latency of the successful ones */
+};
+
+/*
+ * Transfer counters, maintained by the firmware disk drivers and by
+ * generic_getfssec() for streamed file reads.
+ */
+struct disk_stats {
+    uint32_t calls;		/* Firmware transfer calls */
+    uint32_t errors;		/* Failed firmware calls, including retries */
+    uint64_t bytes;		/* Bytes transferred */
+    uint64_t bounced;		/* Bytes copied through the bounce buffer */
+    uint64_t stream_bytes;	/* Bytes read by large sequential file reads */
+    uint32_t stream_ms;		/* Time spent in those reads */
+};
+
+struct disk_profile {
+    unsigned int disk_number;	/* BIOS drive number */
+    unsigned int sector_size;
+    unsigned int maxtransfer;	/* Current transfer size limit (sectors) */
+    unsigned int hard_maxtransfer; /* Configured or firmware upper bound */
+    unsigned int good_maxtransfer; /* Largest size seen succeeding */
+    unsigned int fail_maxtransfer; /* Smallest size seen failing, 0 if none */
+    struct disk_stats stats;
+    struct disk_xfer_class xfer[DISK_XFER_CLASSES];
+};
+
+extern int syslinux_disk_profile(struct disk_profile *);
+
+#endif /* _SYSLINUX_DISKPROF_H */
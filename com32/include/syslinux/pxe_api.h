@@ -590,6 +590,10 @@ void __weak unload_pxe(uint16_t flags);
 uint32_t __weak dns_resolv(const char *);
 
 extern uint32_t __weak SendCookies;
+extern uint32_t __weak HttpRanges;
+extern uint32_t __weak HttpKeepAlive;
+extern uint32_t __weak TcpWindow;
+extern uint32_t __weak TcpOptions;
 void __weak http_bake_cookies(void);
 
 #endif /* _SYSLINUX_PXE_API_H */
@@ -0,0 +1,70 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, Inc., 53 Temple Place Ste 330,
+ *   Boston MA 02111-1307, USA; either version 2 of the License, or
+ *   (at your option) any later version; incorporated herein by reference.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * diskprof.c
+ *
+ * Display the I/O profile the core has learned for the boot disk:
+ * the transfer size limits, per-size latency and error counts, and
+ * the overall transfer statistics.
+ */
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <syslinux/diskprof.h>
+
+static unsigned int avg(uint32_t total, uint32_t n)
+{
+    return n ? total / n : 0;
+}
+
+int main(void)
+{
+    struct disk_profile prof;
+    const struct disk_stats *st = &prof.stats;
+    int i;
+
+    if (syslinux_disk_profile(&prof)) {
+	fprintf(stderr, "diskprof: not booted from a disk\n");
+	return 1;
+    }
+
+    printf("Disk %02x, %u-byte sectors\n",
+	   prof.disk_number, prof.sector_size);
+    printf("maxtransfer %u (limit %u, largest good %u, smallest failed %u)\n",
+	   prof.maxtransfer, prof.hard_maxtransfer,
+	   prof.good_maxtransfer, prof.fail_maxtransfer);
+
+    printf("\n  sectors      calls  errors  avg ms\n");
+    for (i = 0; i < DISK_XFER_CLASSES; i++) {
+	const struct disk_xfer_class *xc = &prof.xfer[i];
+
+	if (!xc->calls && !xc->errors)
+	    continue;
+
+	if (i == DISK_XFER_CLASSES-1)
+	    printf("  %4u+    ", 1U << i);
+	else
+	    printf("  %4u-%-4u", 1U << i, (2U << i) - 1);
+	printf(" %8u %7u %7u\n", xc->calls, xc->errors, avg(xc->ms, xc->calls));
+    }
+
+    printf("\n%u calls, %u errors, %" PRIu64 " KiB transferred, "
+	   "%" PRIu64 " KiB bounced\n",
+	   st->calls, st->errors, st->bytes >> 10, st->bounced >> 10);
+    if (st->stream_bytes)
+	printf("Streamed %" PRIu64 " KiB in %u ms (%u KiB/s)\n",
+	       st->stream_bytes >> 10, st->stream_ms,
+	       st->stream_ms ?
+	       (unsigned int)((st->stream_bytes >> 10) * 1000 / st->stream_ms)
+	       : 0);
+
+    return 0;
+}
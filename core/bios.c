@@ -454,6 +454,7 @@ uint8_t KbdFlags;		/* Check for keyboard escapes */
 __export uint8_t KbdMap[256];	/* Keyboard map */
 
 __export uint16_t PXERetry;
+__export uint16_t TFTPBlkSize;
 
 static inline void check_escapes(void)
 {
@@ -15,6 +15,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <cache.h>
+#include <dcache.h>
 #include <core.h>
 #include <disk.h>
 #include <fs.h>
@@ -28,12 +29,55 @@ union tree_buf {
 	struct btrfs_leaf leaf;
 };
 
+/* a tree node kept around decoded, see get_node() */
+struct btrfs_cached_node {
+	u64 loffset;		/* logical address, 0 = unused */
+	u32 last_used;
+	union tree_buf *buf;
+};
+
+#define BTRFS_NODE_CACHE 32
+
+/*
+ * One level of the path taken by the last tree search, with the range
+ * of keys the node there covers: [lo, hi), unbounded if !has_lo/!has_hi.
+ */
+struct btrfs_last_level {
+	u64 offset;		/* logical address of the node, 0 = unknown */
+	int itemsnr;
+	int slot;		/* slot followed to the level below */
+	bool has_lo, has_hi;
+	struct btrfs_disk_key lo, hi;
+};
+
+/*
+ * The file extent last looked up by btrfs_getfssec().  A compressed
+ * extent is kept decompressed in zbuf, as reads rarely cover a whole
+ * extent in one go.
+ */
+struct btrfs_extent_cache {
+	u64 ino;		/* 0 = unused */
+	u64 start, end;		/* file range covered */
+	u8 compression;
+	u32 skip;		/* offset of start in zbuf */
+	char *zbuf;
+};
+
 /* filesystem instance structure */
 struct btrfs_info {
 	u64 fs_tree;
 	struct btrfs_super_block sb;
 	struct btrfs_chunk_map chunk_map;
-	union tree_buf *tree_buf;
+	union tree_buf *tree_buf;	/* used if the node cache is full */
+	struct btrfs_cached_node nodes[BTRFS_NODE_CACHE];
+	u32 node_clock;
+	u64 last_root;			/* tree of the last search */
+	int last_top;			/* level of its root node */
+	struct btrfs_last_level last[BTRFS_MAX_LEVEL];
+	struct btrfs_extent_cache ext;	/* see btrfs_getfssec() */
+	char *cbuf;			/* compressed extent being read */
+	u64 zin, zout;			/* compressed/decompressed bytes */
+	u32 zms;			/* time spent decompressing */
 };
 
 /* compare function used for bin_search */
@@ -232,62 +276,176 @@ static int btrfs_comp_keys_type(const struct btrfs_disk_key *k1,
 	return 0;
 }
 
-/* seach tree directly on disk ... */
-static int search_tree(struct fs_info *fs, u64 loffset,
-		       struct btrfs_disk_key *key, struct btrfs_path *path)
+/*
+ * Return the tree node at logical address loffset.  Recently used nodes
+ * are kept in memory, so walking neighbouring keys or searching the
+ * same part of a tree again doesn't go back to the disk cache.  The
+ * node is only valid until the next call.
+ */
+static const union tree_buf *get_node(struct fs_info *fs, u64 loffset)
 {
 	struct btrfs_info * const bfs = fs->fs_info;
-	union tree_buf *tree_buf = bfs->tree_buf;
-	int slot, ret;
+	struct btrfs_cached_node *cn, *victim = NULL;
+	union tree_buf *buf;
 	u64 offset;
+	u32 size;
+	int i;
+
+	for (i = 0; i < BTRFS_NODE_CACHE; i++) {
+		cn = &bfs->nodes[i];
+		if (cn->loffset == loffset) {
+			cn->last_used = ++bfs->node_clock;
+			return cn->buf;
+		}
+		if (!victim || cn->last_used < victim->last_used)
+			victim = cn;
+	}
+
+	if (!victim->buf)
+		victim->buf = malloc(max(bfs->sb.nodesize, bfs->sb.leafsize));
+	buf = victim->buf ? victim->buf : bfs->tree_buf;
 
 	offset = logical_physical(fs, loffset);
-	cache_read(fs, &tree_buf->header, offset, sizeof(tree_buf->header));
-	if (tree_buf->header.level) {
+	cache_read(fs, &buf->header, offset, sizeof(buf->header));
+	size = buf->header.level ? bfs->sb.nodesize : bfs->sb.leafsize;
+	cache_read(fs, (char *)buf + sizeof buf->header,
+		   offset + sizeof buf->header, size - sizeof buf->header);
+
+	if (victim->buf) {
+		victim->loffset = loffset;
+		victim->last_used = ++bfs->node_clock;
+	}
+	return buf;
+}
+
+/* search from the node at loffset down to a leaf */
+static int search_node(struct fs_info *fs, u64 loffset,
+		       struct btrfs_disk_key *key, struct btrfs_path *path)
+{
+	struct btrfs_info * const bfs = fs->fs_info;
+	const union tree_buf *tree_buf;
+	struct btrfs_last_level *last, *child;
+	int slot, ret, level, nritems;
+
+	tree_buf = get_node(fs, loffset);
+	level = tree_buf->header.level;
+	nritems = tree_buf->header.nritems;
+	if (level >= BTRFS_MAX_LEVEL)
+		return -1;
+
+	path->itemsnr[level] = nritems;
+	path->offsets[level] = loffset;
+	if (level) {
 		/* inner node */
-		cache_read(fs, (char *)&tree_buf->node.ptrs[0],
-			   offset + sizeof tree_buf->header,
-			   bfs->sb.nodesize - sizeof tree_buf->header);
-		path->itemsnr[tree_buf->header.level] = tree_buf->header.nritems;
-		path->offsets[tree_buf->header.level] = loffset;
-		ret = bin_search(&tree_buf->node.ptrs[0],
+		ret = bin_search((void *)&tree_buf->node.ptrs[0],
 				 sizeof(struct btrfs_key_ptr),
 				 key, (cmp_func)btrfs_comp_keys,
-				 path->slots[tree_buf->header.level],
-				 tree_buf->header.nritems, &slot);
-		if (ret && slot > path->slots[tree_buf->header.level])
+				 path->slots[level], nritems, &slot);
+		if (ret && slot > path->slots[level])
 			slot--;
-		path->slots[tree_buf->header.level] = slot;
-		ret = search_tree(fs, tree_buf->node.ptrs[slot].blockptr,
+		path->slots[level] = slot;
+
+		/*
+		 * If this node is on the remembered path, remember the
+		 * child too, along with the keys it covers.
+		 */
+		last = &bfs->last[level];
+		child = &bfs->last[level - 1];
+		if (last->offset == loffset) {
+			last->itemsnr = nritems;
+			last->slot = slot;
+			child->offset = tree_buf->node.ptrs[slot].blockptr;
+			child->has_lo = slot ? true : last->has_lo;
+			child->lo = slot ? tree_buf->node.ptrs[slot].key : last->lo;
+			child->has_hi = slot + 1 < nritems ? true : last->has_hi;
+			child->hi = slot + 1 < nritems ?
+				tree_buf->node.ptrs[slot + 1].key : last->hi;
+		} else {
+			child->offset = 0;
+		}
+
+		ret = search_node(fs, tree_buf->node.ptrs[slot].blockptr,
 				  key, path);
 	} else {
 		/* leaf node */
-		cache_read(fs, (char *)&tree_buf->leaf.items[0],
-			   offset + sizeof tree_buf->header,
-			   bfs->sb.leafsize - sizeof tree_buf->header);
-		path->itemsnr[tree_buf->header.level] = tree_buf->header.nritems;
-		path->offsets[tree_buf->header.level] = loffset;
-		ret = bin_search(&tree_buf->leaf.items[0],
+		ret = bin_search((void *)&tree_buf->leaf.items[0],
 				 sizeof(struct btrfs_item),
 				 key, (cmp_func)btrfs_comp_keys,
-				 path->slots[0],
-				 tree_buf->header.nritems, &slot);
-		if (ret && slot > path->slots[tree_buf->header.level])
+				 path->slots[0], nritems, &slot);
+		if (ret && slot > path->slots[level])
 			slot--;
-		path->slots[tree_buf->header.level] = slot;
+		path->slots[level] = slot;
 		path->item = tree_buf->leaf.items[slot];
-		cache_read(fs, (char *)&path->data,
-			   offset + sizeof tree_buf->header +
-			   tree_buf->leaf.items[slot].offset,
-			   tree_buf->leaf.items[slot].size);
+		memcpy(path->data,
+		       (const char *)tree_buf + sizeof tree_buf->header +
+		       tree_buf->leaf.items[slot].offset,
+		       tree_buf->leaf.items[slot].size);
 	}
 	return ret;
 }
 
+static bool key_in_level(const struct btrfs_last_level *last,
+			 const struct btrfs_disk_key *key)
+{
+	if (!last->offset)
+		return false;
+	if (last->has_lo && btrfs_comp_keys(key, &last->lo) < 0)
+		return false;
+	if (last->has_hi && btrfs_comp_keys(key, &last->hi) >= 0)
+		return false;
+	return true;
+}
+
+/*
+ * Search the tree rooted at loffset for key, with a cleared path.
+ *
+ * Searches tend to follow each other closely - the inode item, then
+ * its extents, or one directory entry after another - so rather than
+ * start from the root every time, we pick up the path of the previous
+ * search at the lowest node that still covers the key.
+ */
+static int search_tree(struct fs_info *fs, u64 loffset,
+		       struct btrfs_disk_key *key, struct btrfs_path *path)
+{
+	struct btrfs_info * const bfs = fs->fs_info;
+	struct btrfs_last_level *last;
+	int level, start = -1;
+
+	if (bfs->last_root == loffset) {
+		for (level = bfs->last_top; level >= 0; level--) {
+			if (!key_in_level(&bfs->last[level], key))
+				break;
+			start = level;
+		}
+	}
+
+	if (start < 0) {
+		/* Start over from the root */
+		start = get_node(fs, loffset)->header.level;
+		if (start >= BTRFS_MAX_LEVEL)
+			return -1;
+		bfs->last_root = loffset;
+		bfs->last_top = start;
+		last = &bfs->last[start];
+		last->offset = loffset;
+		last->has_lo = last->has_hi = false;
+	}
+
+	/* The levels above are just as the last search left them */
+	for (level = bfs->last_top; level > start; level--) {
+		last = &bfs->last[level];
+		path->offsets[level] = last->offset;
+		path->itemsnr[level] = last->itemsnr;
+		path->slots[level] = last->slot;
+	}
+
+	return search_node(fs, bfs->last[start].offset, key, path);
+}
+
 /* return 0 if leaf found */
 static int next_leaf(struct fs_info *fs, struct btrfs_disk_key *key, struct btrfs_path *path)
 {
-	int slot;
+	int slot, i;
 	int level = 1;
 
 	while (level < BTRFS_MAX_LEVEL) {
@@ -299,8 +457,9 @@ static int next_leaf(struct fs_info *fs, struct btrfs_disk_key *key, struct btrf
 			continue;;
 		}
 		path->slots[level] = slot;
-		path->slots[level-1] = 0; /* reset low level slots info */
-		search_tree(fs, path->offsets[level], key, path);
+		for (i = 0; i < level; i++)
+			path->slots[i] = 0; /* reset low level slots info */
+		search_node(fs, path->offsets[level], key, path);
 		break;
 	}
 	if (level == BTRFS_MAX_LEVEL)
@@ -320,7 +479,7 @@ static int next_slot(struct fs_info *fs, struct btrfs_disk_key *key,
 	if (slot >= path->itemsnr[0])
 		return 1;
 	path->slots[0] = slot;
-	search_tree(fs, path->offsets[0], key, path);
+	search_node(fs, path->offsets[0], key, path);
 	return 0;
 }
 
@@ -454,8 +613,13 @@ static struct inode *btrfs_iget(const char *name, struct inode *parent)
 	struct btrfs_disk_key search_key;
 	struct btrfs_path path;
 	struct btrfs_dir_item dir_item;
+	const struct dentry *dc;
 	int ret;
 
+	dc = dcache_lookup(parent, name);
+	if (dc)
+		return btrfs_iget_by_inr(fs, dc->ino);
+
 	search_key.objectid = parent->ino;
 	search_key.type = BTRFS_DIR_ITEM_KEY;
 	search_key.offset = btrfs_name_hash(name, strlen(name));
@@ -465,6 +629,7 @@ static struct inode *btrfs_iget(const char *name, struct inode *parent)
 		return NULL;
 	dir_item = *(struct btrfs_dir_item *)path.data;
 
+	dcache_insert(parent, name, dir_item.location.objectid, NULL, 0);
 	return btrfs_iget_by_inr(fs, dir_item.location.objectid);
 }
 
@@ -516,39 +681,73 @@ static int btrfs_readdir(struct file *file, struct dirent *dirent)
 	return 0;
 }
 
+/*
+ * With the NO_HOLES feature, holes have no file extent item at all.
+ * Return where the hole at offset ends: at the next file extent of
+ * the inode, or at its size.  path is the result of the search for
+ * offset, and is left somewhere after it.
+ */
+static u64 btrfs_hole_end(struct fs_info *fs, struct inode *inode,
+			  struct btrfs_path *path, u64 offset)
+{
+	struct btrfs_disk_key key;
+	int cmp;
+
+	key.objectid = inode->ino;
+	key.type = BTRFS_EXTENT_DATA_KEY;
+	key.offset = 0;
+
+	for (;;) {
+		cmp = btrfs_comp_keys_type(&path->item.key, &key);
+		if (cmp > 0)
+			return inode->size;	/* no more extents */
+		if (!cmp && path->item.key.offset > offset)
+			return min(path->item.key.offset, inode->size);
+		if (next_slot(fs, &key, path) && next_leaf(fs, &key, path))
+			return inode->size;
+	}
+}
+
 static int btrfs_next_extent(struct inode *inode, uint32_t lstart)
 {
 	struct btrfs_disk_key search_key;
 	struct btrfs_file_extent_item extent_item;
 	struct btrfs_path path;
 	int ret;
-	u64 offset;
+	u64 offset, delta;
 	struct fs_info * const fs = inode->fs;
 	struct btrfs_info * const bfs = fs->fs_info;
 	u32 sec_shift = SECTOR_SHIFT(fs);
 	u32 sec_size = SECTOR_SIZE(fs);
+	u64 end;
 
 	search_key.objectid = inode->ino;
 	search_key.type = BTRFS_EXTENT_DATA_KEY;
 	search_key.offset = lstart << sec_shift;
 	clear_path(&path);
 	ret = search_tree(fs, bfs->fs_tree, &search_key, &path);
-	if (ret) { /* impossible */
+	if (ret < 0) {
 		printf("btrfs: search extent data error!\n");
 		return -1;
 	}
+	if (btrfs_comp_keys_type(&search_key, &path.item.key) ||
+	    path.item.key.offset > search_key.offset)
+		goto hole;
 	extent_item = *(struct btrfs_file_extent_item *)path.data;
 
 	if (extent_item.encryption) {
 	    printf("btrfs: found encrypted data, cannot continue!\n");
 	    return -1;
 	}
+	/* btrfs_getfssec() reads compressed extents itself */
 	if (extent_item.compression) {
-	    printf("btrfs: found compressed data, cannot continue!\n");
+	    printf("btrfs: unexpected compressed extent!\n");
 	    return -1;
 	}
 
 	if (extent_item.type == BTRFS_FILE_EXTENT_INLINE) {/* inline file */
+		if (search_key.offset >= extent_item.ram_bytes)
+			goto hole;
 		/* we fake a extent here, and PVT of inode will tell us */
 		offset = path.offsets[0] + sizeof(struct btrfs_header)
 			+ path.item.offset
@@ -556,13 +755,166 @@ static int btrfs_next_extent(struct inode *inode, uint32_t lstart)
 		inode->next_extent.len =
 			(inode->size + sec_size -1) >> sec_shift;
 	} else {
-		offset = extent_item.disk_bytenr + extent_item.offset;
+		/* lstart may fall in the middle of the extent */
+		delta = search_key.offset - path.item.key.offset;
+		if (delta >= extent_item.num_bytes)
+			goto hole;
+		offset = extent_item.disk_bytenr + extent_item.offset + delta;
 		inode->next_extent.len =
-			(extent_item.num_bytes + sec_size - 1) >> sec_shift;
+			(extent_item.num_bytes - delta + sec_size - 1) >> sec_shift;
+		if (!extent_item.disk_bytenr) {	/* hole */
+			inode->next_extent.pstart = EXTENT_ZERO;
+			return 0;
+		}
 	}
 	inode->next_extent.pstart = logical_physical(fs, offset) >> sec_shift;
 	PVT(inode)->offset = offset;
 	return 0;
+
+hole:
+	end = btrfs_hole_end(fs, inode, &path, search_key.offset);
+	if (end <= search_key.offset)
+		return -1;
+	inode->next_extent.pstart = EXTENT_ZERO;
+	inode->next_extent.len =
+		(end - search_key.offset + sec_size - 1) >> sec_shift;
+	return 0;
+}
+
+/*
+ * Decompress a compressed file extent into the extent cache.
+ */
+static int btrfs_read_compressed(struct fs_info *fs,
+				 const struct btrfs_path *path,
+				 const struct btrfs_file_extent_item *item)
+{
+	struct btrfs_info * const bfs = fs->fs_info;
+	struct btrfs_extent_cache * const ext = &bfs->ext;
+	const char *src;
+	size_t src_len;
+	u64 skip;
+	u32 t0, ms;
+	int len;
+
+	if (item->ram_bytes > BTRFS_MAX_COMPRESSED)
+		return -1;
+
+	if (!ext->zbuf)
+		ext->zbuf = malloc(BTRFS_MAX_COMPRESSED);
+	if (!ext->zbuf)
+		return -1;
+
+	if (item->type == BTRFS_FILE_EXTENT_INLINE) {
+		/* The compressed data starts where disk_bytenr would be */
+		if (path->item.size <=
+		    offsetof(struct btrfs_file_extent_item, disk_bytenr))
+			return -1;
+		src = (const char *)path->data +
+			offsetof(struct btrfs_file_extent_item, disk_bytenr);
+		src_len = path->item.size -
+			offsetof(struct btrfs_file_extent_item, disk_bytenr);
+		skip = 0;
+	} else {
+		if (item->disk_num_bytes > BTRFS_MAX_COMPRESSED ||
+		    item->offset + item->num_bytes > item->ram_bytes)
+			return -1;
+		if (!bfs->cbuf)
+			bfs->cbuf = malloc(BTRFS_MAX_COMPRESSED);
+		if (!bfs->cbuf)
+			return -1;
+		if (cache_read(fs, bfs->cbuf,
+			       logical_physical(fs, item->disk_bytenr),
+			       item->disk_num_bytes) != item->disk_num_bytes) {
+			printf("btrfs: can't read compressed extent!\n");
+			return -1;
+		}
+		src = bfs->cbuf;
+		src_len = item->disk_num_bytes;
+		skip = item->offset;
+	}
+
+	t0 = ms_timer();
+	len = btrfs_decompress(item->compression, ext->zbuf, item->ram_bytes,
+			       src, src_len);
+	if (len < 0) {
+		printf("btrfs: corrupt compressed extent!\n");
+		return -1;
+	}
+	/* The stream may stop short of a trailing run of zeroes */
+	memset(ext->zbuf + len, 0, item->ram_bytes - len);
+
+	ms = ms_timer() - t0;
+	bfs->zin += src_len;
+	bfs->zout += item->ram_bytes;
+	bfs->zms += ms;
+	dprintf("btrfs: %u -> %llu bytes (%llu%%), total %llu -> %llu in %u ms"
+		" (%u KiB/s)\n", (unsigned)src_len, item->ram_bytes,
+		item->ram_bytes * 100 / (src_len ? src_len : 1),
+		bfs->zin, bfs->zout, bfs->zms,
+		bfs->zms ? (u32)((bfs->zout >> 10) * 1000 / bfs->zms) : 0);
+
+	ext->compression = item->compression;
+	ext->skip = skip;
+	return 0;
+}
+
+/*
+ * Find the file extent covering the current position and remember it
+ * in the extent cache, decompressing it if need be.
+ */
+static int btrfs_lookup_extent(struct file *file)
+{
+	struct fs_info * const fs = file->fs;
+	struct btrfs_info * const bfs = fs->fs_info;
+	struct btrfs_extent_cache * const ext = &bfs->ext;
+	struct inode * const inode = file->inode;
+	struct btrfs_disk_key search_key;
+	struct btrfs_file_extent_item item;
+	struct btrfs_path path;
+	u64 len;
+
+	if (ext->ino == inode->ino &&
+	    file->offset >= ext->start && file->offset < ext->end)
+		return 0;
+
+	ext->ino = 0;
+	search_key.objectid = inode->ino;
+	search_key.type = BTRFS_EXTENT_DATA_KEY;
+	search_key.offset = file->offset;
+	clear_path(&path);
+	if (search_tree(fs, bfs->fs_tree, &search_key, &path) < 0)
+		return -1;
+	if (btrfs_comp_keys_type(&search_key, &path.item.key) ||
+	    path.item.key.offset > file->offset)
+		goto hole;
+	item = *(struct btrfs_file_extent_item *)path.data;
+
+	if (item.type == BTRFS_FILE_EXTENT_INLINE)
+		len = item.ram_bytes;
+	else
+		len = item.num_bytes;
+	if (file->offset >= path.item.key.offset + len)
+		goto hole;
+
+	if (item.compression && btrfs_read_compressed(fs, &path, &item))
+		return -1;
+
+	ext->ino = inode->ino;
+	ext->start = path.item.key.offset;
+	ext->end = path.item.key.offset + len;
+	ext->compression = item.compression;
+	return 0;
+
+hole:
+	/* An implicit hole; btrfs_next_extent() maps it to zeroes */
+	len = btrfs_hole_end(fs, inode, &path, file->offset);
+	if (len <= file->offset)
+		return -1;
+	ext->ino = inode->ino;
+	ext->start = file->offset;
+	ext->end = len;
+	ext->compression = BTRFS_COMPRESS_NONE;
+	return 0;
 }
 
 static uint32_t btrfs_getfssec(struct file *file, char *buf, int sectors,
@@ -570,8 +922,35 @@ static uint32_t btrfs_getfssec(struct file *file, char *buf, int sectors,
 {
 	u32 ret;
 	struct fs_info *fs = file->fs;
-	u32 off = PVT(file->inode)->offset % SECTOR_SIZE(fs);
+	struct btrfs_extent_cache * const ext =
+		&((struct btrfs_info *)fs->fs_info)->ext;
+	struct inode * const inode = file->inode;
+	u32 off = PVT(inode)->offset % SECTOR_SIZE(fs);
 	bool handle_inline = false;
+	u64 left;
+
+	if (file->offset >= inode->size)
+		return 0;
+	if (btrfs_lookup_extent(file))
+		return 0;
+
+	if (ext->compression) {
+		/* Copy out of the decompressed extent */
+		left = min(ext->end, inode->size) - file->offset;
+		ret = min(left, (u64)sectors << SECTOR_SHIFT(fs));
+		memcpy(buf, ext->zbuf + ext->skip + (file->offset - ext->start),
+		       ret);
+		file->offset += ret;
+		if (have_more)
+			*have_more = file->offset < inode->size;
+		return ret;
+	}
+
+	/* Don't let generic_getfssec() run on into a compressed extent */
+	left = (ext->end - file->offset + SECTOR_SIZE(fs) - 1)
+		>> SECTOR_SHIFT(fs);
+	if (sectors > left && ext->end < inode->size)
+		sectors = left;
 
 	if (off && !file->offset) {/* inline file first read patch */
 		file->inode->size += off;
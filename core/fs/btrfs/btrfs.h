@@ -53,6 +53,14 @@ typedef u64 __le64;
 #define BTRFS_FILE_EXTENT_REG 1
 #define BTRFS_FILE_EXTENT_PREALLOC 2
 
+#define BTRFS_COMPRESS_NONE 0
+#define BTRFS_COMPRESS_ZLIB 1
+#define BTRFS_COMPRESS_LZO  2
+#define BTRFS_COMPRESS_ZSTD 3
+
+/* largest compressed extent, before and after compression */
+#define BTRFS_MAX_COMPRESSED (128 << 10)
+
 #define BTRFS_MAX_LEVEL 8
 #define BTRFS_MAX_CHUNK_ENTRIES 256
 
@@ -292,4 +300,7 @@ struct btrfs_pvt_inode {
 
 #define PVT(i) ((struct btrfs_pvt_inode *)((i)->pvt))
 
+int btrfs_decompress(int type, void *dst, size_t dst_len,
+		     const void *src, size_t src_len);
+
 #endif
@@ -0,0 +1,133 @@
+/*
+ * compress.c -- decompression of compressed btrfs extents
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, Inc., 53 Temple Place Ste 330,
+ * Boston MA 02111-1307, USA; either version 2 of the License, or
+ * (at your option) any later version; incorporated herein by reference.
+ */
+
+#include <dprintf.h>
+#include <stdio.h>
+#include <string.h>
+#include <minmax.h>
+#include <zlib.h>
+#include <klibc/compiler.h>
+#include <fs.h>
+#include "btrfs.h"
+#include "zstd.h"
+
+static int btrfs_inflate(void *dst, size_t dst_len,
+			 const void *src, size_t src_len)
+{
+	z_stream zs;
+	int ret;
+
+	memset(&zs, 0, sizeof zs);
+	zs.next_in = (Bytef *)src;
+	zs.avail_in = src_len;
+	zs.next_out = dst;
+	zs.avail_out = dst_len;
+
+	if (inflateInit(&zs) != Z_OK)
+		return -1;
+	ret = inflate(&zs, Z_FINISH);
+	inflateEnd(&zs);
+
+	/* A full output buffer is fine, the extent may be partially used */
+	if (ret != Z_STREAM_END && (ret != Z_BUF_ERROR || zs.avail_out))
+		return -1;
+	return dst_len - zs.avail_out;
+}
+
+#ifdef __FIRMWARE_BIOS__
+
+/* core/lzo/lzo1x_f2.S, also used to unpack the core itself */
+extern int __cdecl lzo1x_decompress_asm_fast_safe(const void *src,
+						  unsigned int src_len,
+						  void *dst,
+						  unsigned int *dst_len,
+						  void *wrkmem)
+	__asm__("_lzo1x_decompress_asm_fast_safe");
+
+#define LZO_LEN		4
+#define LZO_PAGE	4096
+
+/*
+ * btrfs LZO extents are a 32-bit total length followed by segments,
+ * each a 32-bit length and LZO1X data expanding to at most one page.
+ * A segment header never straddles a page boundary; if it would, it
+ * starts on the next page instead.
+ */
+static int btrfs_unlzo(void *dst, size_t dst_len,
+		       const void *src, size_t src_len)
+{
+	const char *in = src;
+	size_t total, pos, out = 0;
+	unsigned int seg_len, out_len;
+
+	if (src_len < LZO_LEN)
+		return -1;
+	total = *(const uint32_t *)in;
+	if (total > src_len)
+		return -1;
+
+	pos = LZO_LEN;
+	while (pos < total && out < dst_len) {
+		if (LZO_PAGE - pos % LZO_PAGE < LZO_LEN)
+			pos += LZO_PAGE - pos % LZO_PAGE;
+		if (pos + LZO_LEN > total)
+			return -1;
+		seg_len = *(const uint32_t *)(in + pos);
+		pos += LZO_LEN;
+		if (seg_len > total - pos)
+			return -1;
+
+		out_len = min(dst_len - out, LZO_PAGE);
+		if (lzo1x_decompress_asm_fast_safe(in + pos, seg_len,
+						   (char *)dst + out,
+						   &out_len, NULL))
+			return -1;
+		out += out_len;
+		pos += seg_len;
+	}
+
+	return out;
+}
+
+#else
+
+static int btrfs_unlzo(void *dst, size_t dst_len,
+		       const void *src, size_t src_len)
+{
+	(void)dst;
+	(void)dst_len;
+	(void)src;
+	(void)src_len;
+
+	printf("btrfs: LZO is not supported on this platform\n");
+	return -1;
+}
+
+#endif
+
+/*
+ * Decompress one extent into dst.  Returns the number of bytes
+ * produced, or -1.
+ */
+int btrfs_decompress(int type, void *dst, size_t dst_len,
+		     const void *src, size_t src_len)
+{
+	switch (type) {
+	case BTRFS_COMPRESS_ZLIB:
+		return btrfs_inflate(dst, dst_len, src, src_len);
+	case BTRFS_COMPRESS_LZO:
+		return btrfs_unlzo(dst, dst_len, src, src_len);
+	case BTRFS_COMPRESS_ZSTD:
+		return zstd_decompress(dst, dst_len, src, src_len);
+	default:
+		printf("btrfs: unknown compression type %d\n", type);
+		return -1;
+	}
+}
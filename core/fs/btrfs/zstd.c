@@ -0,0 +1,842 @@
+/*
+ * zstd.c -- a small Zstandard (RFC 8878) decompressor
+ *
+ * Decodes complete frames from one buffer into another, which is all
+ * btrfs needs: each compressed extent is a single frame of at most
+ * 128 KiB.  Dictionaries are not supported, and the optional content
+ * checksum is not verified.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, Inc., 53 Temple Place Ste 330,
+ * Boston MA 02111-1307, USA; either version 2 of the License, or
+ * (at your option) any later version; incorporated herein by reference.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "zstd.h"
+
+#define ZSTD_MAGIC		0xfd2fb528
+#define ZSTD_SKIPPABLE_MAGIC	0x184d2a50	/* low 4 bits are free */
+#define ZSTD_BLOCK_MAX		(128 << 10)
+
+#define HUF_MAX_BITS		11
+#define HUF_MAX_SYMBOLS		256
+
+#define LL_MAX_LOG		9
+#define ML_MAX_LOG		9
+#define OF_MAX_LOG		8
+#define LL_MAX_SYMBOL		35
+#define ML_MAX_SYMBOL		52
+#define OF_MAX_SYMBOL		31
+
+struct fse_entry {
+    uint16_t base;		/* Next state, before adding the bits read */
+    uint8_t symbol;
+    uint8_t bits;
+};
+
+struct fse_table {
+    int log;
+    struct fse_entry e[1 << LL_MAX_LOG];	/* The largest of the three */
+};
+
+struct huf_entry {
+    uint8_t symbol;
+    uint8_t bits;
+};
+
+struct zstd_ctx {
+    const uint8_t *src;		/* Input, and how far we got */
+    size_t src_len;
+    size_t ip;
+    uint8_t *dst;		/* Output of the current frame */
+    size_t dst_len;
+    size_t op;
+
+    uint32_t rep[3];		/* Repeat offsets */
+
+    int huf_log;		/* 0 if there is no table yet */
+    struct huf_entry huf[1 << HUF_MAX_BITS];
+    struct fse_table ll, ml, of;
+    int have_seq_tables;
+    struct fse_table weights;	/* For Huffman weights */
+
+    uint8_t *lit;		/* Literals of the current block */
+    size_t lit_len;
+    uint8_t lit_buf[ZSTD_BLOCK_MAX];
+};
+
+static int highbit(uint32_t v)
+{
+    int n = -1;
+
+    while (v) {
+	v >>= 1;
+	n++;
+    }
+    return n;
+}
+
+static inline uint32_t get_le(const uint8_t *p, int bytes)
+{
+    uint32_t v = 0;
+
+    while (bytes--)
+	v = (v << 8) | p[bytes];
+    return v;
+}
+
+/*
+ * Read n bits (n <= 56) starting at bit pos of a little-endian stream.
+ * Bits outside the stream read as zero.
+ */
+static uint64_t bits_at(const uint8_t *src, size_t len, int64_t pos, int n)
+{
+    uint64_t v = 0;
+    int shift = 0;
+    size_t byte;
+    int i;
+
+    if (pos < 0) {
+	n += pos;
+	shift = -pos;
+	pos = 0;
+    }
+    if (n <= 0)
+	return 0;
+
+    byte = pos >> 3;
+    for (i = 0; i < 8 && byte + i < len; i++)
+	v |= (uint64_t)src[byte + i] << (i * 8);
+    v = (v >> (pos & 7)) & (((uint64_t)1 << n) - 1);
+    return v << shift;
+}
+
+/*
+ * Backward bit stream, as used by the entropy coded parts: read from
+ * the end towards the beginning, starting just below the highest set
+ * bit of the last byte.
+ */
+struct bitstream {
+    const uint8_t *src;
+    size_t len;
+    int64_t pos;		/* Bits left; negative once overread */
+};
+
+static int bs_init(struct bitstream *bs, const uint8_t *src, size_t len)
+{
+    if (!len || !src[len - 1])
+	return -1;
+
+    bs->src = src;
+    bs->len = len;
+    bs->pos = (int64_t)(len - 1) * 8 + highbit(src[len - 1]);
+    return 0;
+}
+
+static inline uint32_t bs_read(struct bitstream *bs, int n)
+{
+    if (!n)
+	return 0;
+    bs->pos -= n;
+    return bits_at(bs->src, bs->len, bs->pos, n);
+}
+
+static inline uint32_t bs_peek(struct bitstream *bs, int n)
+{
+    return bits_at(bs->src, bs->len, bs->pos - n, n);
+}
+
+/*
+ * Build an FSE decoding table from the normalized symbol counts
+ */
+static int fse_build(struct fse_table *t, const int16_t *norm, int nsym,
+		     int log)
+{
+    uint16_t next[LL_MAX_SYMBOL + ML_MAX_SYMBOL];	/* Big enough */
+    int size = 1 << log;
+    int high = size - 1;
+    int step = (size >> 1) + (size >> 3) + 3;
+    int pos = 0;
+    int s, i, n;
+
+    t->log = log;
+
+    /* "Less than one" probabilities go at the end of the table */
+    for (s = 0; s < nsym; s++) {
+	if (norm[s] == -1) {
+	    t->e[high--].symbol = s;
+	    next[s] = 1;
+	} else {
+	    next[s] = norm[s];
+	}
+    }
+
+    /* Spread the others over the rest of it */
+    for (s = 0; s < nsym; s++) {
+	for (i = 0; i < norm[s]; i++) {
+	    t->e[pos].symbol = s;
+	    do {
+		pos = (pos + step) & (size - 1);
+	    } while (pos > high);
+	}
+    }
+    if (pos)
+	return -1;		/* The counts didn't add up */
+
+    for (i = 0; i < size; i++) {
+	s = t->e[i].symbol;
+	n = next[s]++;
+	t->e[i].bits = log - highbit(n);
+	t->e[i].base = (n << t->e[i].bits) - size;
+    }
+
+    return 0;
+}
+
+/*
+ * Read an FSE table description (the normalized symbol counts) from
+ * the forward stream at src, and build the decoding table.  Returns
+ * the number of bytes used, or -1.
+ */
+static int fse_read(struct fse_table *t, const uint8_t *src, size_t len,
+		    int max_log, int max_sym)
+{
+    int16_t norm[LL_MAX_SYMBOL + ML_MAX_SYMBOL];
+    int64_t pos = 4;
+    int log, remaining, threshold, bits, max, sym = 0;
+    int count, flag, i;
+    uint32_t v;
+
+    if (!len)
+	return -1;
+
+    log = (src[0] & 15) + 5;
+    if (log > max_log)
+	return -1;
+
+    remaining = (1 << log) + 1;
+    threshold = 1 << log;
+    bits = log + 1;
+
+    while (remaining > 1) {
+	if (sym > max_sym)
+	    return -1;
+
+	v = bits_at(src, len, pos, bits);
+	max = (2 * threshold - 1) - remaining;
+	if ((int)(v & (threshold - 1)) < max) {
+	    count = v & (threshold - 1);
+	    pos += bits - 1;
+	} else {
+	    count = v & (2 * threshold - 1);
+	    if (count >= threshold)
+		count -= max;
+	    pos += bits;
+	}
+	count--;		/* -1 is "less than one" */
+	remaining -= count < 0 ? -count : count;
+	norm[sym++] = count;
+
+	if (!count) {
+	    /* Runs of zero probabilities */
+	    do {
+		flag = bits_at(src, len, pos, 2);
+		pos += 2;
+		for (i = 0; i < flag; i++) {
+		    if (sym > max_sym)
+			return -1;
+		    norm[sym++] = 0;
+		}
+	    } while (flag == 3);
+	}
+
+	while (remaining < threshold) {
+	    bits--;
+	    threshold >>= 1;
+	}
+    }
+
+    if (remaining != 1 || (pos + 7) >> 3 > (int64_t)len)
+	return -1;
+    if (fse_build(t, norm, sym, log))
+	return -1;
+
+    return (pos + 7) >> 3;
+}
+
+static void fse_rle(struct fse_table *t, uint8_t symbol)
+{
+    t->log = 0;
+    t->e[0].symbol = symbol;
+    t->e[0].bits = 0;
+    t->e[0].base = 0;
+}
+
+static const int16_t ll_default[LL_MAX_SYMBOL + 1] = {
+    4, 3, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 1, 1, 1,
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 3, 2, 1, 1, 1, 1, 1,
+    -1, -1, -1, -1
+};
+
+static const int16_t ml_default[ML_MAX_SYMBOL + 1] = {
+    1, 4, 3, 2, 2, 2, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, -1, -1,
+    -1, -1, -1, -1, -1
+};
+
+static const int16_t of_default[OF_MAX_SYMBOL - 2] = {
+    1, 1, 1, 1, 1, 1, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, -1, -1, -1, -1, -1
+};
+
+/* Literal and match length codes: baseline and number of extra bits */
+static const uint32_t ll_base[LL_MAX_SYMBOL + 1] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+    16, 18, 20, 22, 24, 28, 32, 40, 48, 64, 128, 256, 512, 1024, 2048, 4096,
+    8192, 16384, 32768, 65536
+};
+
+static const uint8_t ll_bits[LL_MAX_SYMBOL + 1] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    1, 1, 1, 1, 2, 2, 3, 3, 4, 6, 7, 8, 9, 10, 11, 12,
+    13, 14, 15, 16
+};
+
+static const uint32_t ml_base[ML_MAX_SYMBOL + 1] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18,
+    19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32, 33, 34,
+    35, 37, 39, 41, 43, 47, 51, 59, 67, 83, 99, 131, 259, 515, 1027, 2051,
+    4099, 8195, 16387, 32771, 65539
+};
+
+static const uint8_t ml_bits[ML_MAX_SYMBOL + 1] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    1, 1, 1, 1, 2, 2, 3, 3, 4, 4, 5, 7, 8, 9, 10, 11,
+    12, 13, 14, 15, 16
+};
+
+/*
+ * Read a Huffman tree description and build the decoding table.
+ * Returns the number of bytes used, or -1.
+ */
+static int huf_read(struct zstd_ctx *z, const uint8_t *src, size_t len)
+{
+    uint8_t weight[HUF_MAX_SYMBOLS];
+    uint32_t rank[HUF_MAX_BITS + 2];
+    uint32_t total, rest, pos;
+    int n, used, i, w, log, size;
+
+    if (!len)
+	return -1;
+
+    if (src[0] < 128) {
+	/* FSE compressed weights, decoded with two interleaved states */
+	struct fse_table *t = &z->weights;
+	struct bitstream bs;
+	uint32_t s1, s2;
+	int hlen = src[0];
+
+	if (hlen + 1 > (int)len)
+	    return -1;
+	used = fse_read(t, src + 1, hlen, 6, HUF_MAX_BITS + 1);
+	if (used < 0 || bs_init(&bs, src + 1 + used, hlen - used))
+	    return -1;
+
+	s1 = bs_read(&bs, t->log);
+	s2 = bs_read(&bs, t->log);
+	n = 0;
+	while (1) {
+	    if (n + 2 > HUF_MAX_SYMBOLS - 1)
+		return -1;
+	    weight[n++] = t->e[s1].symbol;
+	    s1 = t->e[s1].base + bs_read(&bs, t->e[s1].bits);
+	    if (bs.pos < 0) {
+		weight[n++] = t->e[s2].symbol;
+		break;
+	    }
+	    weight[n++] = t->e[s2].symbol;
+	    s2 = t->e[s2].base + bs_read(&bs, t->e[s2].bits);
+	    if (bs.pos < 0) {
+		weight[n++] = t->e[s1].symbol;
+		break;
+	    }
+	}
+	used = 1 + hlen;
+    } else {
+	/* Direct representation, 4 bits each */
+	n = src[0] - 127;
+	used = 1 + (n + 1) / 2;
+	if (used > (int)len)
+	    return -1;
+	for (i = 0; i < n; i++) {
+	    w = src[1 + i / 2];
+	    weight[i] = (i & 1) ? w & 15 : w >> 4;
+	}
+    }
+
+    /* The weight of the last symbol is implied */
+    total = 0;
+    for (i = 0; i < n; i++) {
+	if (weight[i] > HUF_MAX_BITS)
+	    return -1;
+	if (weight[i])
+	    total += 1 << (weight[i] - 1);
+    }
+    if (!total)
+	return -1;
+    log = highbit(total) + 1;
+    if (log > HUF_MAX_BITS)
+	return -1;
+    rest = (1 << log) - total;
+    if (rest & (rest - 1))
+	return -1;
+    weight[n++] = highbit(rest) + 1;
+
+    /* Lower weights (longer codes) come first in the table */
+    memset(rank, 0, sizeof rank);
+    for (i = 0; i < n; i++)
+	rank[weight[i]]++;
+    pos = 0;
+    for (w = 1; w <= log; w++) {
+	uint32_t count = rank[w];
+	rank[w] = pos;
+	pos += count << (w - 1);
+    }
+
+    for (i = 0; i < n; i++) {
+	w = weight[i];
+	if (!w)
+	    continue;
+	size = 1 << (w - 1);
+	while (size--) {
+	    z->huf[rank[w]].symbol = i;
+	    z->huf[rank[w]].bits = log + 1 - w;
+	    rank[w]++;
+	}
+    }
+
+    z->huf_log = log;
+    return used;
+}
+
+static int huf_stream(struct zstd_ctx *z, uint8_t *out, size_t count,
+		      const uint8_t *src, size_t len)
+{
+    struct bitstream bs;
+    const struct huf_entry *e;
+
+    if (bs_init(&bs, src, len))
+	return -1;
+
+    while (count--) {
+	e = &z->huf[bs_peek(&bs, z->huf_log)];
+	*out++ = e->symbol;
+	bs.pos -= e->bits;
+    }
+
+    return bs.pos == 0 ? 0 : -1;
+}
+
+/*
+ * Decode the literals section of a compressed block.  Returns the
+ * number of bytes used, or -1.
+ */
+static int zstd_literals(struct zstd_ctx *z, const uint8_t *src, size_t len)
+{
+    int type, format, hsize, used;
+    uint32_t regen, csize, h;
+    size_t seg, total;
+
+    if (!len)
+	return -1;
+
+    type = src[0] & 3;
+    format = (src[0] >> 2) & 3;
+
+    if (type < 2) {
+	/* Raw or RLE */
+	switch (format) {
+	case 1:
+	    hsize = 2;
+	    break;
+	case 3:
+	    hsize = 3;
+	    break;
+	default:
+	    hsize = 1;
+	    break;
+	}
+	if ((size_t)hsize > len)
+	    return -1;
+	regen = get_le(src, hsize) >> (hsize == 1 ? 3 : 4);
+	if (regen > ZSTD_BLOCK_MAX)
+	    return -1;
+
+	z->lit_len = regen;
+	if (type == 0) {
+	    if (hsize + regen > len)
+		return -1;
+	    /* Use the literals where they are */
+	    z->lit = (uint8_t *)src + hsize;
+	    return hsize + regen;
+	} else {
+	    if ((size_t)hsize + 1 > len)
+		return -1;
+	    memset(z->lit_buf, src[hsize], regen);
+	    z->lit = z->lit_buf;
+	    return hsize + 1;
+	}
+    }
+
+    /* Huffman coded, with a new tree or the previous one */
+    hsize = format < 2 ? 3 : format + 2;
+    if ((size_t)hsize > len)
+	return -1;
+    h = get_le(src, hsize > 4 ? 4 : hsize);
+    switch (format) {
+    case 0:
+    case 1:
+	regen = (h >> 4) & 0x3ff;
+	csize = (h >> 14) & 0x3ff;
+	break;
+    case 2:
+	regen = (h >> 4) & 0x3fff;
+	csize = h >> 18;
+	break;
+    default:
+	regen = (h >> 4) & 0x3ffff;
+	csize = (h >> 22) | ((uint32_t)src[4] << 10);
+	break;
+    }
+    total = hsize + csize;
+    if (regen > ZSTD_BLOCK_MAX || total > len)
+	return -1;
+
+    src += hsize;
+    if (type == 2) {
+	used = huf_read(z, src, csize);
+	if (used < 0)
+	    return -1;
+	src += used;
+	csize -= used;
+    } else if (!z->huf_log) {
+	return -1;
+    }
+
+    z->lit = z->lit_buf;
+    z->lit_len = regen;
+
+    if (format == 0) {
+	if (huf_stream(z, z->lit_buf, regen, src, csize))
+	    return -1;
+    } else {
+	/* Four streams, preceded by a jump table of the first three sizes */
+	size_t size[4], off = 6;
+	int i;
+
+	if (csize < 6)
+	    return -1;
+	size[0] = get_le(src, 2);
+	size[1] = get_le(src + 2, 2);
+	size[2] = get_le(src + 4, 2);
+	if (size[0] + size[1] + size[2] + 6 > csize)
+	    return -1;
+	size[3] = csize - 6 - size[0] - size[1] - size[2];
+
+	seg = (regen + 3) / 4;
+	if (seg * 3 > regen)
+	    return -1;
+	for (i = 0; i < 4; i++) {
+	    size_t count = i < 3 ? seg : regen - 3 * seg;
+
+	    if (huf_stream(z, z->lit_buf + i * seg, count, src + off, size[i]))
+		return -1;
+	    off += size[i];
+	}
+    }
+
+    return total;
+}
+
+/*
+ * Set up one of the three sequence decoding tables according to its
+ * mode.  Returns the number of bytes used, or -1.
+ */
+static int zstd_seq_table(struct zstd_ctx *z, struct fse_table *t, int mode,
+			  const int16_t *def, int def_nsym, int def_log,
+			  int max_log, int max_sym,
+			  const uint8_t *src, size_t len)
+{
+    switch (mode) {
+    case 0:			/* Predefined */
+	return fse_build(t, def, def_nsym, def_log);
+    case 1:			/* RLE */
+	if (!len || src[0] > max_sym)
+	    return -1;
+	fse_rle(t, src[0]);
+	return 1;
+    case 2:			/* FSE compressed */
+	return fse_read(t, src, len, max_log, max_sym);
+    default:			/* Repeat */
+	return z->have_seq_tables ? 0 : -1;
+    }
+}
+
+static int zstd_sequences(struct zstd_ctx *z, const uint8_t *src, size_t len)
+{
+    struct bitstream bs;
+    uint32_t nseq, ll_state, ml_state, of_state;
+    uint32_t ll, ml, of, offset;
+    const uint8_t *lit = z->lit, *lit_end = z->lit + z->lit_len;
+    size_t ip = 0;
+    int used, modes, code;
+
+    if (!len)
+	return -1;
+
+    nseq = src[ip++];
+    if (nseq >= 128) {
+	if (nseq == 255) {
+	    if (ip + 2 > len)
+		return -1;
+	    nseq = get_le(src + ip, 2) + 0x7f00;
+	    ip += 2;
+	} else {
+	    if (ip + 1 > len)
+		return -1;
+	    nseq = ((nseq - 128) << 8) + src[ip++];
+	}
+    }
+
+    if (nseq) {
+	if (ip + 1 > len)
+	    return -1;
+	modes = src[ip++];
+
+	used = zstd_seq_table(z, &z->ll, modes >> 6, ll_default,
+			      LL_MAX_SYMBOL + 1, 6, LL_MAX_LOG, LL_MAX_SYMBOL,
+			      src + ip, len - ip);
+	if (used < 0)
+	    return -1;
+	ip += used;
+	used = zstd_seq_table(z, &z->of, (modes >> 4) & 3, of_default,
+			      OF_MAX_SYMBOL - 2, 5, OF_MAX_LOG, OF_MAX_SYMBOL,
+			      src + ip, len - ip);
+	if (used < 0)
+	    return -1;
+	ip += used;
+	used = zstd_seq_table(z, &z->ml, (modes >> 2) & 3, ml_default,
+			      ML_MAX_SYMBOL + 1, 6, ML_MAX_LOG, ML_MAX_SYMBOL,
+			      src + ip, len - ip);
+	if (used < 0)
+	    return -1;
+	ip += used;
+	z->have_seq_tables = 1;
+
+	if (bs_init(&bs, src + ip, len - ip))
+	    return -1;
+	ll_state = bs_read(&bs, z->ll.log);
+	of_state = bs_read(&bs, z->of.log);
+	ml_state = bs_read(&bs, z->ml.log);
+
+	while (nseq--) {
+	    code = z->of.e[of_state].symbol;
+	    of = ((uint32_t)1 << code) + bs_read(&bs, code);
+	    code = z->ml.e[ml_state].symbol;
+	    ml = ml_base[code] + bs_read(&bs, ml_bits[code]);
+	    code = z->ll.e[ll_state].symbol;
+	    ll = ll_base[code] + bs_read(&bs, ll_bits[code]);
+
+	    /* Offsets 1-3 refer to the repeat offsets */
+	    if (of > 3) {
+		offset = of - 3;
+		z->rep[2] = z->rep[1];
+		z->rep[1] = z->rep[0];
+		z->rep[0] = offset;
+	    } else {
+		if (!ll)
+		    of++;
+		if (of == 1) {
+		    offset = z->rep[0];
+		} else {
+		    offset = of == 4 ? z->rep[0] - 1 : z->rep[of - 1];
+		    if (of != 2)
+			z->rep[2] = z->rep[1];
+		    z->rep[1] = z->rep[0];
+		    z->rep[0] = offset;
+		}
+	    }
+
+	    if (nseq) {
+		ll_state = z->ll.e[ll_state].base +
+		    bs_read(&bs, z->ll.e[ll_state].bits);
+		ml_state = z->ml.e[ml_state].base +
+		    bs_read(&bs, z->ml.e[ml_state].bits);
+		of_state = z->of.e[of_state].base +
+		    bs_read(&bs, z->of.e[of_state].bits);
+	    }
+
+	    /* Execute the sequence */
+	    if (ll > (size_t)(lit_end - lit) ||
+		ll + ml > z->dst_len - z->op ||
+		!offset || offset > z->op + ll)
+		return -1;
+
+	    memcpy(z->dst + z->op, lit, ll);
+	    lit += ll;
+	    z->op += ll;
+
+	    if (offset >= ml) {
+		memcpy(z->dst + z->op, z->dst + z->op - offset, ml);
+		z->op += ml;
+	    } else {
+		/* Overlapping match, copy a byte at a time */
+		while (ml--) {
+		    z->dst[z->op] = z->dst[z->op - offset];
+		    z->op++;
+		}
+	    }
+	}
+
+	if (bs.pos != 0)
+	    return -1;
+    }
+
+    /* Whatever literals are left */
+    ll = lit_end - lit;
+    if (ll > z->dst_len - z->op)
+	return -1;
+    memcpy(z->dst + z->op, lit, ll);
+    z->op += ll;
+
+    return 0;
+}
+
+static int zstd_frame(struct zstd_ctx *z)
+{
+    const uint8_t *src = z->src;
+    uint32_t magic, bh, bsize;
+    int fhd, fcs_size, did_size, single, last, used;
+
+    if (z->ip + 4 > z->src_len)
+	return -1;
+    magic = get_le(src + z->ip, 4);
+    z->ip += 4;
+
+    if ((magic & ~15) == ZSTD_SKIPPABLE_MAGIC) {
+	if (z->ip + 4 > z->src_len)
+	    return -1;
+	bsize = get_le(src + z->ip, 4);
+	if (bsize > z->src_len - z->ip - 4)
+	    return -1;
+	z->ip += 4 + bsize;
+	return 0;
+    }
+    if (magic != ZSTD_MAGIC)
+	return -1;
+
+    /* Frame header: we only need to know its size */
+    if (z->ip + 1 > z->src_len)
+	return -1;
+    fhd = src[z->ip++];
+    single = (fhd >> 5) & 1;
+    did_size = (fhd & 3) == 3 ? 4 : fhd & 3;
+    fcs_size = (fhd >> 6) ? 1 << (fhd >> 6) : single;
+    if (fhd & 8)
+	return -1;		/* Reserved bit */
+    z->ip += !single + did_size + fcs_size;
+    if (z->ip > z->src_len)
+	return -1;
+    if (did_size && get_le(src + z->ip - fcs_size - did_size, did_size))
+	return -1;		/* Needs a dictionary */
+
+    z->rep[0] = 1;
+    z->rep[1] = 4;
+    z->rep[2] = 8;
+    z->huf_log = 0;
+    z->have_seq_tables = 0;
+
+    do {
+	if (z->ip + 3 > z->src_len)
+	    return -1;
+	bh = get_le(src + z->ip, 3);
+	z->ip += 3;
+	last = bh & 1;
+	bsize = bh >> 3;
+
+	switch ((bh >> 1) & 3) {
+	case 0:			/* Raw */
+	    if (bsize > z->src_len - z->ip || bsize > z->dst_len - z->op)
+		return -1;
+	    memcpy(z->dst + z->op, src + z->ip, bsize);
+	    z->op += bsize;
+	    z->ip += bsize;
+	    break;
+	case 1:			/* RLE */
+	    if (z->ip + 1 > z->src_len || bsize > z->dst_len - z->op)
+		return -1;
+	    memset(z->dst + z->op, src[z->ip], bsize);
+	    z->op += bsize;
+	    z->ip++;
+	    break;
+	case 2:			/* Compressed */
+	    if (bsize > z->src_len - z->ip || bsize > ZSTD_BLOCK_MAX)
+		return -1;
+	    used = zstd_literals(z, src + z->ip, bsize);
+	    if (used < 0 ||
+		zstd_sequences(z, src + z->ip + used, bsize - used))
+		return -1;
+	    z->ip += bsize;
+	    break;
+	default:
+	    return -1;
+	}
+    } while (!last);
+
+    /* Content checksum, not checked */
+    if (fhd & 4)
+	z->ip += 4;
+    if (z->ip > z->src_len)
+	return -1;
+
+    return 0;
+}
+
+/*
+ * Decompress the frames in src into dst.  Returns the decompressed
+ * size, or -1 if the data is corrupt, needs a dictionary or does not
+ * fit in dst.
+ */
+long zstd_decompress(void *dst, size_t dst_len, const void *src,
+		     size_t src_len)
+{
+    struct zstd_ctx *z;
+    long ret = -1;
+
+    z = malloc(sizeof *z);
+    if (!z)
+	return -1;
+
+    z->src = src;
+    z->src_len = src_len;
+    z->ip = 0;
+    z->dst = dst;
+    z->dst_len = dst_len;
+    z->op = 0;
+
+    while (z->ip < z->src_len) {
+	if (zstd_frame(z))
+	    goto out;
+    }
+    ret = z->op;
+
+out:
+    free(z);
+    return ret;
+}
@@ -0,0 +1,9 @@
+#ifndef BTRFS_ZSTD_H
+#define BTRFS_ZSTD_H
+
+#include <stddef.h>
+
+long zstd_decompress(void *dst, size_t dst_len, const void *src,
+		     size_t src_len);
+
+#endif /* BTRFS_ZSTD_H */
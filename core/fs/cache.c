@@ -6,42 +6,99 @@
 #include <stdio.h>
 #include <string.h>
 #include <dprintf.h>
+#include <minmax.h>
+#include <ilog2.h>
 #include "core.h"
 #include "cache.h"
 
 
+/*
+ * Hash a block number into the bucket index of the block cache.
+ */
+static inline unsigned int cache_hash_index(const struct device *dev,
+					    block_t block)
+{
+    uint32_t h = (uint32_t)block ^ (uint32_t)(block >> 32);
+
+    return ((h * 0x9e370001UL) >> 16) & dev->cache_hash_mask;
+}
+
+static void cache_hash_insert(struct device *dev, struct cache *cs)
+{
+    struct cache **bucket = &dev->cache_hash[cache_hash_index(dev, cs->block)];
+
+    cs->hash_next = *bucket;
+    *bucket = cs;
+}
+
+static void cache_hash_remove(struct device *dev, struct cache *cs)
+{
+    struct cache **pp = &dev->cache_hash[cache_hash_index(dev, cs->block)];
+
+    while (*pp) {
+	if (*pp == cs) {
+	    *pp = cs->hash_next;
+	    break;
+	}
+	pp = &(*pp)->hash_next;
+    }
+    cs->hash_next = NULL;
+}
+
 /*
  * Initialize the cache data structres. the _block_size_shift_ specify
  * the block size, which is 512 byte for FAT fs of the current 
  * implementation since the block(cluster) size in FAT is a bit big.
+ *
+ * The cache area is laid out as the block data, followed by the LRU
+ * descriptors (headnode first), followed by the hash buckets.
  */
 void cache_init(struct device *dev, int block_size_shift)
 {
     struct cache *prev, *cur;
     char *data = dev->cache_data;
     struct cache *head, *cache;
+    unsigned int hash_size;
     int i;
 
     dev->cache_block_size = 1 << block_size_shift;
 
-    if (dev->cache_size < dev->cache_block_size + 2*sizeof(struct cache)) {
+    if (dev->cache_size < dev->cache_block_size + 2*sizeof(struct cache)
+	+ sizeof(struct cache *)) {
 	dev->cache_head = NULL;
 	return;			/* Cache unusably small */
     }
 
-    /* We need one struct cache for the headnode plus one for each block */
+    /*
+     * We need one struct cache for the headnode plus one for each
+     * block, and at most one hash bucket per block.
+     */
     dev->cache_entries =
 	(dev->cache_size - sizeof(struct cache))/
-	(dev->cache_block_size + sizeof(struct cache));
+	(dev->cache_block_size + sizeof(struct cache) +
+	 sizeof(struct cache *));
 
     dev->cache_head = head = (struct cache *)
 	(data + (dev->cache_entries << block_size_shift));
     cache = head + 1;		/* First cache descriptor */
 
+    /* Largest power of two not exceeding the number of entries */
+    for (hash_size = 1; hash_size << 1 <= dev->cache_entries; hash_size <<= 1)
+	;
+    dev->cache_hash = (struct cache **)&cache[dev->cache_entries];
+    dev->cache_hash_mask = hash_size - 1;
+    memset(dev->cache_hash, 0, hash_size * sizeof(struct cache *));
+
+    dev->cache_hits = dev->cache_misses = 0;
+    dev->cache_ra_bufblks = 0;
+    dev->cache_ra_window = 0;
+    dev->cache_ra_next = -1;
+
     head->prev  = &cache[dev->cache_entries-1];
     head->prev->next = head;
     head->block = -1;
     head->data  = NULL;
+    head->hash_next = NULL;
 
     prev = head;
     
@@ -49,6 +106,7 @@ void cache_init(struct device *dev, int block_size_shift)
         cur = &cache[i];
         cur->data  = data;
         cur->block = -1;
+        cur->hash_next = NULL;
         cur->prev  = prev;
         prev->next = cur;
         data += dev->cache_block_size;
@@ -71,29 +129,28 @@ void cache_lock_block(struct cache *cs)
 }
 
 /*
- * Check for a particular BLOCK in the block cache, 
- * and if it is already there, just do nothing and return;
- * otherwise pick a victim block and update the LRU link.
+ * Look up a block in the hash without touching the LRU chain.
  */
-struct cache *_get_cache_block(struct device *dev, block_t block)
+static struct cache *cache_lookup(struct device *dev, block_t block)
 {
-    struct cache *head = dev->cache_head;
     struct cache *cs;
-    int i;
-
-    cs = dev->cache_head + 1;
 
-    for (i = 0; i < dev->cache_entries; i++) {
+    for (cs = dev->cache_hash[cache_hash_index(dev, block)]; cs;
+	 cs = cs->hash_next) {
 	if (cs->block == block)
-	    goto found;
-	cs++;
+	    return cs;
     }
-    
-    /* Not found, pick a victim */
-    cs = head->next;
 
-found:
-    /* Move to the end of the LRU chain, unless the block is already locked */
+    return NULL;
+}
+
+/*
+ * Move a block to the end of the LRU chain, unless it is locked.
+ */
+static void cache_touch(struct device *dev, struct cache *cs)
+{
+    struct cache *head = dev->cache_head;
+
     if (cs->next) {
 	cs->prev->next = cs->next;
 	cs->next->prev = cs->prev;
@@ -103,35 +160,206 @@ found:
 	cs->next = head;
 	head->prev = cs;
     }
+}
+
+/*
+ * Take the least recently used block and make it available for reuse.
+ */
+static struct cache *cache_victim(struct device *dev)
+{
+    struct cache *cs = dev->cache_head->next;
+
+    if (cs->block != (block_t)-1) {
+	cache_hash_remove(dev, cs);
+	cs->block = -1;
+    }
+    cache_touch(dev, cs);
 
     return cs;
-}    
+}
 
 /*
  * Check for a particular BLOCK in the block cache, 
  * and if it is already there, just do nothing and return;
- * otherwise load it from disk and update the LRU link.
+ * otherwise pick a victim block and update the LRU link.
+ *
+ * A victim is returned with its block number set to -1; the caller
+ * is expected to fill it in and hash it via get_cache().
+ */
+struct cache *_get_cache_block(struct device *dev, block_t block)
+{
+    struct cache *cs;
+
+    cs = cache_lookup(dev, block);
+    if (cs) {
+	dev->cache_hits++;
+	cache_touch(dev, cs);
+	return cs;
+    }
+
+    dev->cache_misses++;
+    return cache_victim(dev);
+}
+
+/*
+ * Maximum read-ahead window, in cache blocks; settable with the
+ * READAHEAD configuration keyword.  0 or 1 disables read-ahead.
+ */
+__export uint16_t ReadAhead = 8;
+
+/*
+ * Work out how many blocks to read on a miss at BLOCK.  The window
+ * doubles for every miss which continues the previous fill, and
+ * drops back to a single block as soon as the access pattern turns
+ * random.  HINT is the number of blocks the caller is known to need.
+ * The run stops at the end of the medium, if we know where that is;
+ * the firmware would only retry and complain about reading past it.
+ */
+static unsigned int cache_ra_window(struct device *dev, block_t block,
+				    unsigned int hint)
+{
+    const struct disk *disk = dev->disk;
+    int blktosec = ilog2(dev->cache_block_size) - disk->sector_shift;
+    unsigned int limit = ReadAhead;
+    unsigned int want, n;
+    sector_t first, left;
+
+    /* Never let a single fill flush more than a quarter of the cache */
+    if (limit > dev->cache_entries >> 2)
+	limit = dev->cache_entries >> 2;
+    if (limit <= 1)
+	return 1;
+
+    if (block == dev->cache_ra_next && dev->cache_ra_window)
+	dev->cache_ra_window = min(dev->cache_ra_window << 1, limit);
+    else
+	dev->cache_ra_window = 1;
+
+    want = max(dev->cache_ra_window, hint);
+    if (want > limit)
+	want = limit;
+
+    if (disk->sectors) {
+	first = disk->part_start + ((sector_t)block << blktosec);
+	left = first < disk->sectors ? (disk->sectors - first) >> blktosec : 0;
+	if (want > left)
+	    want = left ? left : 1;
+    }
+
+    /* Only read the run of blocks which aren't cached yet */
+    for (n = 1; n < want; n++) {
+	if (cache_lookup(dev, block + n))
+	    break;
+    }
+
+    if (n > 1 && dev->cache_ra_bufblks < n) {
+	char *buf = realloc(dev->cache_ra_buf, limit * dev->cache_block_size);
+	if (!buf)
+	    return 1;
+	dev->cache_ra_buf = buf;
+	dev->cache_ra_bufblks = limit;
+    }
+
+    return n;
+}
+
+/*
+ * Fill the victim CS with BLOCK, reading up to HINT following blocks
+ * which aren't yet in the cache with the same disk request.
+ */
+static void cache_fill(struct device *dev, struct cache *cs, block_t block,
+		       unsigned int hint)
+{
+    struct disk *disk = dev->disk;
+    unsigned int sec_per_block = dev->cache_block_size >> disk->sector_shift;
+    unsigned int n, i;
+    const char *p;
+    int done;
+
+    cs->block = block;
+    cache_hash_insert(dev, cs);
+
+    n = cache_ra_window(dev, block, hint);
+    dev->cache_ra_next = block + n;
+
+    if (n > 1) {
+	done = disk->rdwr_sectors(disk, dev->cache_ra_buf,
+				  block * sec_per_block, n * sec_per_block, 0);
+	done /= sec_per_block;
+	if (done > 0) {
+	    if ((unsigned int)done < n)
+		n = done;
+
+	    dev->cache_ra_reads++;
+	    dev->cache_ra_blocks += n - 1;
+
+	    p = dev->cache_ra_buf;
+	    memcpy(cs->data, p, dev->cache_block_size);
+	    for (i = 1; i < n; i++) {
+		struct cache *ra = cache_victim(dev);
+
+		p += dev->cache_block_size;
+		ra->block = block + i;
+		cache_hash_insert(dev, ra);
+		memcpy(ra->data, p, dev->cache_block_size);
+	    }
+	    return;
+	}
+	dev->cache_ra_next = block + 1;
+    }
+
+    getoneblk(disk, cs->data, block, dev->cache_block_size);
+}
+
+/*
+ * Check for a particular BLOCK in the block cache, 
+ * and if it is already there, just do nothing and return;
+ * otherwise load it from disk, together with up to HINT-1 blocks
+ * following it, and update the LRU link.
  * Return the data pointer.
  */
-const void *get_cache(struct device *dev, block_t block)
+const void *get_cache_ahead(struct device *dev, block_t block,
+			    unsigned int hint)
 {
     struct cache *cs;
 
     cs = _get_cache_block(dev, block);
-    if (cs->block != block) {
-	cs->block = block;
-        getoneblk(dev->disk, cs->data, block, dev->cache_block_size);
-    }
+    if (cs->block != block)
+	cache_fill(dev, cs, block, hint);
 
     return cs->data;
 }
 
+const void *get_cache(struct device *dev, block_t block)
+{
+    return get_cache_ahead(dev, block, 1);
+}
+
+/*
+ * Print the block cache hit/miss counters.
+ */
+void cache_stats(struct device *dev)
+{
+    uint32_t lookups = dev->cache_hits + dev->cache_misses;
+
+    printf("cache: %u entries of %u bytes, %u buckets, "
+	   "%u hits, %u misses (%u%% hit)\n",
+	   dev->cache_entries, dev->cache_block_size,
+	   dev->cache_hash_mask + 1, dev->cache_hits, dev->cache_misses,
+	   lookups ? (uint32_t)((uint64_t)dev->cache_hits * 100 / lookups) : 0);
+    printf("cache: %u read-ahead requests, %u blocks read ahead, "
+	   "window %u\n",
+	   dev->cache_ra_reads, dev->cache_ra_blocks, dev->cache_ra_window);
+}
+
 /*
  * Read data from the cache at an arbitrary byte offset and length.
  * This is useful for filesystems whose metadata is not necessarily
  * aligned with their blocks.
  *
- * This is still reading linearly on the disk.
+ * This is still reading linearly on the disk, but blocks which
+ * aren't cached yet are fetched with as few disk requests as the
+ * read-ahead window allows.
  */
 size_t cache_read(struct fs_info *fs, void *buf, uint64_t offset, size_t count)
 {
@@ -144,7 +372,9 @@ size_t cache_read(struct fs_info *fs, void *buf, uint64_t offset, size_t count)
     while (count) {
 	block = offset >> fs->block_shift;
 	off = offset & (fs->block_size - 1);
-	cd = get_cache(fs->fs_dev, block);
+	cd = get_cache_ahead(fs->fs_dev, block,
+			     (off + count + fs->block_size - 1)
+			     >> fs->block_shift);
 	if (!cd)
 	    break;
 	cnt = fs->block_size - off;
@@ -0,0 +1,153 @@
+/*
+ * core/fs/dcache.c: Path component lookup cache.
+ *
+ * Maps (directory inode number, name) to the inode number found by
+ * the filesystem driver, plus optional driver data.  Menus tend to
+ * open many files from the same few directories, so this saves
+ * rescanning the same directory blocks over and over.
+ *
+ * Drivers opt in by calling dcache_lookup() at the top of their
+ * ->iget() method and dcache_insert() once they found the entry.
+ * Directory inode numbers must be unique within the filesystem.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <dprintf.h>
+#include "core.h"
+#include "dcache.h"
+
+#define DCACHE_HASH_SIZE	64	/* Must be a power of 2 */
+#define DCACHE_MAX_ENTRIES	256	/* Keep the memory footprint bounded */
+
+struct dcache {
+    struct list_head lru;	/* Least recently used first */
+    struct dentry *hash[DCACHE_HASH_SIZE];
+    unsigned int entries;
+    uint32_t hits, misses;
+};
+
+static uint32_t dcache_hash(uint64_t dir, const char *name)
+{
+    uint32_t h = 2166136261U ^ (uint32_t)dir ^ (uint32_t)(dir >> 32);
+
+    while (*name) {
+	h ^= (unsigned char)*name++;
+	h *= 16777619U;
+    }
+
+    return h;
+}
+
+static struct dcache *get_dcache(struct fs_info *fs)
+{
+    struct dcache *dc = fs->dcache;
+
+    if (!dc) {
+	dc = zalloc(sizeof *dc);
+	if (!dc)
+	    return NULL;
+	INIT_LIST_HEAD(&dc->lru);
+	fs->dcache = dc;
+    }
+
+    return dc;
+}
+
+static void dcache_unhash(struct dcache *dc, struct dentry *de)
+{
+    struct dentry **pp = &dc->hash[de->hash & (DCACHE_HASH_SIZE - 1)];
+
+    while (*pp) {
+	if (*pp == de) {
+	    *pp = de->hash_next;
+	    break;
+	}
+	pp = &(*pp)->hash_next;
+    }
+}
+
+/*
+ * Look up NAME in the directory DIR.  Returns the cached entry, or
+ * NULL if the driver has to search the directory itself.
+ */
+const struct dentry *dcache_lookup(struct inode *dir, const char *name)
+{
+    struct dcache *dc = get_dcache(dir->fs);
+    struct dentry *de;
+    uint32_t hash;
+
+    if (!dc)
+	return NULL;
+
+    hash = dcache_hash(dir->ino, name);
+    for (de = dc->hash[hash & (DCACHE_HASH_SIZE - 1)]; de;
+	 de = de->hash_next) {
+	if (de->hash == hash && de->dir == dir->ino &&
+	    !strcmp(de->name, name)) {
+	    dc->hits++;
+	    list_move_tail(&de->lru, &dc->lru);
+	    dprintf("dcache: hit %llu/%s -> %llu\n", dir->ino, name, de->ino);
+	    return de;
+	}
+    }
+
+    dc->misses++;
+    return NULL;
+}
+
+/*
+ * Remember that NAME in DIR resolved to inode number INO.  DATA, if
+ * any, is copied into the entry for the driver's later use.
+ */
+void dcache_insert(struct inode *dir, const char *name, uint64_t ino,
+		   const void *data, size_t len)
+{
+    struct dcache *dc = get_dcache(dir->fs);
+    struct dentry *de, **bucket;
+    size_t dlen = (len + 7) & ~7;
+    size_t nlen = strlen(name) + 1;
+
+    if (!dc || len > UINT16_MAX)
+	return;
+
+    if (dc->entries >= DCACHE_MAX_ENTRIES) {
+	de = list_first_entry(&dc->lru, struct dentry, lru);
+	list_del(&de->lru);
+	dcache_unhash(dc, de);
+	free(de);
+	dc->entries--;
+    }
+
+    de = malloc(sizeof *de + dlen + nlen);
+    if (!de)
+	return;
+
+    de->dir = dir->ino;
+    de->ino = ino;
+    de->hash = dcache_hash(dir->ino, name);
+    de->data_len = len;
+    if (len)
+	memcpy(de->data, data, len);
+    de->name = memcpy((char *)de->data + dlen, name, nlen);
+
+    bucket = &dc->hash[de->hash & (DCACHE_HASH_SIZE - 1)];
+    de->hash_next = *bucket;
+    *bucket = de;
+    list_add_tail(&de->lru, &dc->lru);
+    dc->entries++;
+}
+
+/*
+ * Print the lookup cache hit/miss counters.
+ */
+void dcache_stats(struct fs_info *fs)
+{
+    struct dcache *dc = fs->dcache;
+
+    if (!dc)
+	return;
+
+    printf("dcache: %u entries, %u hits, %u misses\n",
+	   dc->entries, dc->hits, dc->misses);
+}
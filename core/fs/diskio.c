@@ -18,6 +18,30 @@ void getoneblk(struct disk *disk, char *buf, block_t block, int block_size)
     disk->rdwr_sectors(disk, buf, block * sec_per_block, sec_per_block, 0);
 }
 
+/*
+ * Report the I/O profile of the disk we are booting from.
+ */
+__export int syslinux_disk_profile(struct disk_profile *prof)
+{
+    const struct disk *disk;
+
+    if (!this_fs || !this_fs->fs_dev || !this_fs->fs_dev->disk)
+	return -1;
+
+    disk = this_fs->fs_dev->disk;
+
+    prof->disk_number      = disk->disk_number;
+    prof->sector_size      = disk->sector_size;
+    prof->maxtransfer      = disk->maxtransfer;
+    prof->hard_maxtransfer = disk->hard_maxtransfer;
+    prof->good_maxtransfer = disk->good_maxtransfer;
+    prof->fail_maxtransfer = disk->fail_maxtransfer;
+    prof->stats            = disk->stats;
+    memcpy(prof->xfer, disk->xfer, sizeof prof->xfer);
+
+    return 0;
+}
+
 /*
  * Initialize the device structure.
  */
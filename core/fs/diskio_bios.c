@@ -2,9 +2,16 @@
 #include <com32.h>
 #include <fs.h>
 #include <ilog2.h>
+#include <minmax.h>
 
 #define RETRY_COUNT 6
 
+/*
+ * Number of consecutive full-size transfers after which we try a
+ * larger maxtransfer again.
+ */
+#define GROW_AFTER 16
+
 static inline sector_t chs_max(const struct disk *disk)
 {
     return (sector_t)disk->secpercyl << 10;
@@ -42,6 +49,84 @@ static inline bool is_power_of_2(uint32_t x)
     return !(x & (x-1));
 }
 
+/*
+ * I/O profile.  maxtransfer starts out at the largest value the BIOS
+ * and the installer allow.  When a transfer keeps failing we back off,
+ * but no further than the largest size which is already known to
+ * work; after GROW_AFTER clean full-size transfers we probe halfway
+ * back up towards the smallest size which has been seen failing.
+ * Only errors which point at the transfer itself count as "failing"
+ * here; a media error just means a bad sector somewhere in the chunk.
+ */
+static inline struct disk_xfer_class *xfer_class(struct disk *disk,
+						 size_t chunk)
+{
+    return &disk->xfer[min(ilog2(chunk), DISK_XFER_CLASSES-1)];
+}
+
+static size_t disk_xfer_backoff(struct disk *disk, size_t chunk)
+{
+    size_t next = chunk >> 1;
+
+    /* For any starting value, this will always end with ..., 1, 0 */
+    if (disk->good_maxtransfer < chunk && disk->good_maxtransfer > next)
+	next = disk->good_maxtransfer;
+
+    return next;
+}
+
+/* INT 13h status codes which can be caused by the size of the transfer */
+static bool xfer_size_error(uint8_t status)
+{
+    switch (status) {
+    case 0x01:			/* Invalid function or parameter */
+    case 0x08:			/* DMA overrun */
+    case 0x09:			/* DMA across 64K boundary */
+    case 0x0d:			/* Invalid number of sectors */
+	return true;
+    default:
+	return false;
+    }
+}
+
+static void disk_xfer_done(struct disk *disk, size_t chunk, size_t failed,
+			   uint8_t status, mstime_t t0)
+{
+    struct disk_xfer_class *xc = xfer_class(disk, chunk);
+    unsigned int limit;
+
+    xc->calls++;
+    xc->ms += ms_timer() - t0;
+
+    if (chunk > disk->good_maxtransfer)
+	disk->good_maxtransfer = chunk;
+
+    if (failed) {
+	/* We had to back off to get here, remember what didn't work */
+	if (xfer_size_error(status) &&
+	    (!disk->fail_maxtransfer || failed < disk->fail_maxtransfer))
+	    disk->fail_maxtransfer = failed;
+	disk->maxtransfer = chunk;
+	disk->good_streak = 0;
+	return;
+    }
+
+    if (chunk < disk->maxtransfer || ++disk->good_streak < GROW_AFTER)
+	return;
+
+    disk->good_streak = 0;
+
+    limit = disk->hard_maxtransfer;
+    if (disk->fail_maxtransfer && disk->fail_maxtransfer <= limit)
+	limit = disk->fail_maxtransfer - 1;
+
+    if (disk->maxtransfer < limit) {
+	disk->maxtransfer += (limit - disk->maxtransfer + 1) >> 1;
+	dprintf("disk %02x: maxtransfer -> %u\n",
+		disk->disk_number, disk->maxtransfer);
+    }
+}
+
 static int chs_rdwr_sectors(struct disk *disk, void *buf,
 			    sector_t lba, size_t count, bool is_write)
 {
@@ -55,8 +140,10 @@ static int chs_rdwr_sectors(struct disk *disk, void *buf,
     com32sys_t ireg, oreg;
     size_t done = 0;
     size_t bytes;
+    size_t failed;
+    uint8_t status;
     int retry;
-    uint32_t maxtransfer = disk->maxtransfer;
+    mstime_t t0;
 
     if (lba + disk->part_start >= chs_max(disk))
 	return 0;		/* Impossible CHS request */
@@ -68,12 +155,12 @@ static int chs_rdwr_sectors(struct disk *disk, void *buf,
 
     while (count) {
 	chunk = count;
-	if (chunk > maxtransfer)
-	    chunk = maxtransfer;
+	if (chunk > disk->maxtransfer)
+	    chunk = disk->maxtransfer;
 
 	freeseg = (0x10000 - ((size_t)ptr & 0xffff)) >> sector_shift;
 
-	if ((size_t)buf <= 0xf0000 && freeseg) {
+	if ((size_t)ptr <= 0xf0000 && freeseg) {
 	    /* Can do a direct load */
 	    tptr = ptr;
 	} else {
@@ -105,6 +192,8 @@ static int chs_rdwr_sectors(struct disk *disk, void *buf,
 	ireg.es       = SEG(tptr);
 
 	retry = RETRY_COUNT;
+	failed = 0;
+	status = 0;
 
         for (;;) {
 	    if (c < 1024) {
@@ -114,22 +203,22 @@ static int chs_rdwr_sectors(struct disk *disk, void *buf,
 			(ireg.eax.b[1] & 1) ? "<-" : "->",
 			ptr);
 
+		t0 = ms_timer();
 		__intcall(0x13, &ireg, &oreg);
 		if (!(oreg.eflags.l & EFLAGS_CF))
 		    break;
 
 		dprintf("CHS: error AX = %04x\n", oreg.eax.w[0]);
+		disk->stats.errors++;
+		xfer_class(disk, chunk)->errors++;
 
 		if (retry--)
 		    continue;
 
-		/*
-		 * For any starting value, this will always end with
-		 * ..., 1, 0
-		 */
-		chunk >>= 1;
+		failed = chunk;
+		status = oreg.eax.b[1];
+		chunk = disk_xfer_backoff(disk, chunk);
 		if (chunk) {
-		    maxtransfer = chunk;
 		    retry = RETRY_COUNT;
 		    ireg.eax.b[0] = chunk;
 		    continue;
@@ -145,11 +234,17 @@ static int chs_rdwr_sectors(struct disk *disk, void *buf,
 
 	bytes = chunk << sector_shift;
 
-	if (tptr != ptr && !is_write)
-	    memcpy(ptr, tptr, bytes);
+	if (tptr != ptr) {
+	    if (!is_write)
+		memcpy(ptr, tptr, bytes);
+	    disk->stats.bounced += bytes;
+	}
+
+	disk->stats.calls++;
+	disk->stats.bytes += bytes;
 
 	/* If we dropped maxtransfer, it eventually worked, so remember it */
-	disk->maxtransfer = maxtransfer;
+	disk_xfer_done(disk, chunk, failed, status, t0);
 
 	ptr   += bytes;
 	xlba  += chunk;
@@ -171,8 +266,10 @@ static int edd_rdwr_sectors(struct disk *disk, void *buf,
     com32sys_t ireg, oreg, reset;
     size_t done = 0;
     size_t bytes;
+    size_t failed;
+    uint8_t status;
     int retry;
-    uint32_t maxtransfer = disk->maxtransfer;
+    mstime_t t0;
 
     memset(&ireg, 0, sizeof ireg);
 
@@ -186,8 +283,8 @@ static int edd_rdwr_sectors(struct disk *disk, void *buf,
     lba += disk->part_start;
     while (count) {
 	chunk = count;
-	if (chunk > maxtransfer)
-	    chunk = maxtransfer;
+	if (chunk > disk->maxtransfer)
+	    chunk = disk->maxtransfer;
 
 	freeseg = (0x10000 - ((size_t)ptr & 0xffff)) >> sector_shift;
 
@@ -208,6 +305,8 @@ static int edd_rdwr_sectors(struct disk *disk, void *buf,
 	    memcpy(tptr, ptr, bytes);
 
 	retry = RETRY_COUNT;
+	failed = 0;
+	status = 0;
 
 	for (;;) {
 	    pkt.size   = sizeof pkt;
@@ -221,11 +320,14 @@ static int edd_rdwr_sectors(struct disk *disk, void *buf,
 		    (ireg.eax.b[1] & 1) ? "<-" : "->",
 		    ptr);
 
+	    t0 = ms_timer();
 	    __intcall(0x13, &ireg, &oreg);
 	    if (!(oreg.eflags.l & EFLAGS_CF))
 		break;
 
 	    dprintf("EDD: error AX = %04x\n", oreg.eax.w[0]);
+	    disk->stats.errors++;
+	    xfer_class(disk, chunk)->errors++;
 
 	    if (retry--)
 		continue;
@@ -238,10 +340,10 @@ static int edd_rdwr_sectors(struct disk *disk, void *buf,
 	     */
 	    __intcall(0x13, &reset, NULL);
 
-	    /* For any starting value, this will always end with ..., 1, 0 */
-	    chunk >>= 1;
+	    failed = chunk;
+	    status = oreg.eax.b[1];
+	    chunk = disk_xfer_backoff(disk, chunk);
 	    if (chunk) {
-		maxtransfer = chunk;
 		retry = RETRY_COUNT;
 		continue;
 	    }
@@ -271,11 +373,17 @@ static int edd_rdwr_sectors(struct disk *disk, void *buf,
 
 	bytes = chunk << sector_shift;
 
-	if (tptr != ptr && !is_write)
-	    memcpy(ptr, tptr, bytes);
+	if (tptr != ptr) {
+	    if (!is_write)
+		memcpy(ptr, tptr, bytes);
+	    disk->stats.bounced += bytes;
+	}
+
+	disk->stats.calls++;
+	disk->stats.bytes += bytes;
 
 	/* If we dropped maxtransfer, it eventually worked, so remember it */
-	disk->maxtransfer = maxtransfer;
+	disk_xfer_done(disk, chunk, failed, status, t0);
 
 	ptr   += bytes;
 	lba   += chunk;
@@ -369,6 +477,8 @@ struct disk *bios_disk_init(void *private)
 		if (edd_params.sector_size >= 512 &&
 		    is_power_of_2(edd_params.sector_size))
 		    sector_size = edd_params.sector_size;
+		if (edd_params.sectors != (uint64_t)-1)
+		    disk.sectors = edd_params.sectors;
 	    }
 	}
 
@@ -380,11 +490,14 @@ struct disk *bios_disk_init(void *private)
     disk.part_start    = part_start;
     disk.secpercyl     = disk.h * disk.s;
     disk.rdwr_sectors  = ebios ? edd_rdwr_sectors : chs_rdwr_sectors;
+    if (!ebios)
+	disk.sectors   = chs_max(&disk);
 
     if (!MaxTransfer || MaxTransfer > hard_max_transfer)
 	MaxTransfer = hard_max_transfer;
 
     disk.maxtransfer   = MaxTransfer;
+    disk.hard_maxtransfer = MaxTransfer;
 
     dprintf("disk %02x cdrom %d type %d sector %u/%u offset %llu limit %u\n",
 	    devno, cdrom, ebios, sector_size, disk.sector_shift,
@@ -12,71 +12,145 @@
 #include <cache.h>
 #include "ext2_fs.h"
 
+/*
+ * Find the extent leaf covering block.  The nodes on the way down are
+ * remembered in the inode, so that the next lookup - usually for the
+ * block right after - only has to descend from the lowest node that
+ * still covers it, which normally is the leaf itself.
+ */
 static const struct ext4_extent_header *
-ext4_find_leaf(struct fs_info *fs, const struct ext4_extent_header *eh,
-	       block_t block)
+ext4_find_leaf(struct inode *inode, uint32_t block, uint32_t *leaf_end)
 {
-    struct ext4_extent_idx *index;
-    block_t blk;
+    struct fs_info *fs = inode->fs;
+    struct ext2_pvt_inode *pvt = PVT(inode);
+    const struct ext4_extent_header *eh = &pvt->i_extent_hdr;
+    const struct ext4_extent_idx *index;
+    struct ext4_path *path;
+    uint32_t end = ~0;
+    int level = 0;
     int i;
 
     while (1) {
 	if (eh->eh_magic != EXT4_EXT_MAGIC)
-	    return NULL;
-	if (eh->eh_depth == 0)
+	    break;
+	if (eh->eh_depth == 0) {
+	    *leaf_end = end;
 	    return eh;
+	}
+	if (level >= EXT4_MAX_DEPTH)
+	    break;
 
-	index = EXT4_FIRST_INDEX(eh);
-	for (i = 0; i < (int)eh->eh_entries; i++) {
-	    if (block < index[i].ei_block)
+	path = &pvt->ext_path[level];
+	if (level >= pvt->ext_levels ||
+	    block < path->start || block >= path->end) {
+	    /* Not the node we used last time, search the index */
+	    index = EXT4_FIRST_INDEX(eh);
+	    for (i = 0; i < (int)eh->eh_entries; i++) {
+		if (block < index[i].ei_block)
+		    break;
+	    }
+	    if (--i < 0)
 		break;
+
+	    path->blk = ((block_t)index[i].ei_leaf_hi << 32)
+		+ index[i].ei_leaf_lo;
+	    path->start = index[i].ei_block;
+	    path->end = i + 1 < eh->eh_entries ? index[i+1].ei_block : end;
+	    pvt->ext_levels = level + 1;
+	    pvt->ext_hint = 0;
 	}
-	if (--i < 0)
-	    return NULL;
 
-	blk = index[i].ei_leaf_hi;
-	blk = (blk << 32) + index[i].ei_leaf_lo;
-	eh = get_cache(fs->fs_dev, blk);
+	end = path->end;
+	eh = get_cache(fs->fs_dev, path->blk);
+	level++;
+    }
+
+    pvt->ext_levels = 0;
+    return NULL;
+}
+
+/*
+ * Find the last extent in the leaf starting at or before block, or
+ * return -1 if block comes before all of them.  Sequential lookups
+ * find it at or right after the one used last time.
+ */
+static int ext4_find_extent(struct inode *inode,
+			    const struct ext4_extent_header *leaf,
+			    uint32_t block)
+{
+    const struct ext4_extent *ext = EXT4_FIRST_EXTENT(leaf);
+    int n = leaf->eh_entries;
+    int lo, hi, mid;
+    int i = PVT(inode)->ext_hint;
+
+    if (i < n && ext[i].ee_block <= block) {
+	if (i + 1 >= n || block < ext[i+1].ee_block)
+	    return i;
+	if (i + 2 >= n || block < ext[i+2].ee_block)
+	    return PVT(inode)->ext_hint = i + 1;
     }
+
+    lo = 0;
+    hi = n - 1;
+    while (lo <= hi) {
+	mid = (lo + hi) >> 1;
+	if (ext[mid].ee_block > block)
+	    hi = mid - 1;
+	else
+	    lo = mid + 1;
+    }
+
+    if (hi >= 0)
+	PVT(inode)->ext_hint = hi;
+    return hi;
 }
 
-/* handle the ext4 extents to get the phsical block number */
-/* XXX: still need to handle sparse files with extents */
+/*
+ * Handle the ext4 extents to get the physical block number.  Holes and
+ * uninitialized extents map to block 0, which reads as zero.
+ */
 static block_t
 bmap_extent(struct inode *inode, uint32_t block, size_t *nblocks)
 {
-    struct fs_info *fs = inode->fs;
     const struct ext4_extent_header *leaf;
     const struct ext4_extent *ext;
-    int i;
+    uint32_t leaf_end, len, next;
     block_t start;
+    int i;
 
-    leaf = ext4_find_leaf(fs, &PVT(inode)->i_extent_hdr, block);
+    leaf = ext4_find_leaf(inode, block, &leaf_end);
     if (!leaf) {
 	printf("ERROR, extent leaf not found\n");
 	return 0;
     }
 
     ext = EXT4_FIRST_EXTENT(leaf);
-    for (i = 0; i < leaf->eh_entries; i++) {
-	if (block < ext[i].ee_block)
-	    break;
-    }
-    if (--i < 0) {
-	printf("ERROR, not find the right block\n");
-	return 0;
-    }
+    i = ext4_find_extent(inode, leaf, block);
+    next = i + 1 < leaf->eh_entries ? ext[i+1].ee_block : leaf_end;
 
-    /* got it */
-    block -= ext[i].ee_block;
-    if (block >= ext[i].ee_len)
-	return 0;
-    start = ((block_t)ext[i].ee_start_hi << 32) + ext[i].ee_start_lo;
+    if (i >= 0) {
+	len = ext[i].ee_len;
+	if (len > EXT4_INIT_MAX_LEN)
+	    len -= EXT4_INIT_MAX_LEN;
 
-    if (nblocks)
-	*nblocks = ext[i].ee_len - block;
+	if (block - ext[i].ee_block < len) {
+	    /* got it */
+	    block -= ext[i].ee_block;
+	    if (nblocks)
+		*nblocks = len - block;
 
-    return start + block;
+	    if (ext[i].ee_len > EXT4_INIT_MAX_LEN)
+		return 0;	/* Allocated, but not written yet */
+
+	    start = ((block_t)ext[i].ee_start_hi << 32) + ext[i].ee_start_lo;
+	    return start + block;
+	}
+    }
+
+    /* A hole, up to the next extent */
+    if (nblocks)
+	*nblocks = next - block;
+    return 0;
 }
 
 /*
@@ -205,17 +279,36 @@ block_t ext2_bmap(struct inode *inode, block_t block, size_t *nblocks)
 
 
 /*
- * Next extent for getfssec
+ * Next extent for getfssec.  Runs of blocks that happen to be
+ * physically contiguous (or are all holes) are returned as a single
+ * extent, even if they span several extents or indirect blocks.
  */
 int ext2_next_extent(struct inode *inode, uint32_t lstart)
 {
     struct fs_info *fs = inode->fs;
     int blktosec =  BLOCK_SHIFT(fs) - SECTOR_SHIFT(fs);
     int blkmask = (1 << blktosec) - 1;
-    block_t block;
-    size_t nblocks = 0;
-
-    block = ext2_bmap(inode, lstart >> blktosec, &nblocks);
+    uint32_t lblock = lstart >> blktosec;
+    uint32_t end_block, max_blocks;
+    block_t block, next;
+    size_t nblocks = 0, more;
+
+    block = ext2_bmap(inode, lblock, &nblocks);
+
+    end_block = (inode->size + BLOCK_SIZE(fs) - 1) >> BLOCK_SHIFT(fs);
+    max_blocks = (UINT32_MAX >> 1) >> blktosec;
+    if (end_block > lblock && end_block - lblock < max_blocks)
+	max_blocks = end_block - lblock;
+
+    while (nblocks && nblocks < max_blocks) {
+	more = 0;
+	next = ext2_bmap(inode, lblock + nblocks, &more);
+	if (!more || next != (block ? block + nblocks : 0))
+	    break;
+	nblocks += more;
+    }
+    if (nblocks > max_blocks)
+	nblocks = max_blocks;
 
     if (!block)
 	inode->next_extent.pstart = EXTENT_ZERO;
@@ -4,6 +4,7 @@
 #include <sys/dirent.h>
 #include <minmax.h>
 #include "cache.h"
+#include "dcache.h"
 #include "core.h"
 #include "disk.h"
 #include "fs.h"
@@ -78,13 +79,37 @@ static inline struct ext2_dir_entry *ext2_next_entry(struct ext2_dir_entry *p)
 /*
  * Map a logical sector and load it into the cache
  */
-static const void *
-ext2_get_cache(struct inode *inode, block_t lblock)
+const void *ext2_get_cache(struct inode *inode, block_t lblock)
 {
     block_t pblock = ext2_bmap(inode, lblock, NULL);
     return get_cache(inode->fs->fs_dev, pblock);
 }
 
+/*
+ * Search the first size bytes of one directory block for a name.
+ */
+const struct ext2_dir_entry *
+ext2_search_dirblock(const char *data, uint32_t size,
+		     const char *dname, size_t dname_len)
+{
+    const struct ext2_dir_entry *de;
+    uint32_t offset = 0;
+
+    /* The smallest possible size is 9 bytes */
+    while (offset + 8 < size) {
+	de = (const struct ext2_dir_entry *)(data + offset);
+	if (de->d_rec_len > size - offset || !de->d_rec_len)
+	    break;
+
+	if (ext2_match_entry(dname, dname_len, de))
+	    return de;
+
+	offset += de->d_rec_len;
+    }
+
+    return NULL;
+}
+
 /*
  * find a dir entry, return it if found, or return NULL.
  */
@@ -92,27 +117,29 @@ static const struct ext2_dir_entry *
 ext2_find_entry(struct fs_info *fs, struct inode *inode, const char *dname)
 {
     block_t index = 0;
-    uint32_t i = 0, offset, maxoffset;
+    uint32_t i = 0;
     const struct ext2_dir_entry *de;
     const char *data;
     size_t dname_len = strlen(dname);
 
+    /* Hash-indexed directories only need a leaf or two searched */
+    if (inode->flags & EXT2_INDEX_FL) {
+	switch (ext2_htree_find(inode, dname, dname_len, &de)) {
+	case 1:
+	    return de;
+	case 0:
+	    return NULL;
+	default:
+	    break;		/* Bad index, fall back to a linear scan */
+	}
+    }
+
     while (i < inode->size) {
 	data = ext2_get_cache(inode, index++);
-	offset = 0;
-	maxoffset =  min(BLOCK_SIZE(fs), i-inode->size);
-
-	/* The smallest possible size is 9 bytes */
-	while (offset < maxoffset-8) {
-	    de = (const struct ext2_dir_entry *)(data + offset);
-	    if (de->d_rec_len > maxoffset - offset)
-		break;
-
-	    if (ext2_match_entry(dname, dname_len, de))
-		return de;
-
-	    offset += de->d_rec_len;
-	}
+	de = ext2_search_dirblock(data, min(BLOCK_SIZE(fs), inode->size - i),
+				  dname, dname_len);
+	if (de)
+	    return de;
 	i += BLOCK_SIZE(fs);
     }
 
@@ -182,12 +209,18 @@ static struct inode *ext2_iget_root(struct fs_info *fs)
 static struct inode *ext2_iget(const char *dname, struct inode *parent)
 {
     const struct ext2_dir_entry *de;
+    const struct dentry *dc;
     struct fs_info *fs = parent->fs;
 
+    dc = dcache_lookup(parent, dname);
+    if (dc)
+	return ext2_iget_by_inr(fs, dc->ino);
+
     de = ext2_find_entry(fs, parent, dname);
     if (!de)
 	return NULL;
-    
+
+    dcache_insert(parent, dname, de->d_inode, NULL, 0);
     return ext2_iget_by_inr(fs, de->d_inode);
 }
 
@@ -315,6 +348,10 @@ static int ext2_fs_init(struct fs_info *fs)
     /* Volume UUID */
     memcpy(sbi->s_uuid, sb.s_uuid, sizeof(sbi->s_uuid));
 
+    /* Directory index hashing */
+    memcpy(sbi->s_hash_seed, sb.s_hash_seed, sizeof(sbi->s_hash_seed));
+    sbi->s_hash_unsigned = !!(sb.s_flags & EXT2_FLAGS_UNSIGNED_HASH);
+
     /* Initialize the cache, and force block zero to all zero */
     cache_init(fs->fs_dev, fs->block_shift);
     cs = _get_cache_block(fs->fs_dev, 0);
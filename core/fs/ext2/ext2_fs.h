@@ -2,6 +2,7 @@
 #define __EXT2_FS_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
 #define	EXT2_SUPER_MAGIC	0xEF53
 
@@ -36,6 +37,10 @@
 #define EXT4_EXT_MAGIC     0xf30a
 #define EXT4_EXTENTS_FLAG  0x00080000
 
+/* for hash-indexed (htree) directories */
+#define EXT2_INDEX_FL		0x00001000	/* i_flags: directory has an index */
+#define EXT2_FLAGS_UNSIGNED_HASH 0x0002		/* s_flags: hash on unsigned chars */
+
 /*
  * File types and file modes
  */
@@ -214,6 +219,40 @@ struct ext2_dir_entry {
     char	d_name[EXT2_NAME_LEN];	        /* File name */
 };
 
+/*
+ * htree directory index.  Block 0 of an indexed directory holds the
+ * "." and ".." entries, followed by the root info and the first level
+ * of dx entries; interior nodes are blocks holding one empty directory
+ * entry spanning the whole block, followed by dx entries.  The hash
+ * field of the first dx entry of each node holds the count and limit.
+ */
+struct ext2_dx_root_info {
+    uint32_t reserved_zero;
+    uint8_t  hash_version;
+    uint8_t  info_length;	/* 8 */
+    uint8_t  indirect_levels;
+    uint8_t  unused_flags;
+};
+
+struct ext2_dx_entry {
+    uint32_t hash;
+    uint32_t block;		/* Logical block within the directory */
+};
+
+struct ext2_dx_countlimit {
+    uint16_t limit;
+    uint16_t count;
+};
+
+#define EXT2_HASH_LEGACY		0
+#define EXT2_HASH_HALF_MD4		1
+#define EXT2_HASH_TEA			2
+#define EXT2_HASH_LEGACY_UNSIGNED	3
+#define EXT2_HASH_HALF_MD4_UNSIGNED	4
+#define EXT2_HASH_TEA_UNSIGNED		5
+
+#define EXT2_DX_MAX_LEVELS	3	/* Including the root */
+
 /*******************************************************************************
 #define EXT2_DIR_PAD	 4
 #define EXT2_DIR_ROUND	(EXT2_DIR_PAD - 1)
@@ -265,6 +304,18 @@ struct ext4_extent_header {
 #define EXT4_FIRST_EXTENT(header) ( (struct ext4_extent *)(header + 1) )
 #define EXT4_FIRST_INDEX(header)  ( (struct ext4_extent_idx *) (header + 1) )
 
+#define EXT4_INIT_MAX_LEN	32768	/* Longer ee_len means uninitialized */
+#define EXT4_MAX_DEPTH		5	/* Maximum extent tree depth */
+
+/*
+ * One node on the path from the inode to the last extent leaf used
+ */
+struct ext4_path {
+    block_t  blk;		/* Physical block of the node */
+    uint32_t start;		/* Logical blocks covered: [start, end) */
+    uint32_t end;
+};
+
 
 /*
  * The ext2 super block information in memory
@@ -278,6 +329,8 @@ struct ext2_sb_info {
     uint32_t s_first_data_block;	/* First Data Block */
     int      s_inode_size;
     uint8_t  s_uuid[16];	/* 128-bit uuid for volume */
+    uint32_t s_hash_seed[4];	/* HTREE hash seed */
+    bool     s_hash_unsigned;	/* HTREE hashes use unsigned chars */
 };
 
 static inline struct ext2_sb_info *EXT2_SB(struct fs_info *fs)
@@ -298,6 +351,10 @@ struct ext2_pvt_inode {
 	uint32_t i_block[EXT2_N_BLOCKS];
 	struct ext4_extent_header i_extent_hdr;
     };
+    /* Extent tree path to the last leaf used, see bmap_extent() */
+    struct ext4_path ext_path[EXT4_MAX_DEPTH];
+    int ext_levels;		/* Valid entries in ext_path */
+    int ext_hint;		/* Last extent used within the leaf */
 };
 
 #define PVT(i) ((struct ext2_pvt_inode *)((i)->pvt))
@@ -307,5 +364,10 @@ struct ext2_pvt_inode {
  */
 block_t ext2_bmap(struct inode *, block_t, size_t *);
 int ext2_next_extent(struct inode *, uint32_t);
+const void *ext2_get_cache(struct inode *, block_t);
+const struct ext2_dir_entry *ext2_search_dirblock(const char *, uint32_t,
+						  const char *, size_t);
+int ext2_htree_find(struct inode *, const char *, size_t,
+		    const struct ext2_dir_entry **);
 
 #endif /* ext2_fs.h */
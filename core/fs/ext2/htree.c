@@ -0,0 +1,364 @@
+/*
+ * Hashed (htree) directory lookup.
+ *
+ * Directories with EXT2_INDEX_FL set carry a B-tree keyed on a hash of
+ * the file names, one or two levels deep.  Walking it takes us straight
+ * to the leaf block that holds the name, rather than searching every
+ * block of the directory.  The hash functions are the ones used by the
+ * Linux kernel's ext3/ext4 drivers.
+ *
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <dprintf.h>
+#include <minmax.h>
+#include <fs.h>
+#include <cache.h>
+#include "ext2_fs.h"
+
+#define DX_BLOCK_MASK	0x0fffffff
+#define DX_HASH_EOF	0x7fffffff
+
+static inline uint32_t rol32(uint32_t x, int s)
+{
+    return (x << s) | (x >> (32 - s));
+}
+
+/* The original, "legacy" hash */
+static uint32_t dx_hack_hash(const char *name, int len, bool is_unsigned)
+{
+    uint32_t hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+    int c;
+
+    while (len--) {
+	c = is_unsigned ? (int)(unsigned char)*name : (int)(signed char)*name;
+	name++;
+	hash = hash1 + (hash0 ^ (c * 7152373));
+	if (hash & 0x80000000)
+	    hash -= 0x7fffffff;
+	hash1 = hash0;
+	hash0 = hash;
+    }
+    return hash0 << 1;
+}
+
+/*
+ * Pack up to num*4 bytes of name into words, padded with the length
+ */
+static void str2hashbuf(const char *msg, int len, uint32_t *buf, int num,
+			bool is_unsigned)
+{
+    uint32_t pad, val;
+    int i, c;
+
+    pad = (uint32_t)len | ((uint32_t)len << 8);
+    pad |= pad << 16;
+
+    val = pad;
+    if (len > num*4)
+	len = num*4;
+    for (i = 0; i < len; i++) {
+	c = is_unsigned ? (int)(unsigned char)msg[i] : (int)(signed char)msg[i];
+	val = c + (val << 8);
+	if ((i % 4) == 3) {
+	    *buf++ = val;
+	    val = pad;
+	    num--;
+	}
+    }
+    if (--num >= 0)
+	*buf++ = val;
+    while (--num >= 0)
+	*buf++ = pad;
+}
+
+#define F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define H(x, y, z) ((x) ^ (y) ^ (z))
+
+#define ROUND(f, a, b, c, d, x, s) \
+    (a += f(b, c, d) + x, a = rol32(a, s))
+#define K1 0
+#define K2 013240474631UL
+#define K3 015666365641UL
+
+/* A cut-down MD4 transform, 8 words of input, 3 rounds */
+static void half_md4_transform(uint32_t buf[4], const uint32_t in[8])
+{
+    uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+    /* Round 1 */
+    ROUND(F, a, b, c, d, in[0] + K1,  3);
+    ROUND(F, d, a, b, c, in[1] + K1,  7);
+    ROUND(F, c, d, a, b, in[2] + K1, 11);
+    ROUND(F, b, c, d, a, in[3] + K1, 19);
+    ROUND(F, a, b, c, d, in[4] + K1,  3);
+    ROUND(F, d, a, b, c, in[5] + K1,  7);
+    ROUND(F, c, d, a, b, in[6] + K1, 11);
+    ROUND(F, b, c, d, a, in[7] + K1, 19);
+
+    /* Round 2 */
+    ROUND(G, a, b, c, d, in[1] + K2,  3);
+    ROUND(G, d, a, b, c, in[3] + K2,  5);
+    ROUND(G, c, d, a, b, in[5] + K2,  9);
+    ROUND(G, b, c, d, a, in[7] + K2, 13);
+    ROUND(G, a, b, c, d, in[0] + K2,  3);
+    ROUND(G, d, a, b, c, in[2] + K2,  5);
+    ROUND(G, c, d, a, b, in[4] + K2,  9);
+    ROUND(G, b, c, d, a, in[6] + K2, 13);
+
+    /* Round 3 */
+    ROUND(H, a, b, c, d, in[3] + K3,  3);
+    ROUND(H, d, a, b, c, in[7] + K3,  9);
+    ROUND(H, c, d, a, b, in[2] + K3, 11);
+    ROUND(H, b, c, d, a, in[6] + K3, 15);
+    ROUND(H, a, b, c, d, in[1] + K3,  3);
+    ROUND(H, d, a, b, c, in[5] + K3,  9);
+    ROUND(H, c, d, a, b, in[0] + K3, 11);
+    ROUND(H, b, c, d, a, in[4] + K3, 15);
+
+    buf[0] += a;
+    buf[1] += b;
+    buf[2] += c;
+    buf[3] += d;
+}
+
+#undef F
+#undef G
+#undef H
+#undef ROUND
+
+static void tea_transform(uint32_t buf[4], const uint32_t in[4])
+{
+    uint32_t sum = 0;
+    uint32_t b0 = buf[0], b1 = buf[1];
+    uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+    int n = 16;
+
+    do {
+	sum += 0x9e3779b9;
+	b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+	b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+    } while (--n);
+
+    buf[0] += b0;
+    buf[1] += b1;
+}
+
+/*
+ * Compute the major hash of a name, or return -1 for an unknown hash
+ * version.  The low bit is always clear; in the index it flags a hash
+ * that continues from the previous leaf block.
+ */
+static int dx_hash(struct fs_info *fs, int version, const char *name,
+		   int len, uint32_t *hashp)
+{
+    const struct ext2_sb_info *sbi = EXT2_SB(fs);
+    uint32_t buf[4], in[8];
+    uint32_t hash;
+    bool is_unsigned = false;
+    int i;
+
+    buf[0] = 0x67452301;
+    buf[1] = 0xefcdab89;
+    buf[2] = 0x98badcfe;
+    buf[3] = 0x10325476;
+    for (i = 0; i < 4; i++) {
+	if (sbi->s_hash_seed[i]) {
+	    memcpy(buf, sbi->s_hash_seed, sizeof buf);
+	    break;
+	}
+    }
+
+    switch (version) {
+    case EXT2_HASH_LEGACY_UNSIGNED:
+	is_unsigned = true;
+	/* fall through */
+    case EXT2_HASH_LEGACY:
+	hash = dx_hack_hash(name, len, is_unsigned);
+	break;
+    case EXT2_HASH_HALF_MD4_UNSIGNED:
+	is_unsigned = true;
+	/* fall through */
+    case EXT2_HASH_HALF_MD4:
+	for (; len > 0; len -= 32, name += 32) {
+	    str2hashbuf(name, len, in, 8, is_unsigned);
+	    half_md4_transform(buf, in);
+	}
+	hash = buf[1];
+	break;
+    case EXT2_HASH_TEA_UNSIGNED:
+	is_unsigned = true;
+	/* fall through */
+    case EXT2_HASH_TEA:
+	for (; len > 0; len -= 16, name += 16) {
+	    str2hashbuf(name, len, in, 4, is_unsigned);
+	    tea_transform(buf, in);
+	}
+	hash = buf[0];
+	break;
+    default:
+	return -1;
+    }
+
+    hash &= ~1;
+    if (hash == (DX_HASH_EOF << 1))
+	hash = (DX_HASH_EOF - 1) << 1;
+
+    *hashp = hash;
+    return 0;
+}
+
+/*
+ * One level of the path from the root to a leaf.  We keep block
+ * numbers rather than pointers, as the cache may have recycled the
+ * upper levels by the time we step back up to them.
+ */
+struct dx_frame {
+    uint32_t block;		/* Logical block of the node */
+    uint16_t offset;		/* Offset of the dx entries in the block */
+    uint16_t count;		/* Number of entries */
+    uint16_t at;		/* Entry we followed */
+};
+
+static const struct ext2_dx_entry *
+dx_entries(struct inode *dir, const struct dx_frame *frame)
+{
+    const char *data = ext2_get_cache(dir, frame->block);
+    return (const struct ext2_dx_entry *)(data + frame->offset);
+}
+
+/* Load an index node and point the frame at its first entry */
+static const struct ext2_dx_entry *
+dx_load_node(struct inode *dir, struct dx_frame *frame, uint32_t block,
+	     int offset)
+{
+    struct fs_info *fs = dir->fs;
+    const struct ext2_dx_entry *entries;
+    const struct ext2_dx_countlimit *cl;
+
+    if ((uint64_t)block << fs->block_shift >= dir->size)
+	return NULL;
+
+    frame->block = block;
+    frame->offset = offset;
+    frame->at = 0;
+
+    entries = dx_entries(dir, frame);
+    cl = (const struct ext2_dx_countlimit *)entries;
+    frame->count = cl->count;
+
+    /* The entries must fit in the block */
+    if (!cl->count || cl->count > cl->limit ||
+	offset + cl->limit * sizeof *entries > BLOCK_SIZE(fs))
+	return NULL;
+
+    return entries;
+}
+
+/*
+ * Find the entry covering hash: the last one whose hash is less than or
+ * equal to it.  The first entry covers everything below the second one.
+ */
+static void dx_search_node(struct dx_frame *frame,
+			   const struct ext2_dx_entry *entries, uint32_t hash)
+{
+    int p = 1, q = frame->count - 1, m;
+
+    while (p <= q) {
+	m = p + (q - p) / 2;
+	if (entries[m].hash > hash)
+	    q = m - 1;
+	else
+	    p = m + 1;
+    }
+    frame->at = p - 1;
+}
+
+/*
+ * Look a name up through the directory index.
+ *
+ * Returns 1 and sets *dep if found, 0 if the name is not in the
+ * directory, or -1 if the index can't be used.
+ */
+int ext2_htree_find(struct inode *dir, const char *name, size_t len,
+		    const struct ext2_dir_entry **dep)
+{
+    struct fs_info *fs = dir->fs;
+    struct dx_frame frames[EXT2_DX_MAX_LEVELS], *frame;
+    const struct ext2_dx_root_info *info;
+    const struct ext2_dx_entry *entries;
+    const struct ext2_dir_entry *de;
+    const char *data;
+    uint32_t hash, block;
+    int version, levels, offset;
+
+    data = ext2_get_cache(dir, 0);
+
+    /* The root info follows the "." and ".." entries, 12 bytes each */
+    info = (const struct ext2_dx_root_info *)(data + 24);
+    version = info->hash_version;
+    levels = info->indirect_levels;
+    offset = 24 + info->info_length;
+    if (info->unused_flags & 1 || levels >= EXT2_DX_MAX_LEVELS ||
+	info->info_length < 8)
+	return -1;
+
+    if (version <= EXT2_HASH_TEA && EXT2_SB(fs)->s_hash_unsigned)
+	version += EXT2_HASH_LEGACY_UNSIGNED;
+    if (dx_hash(fs, version, name, len, &hash))
+	return -1;
+
+    /* Walk down to the leaf; interior nodes start with an empty dirent */
+    frame = frames;
+    block = 0;
+    while (1) {
+	entries = dx_load_node(dir, frame, block, offset);
+	if (!entries)
+	    return -1;
+	dx_search_node(frame, entries, hash);
+	block = entries[frame->at].block & DX_BLOCK_MASK;
+	if (frame == frames + levels)
+	    break;
+	frame++;
+	offset = 8;
+    }
+
+    while (1) {
+	if ((uint64_t)block << fs->block_shift >= dir->size)
+	    return -1;
+
+	data = ext2_get_cache(dir, block);
+	de = ext2_search_dirblock(data, BLOCK_SIZE(fs), name, len);
+	if (de) {
+	    *dep = de;
+	    return 1;
+	}
+
+	/*
+	 * Names with the same hash can spill over into the next leaf,
+	 * in which case its hash has the low (continuation) bit set.
+	 * Step to the next entry, moving up the tree as needed...
+	 */
+	while (++frame->at >= frame->count) {
+	    if (frame == frames)
+		return 0;	/* End of the index */
+	    frame--;
+	}
+	entries = dx_entries(dir, frame);
+	if ((entries[frame->at].hash & ~1) != hash)
+	    return 0;
+
+	/* ... and back down to the first leaf below it */
+	block = entries[frame->at].block & DX_BLOCK_MASK;
+	while (frame < frames + levels) {
+	    entries = dx_load_node(dir, ++frame, block, 8);
+	    if (!entries)
+		return -1;
+	    block = entries[0].block & DX_BLOCK_MASK;
+	}
+    }
+}
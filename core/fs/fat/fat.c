@@ -4,6 +4,7 @@
 #include <string.h>
 #include <sys/dirent.h>
 #include <cache.h>
+#include <dcache.h>
 #include <core.h>
 #include <disk.h>
 #include <fs.h>
@@ -84,6 +85,77 @@ static uint32_t get_next_cluster(struct fs_info *fs, uint32_t clust_num)
     return next_cluster;
 }
 
+/*
+ * Decode FAT sector FAT_SECTOR into a table holding, for every
+ * cluster it describes, the number of links which follow it to the
+ * physically next cluster.  The count stops at the end of the sector,
+ * the caller carries on with the next one.  FAT16 and FAT32 only.
+ */
+static const uint16_t *get_fat_runs(struct fs_info *fs, sector_t fat_sector)
+{
+    struct fat_sb_info *sbi = FAT_SB(fs);
+    uint32_t entries = UINT32_C(1) << sbi->run_shift;
+    int slot = fat_sector % FAT_RUN_SLOTS;
+    uint16_t *runs = sbi->runs + (slot << sbi->run_shift);
+    uint32_t base = fat_sector << sbi->run_shift;
+    uint32_t i, next, run;
+    const void *data;
+
+    if (sbi->run_sector[slot] == fat_sector)
+	return runs;
+
+    data = get_fat_sector(fs, fat_sector);
+    run = 0;
+    for (i = entries; i--; ) {
+	if (sbi->fat_type == FAT32)
+	    next = ((const uint32_t *)data)[i] & 0x0fffffff;
+	else
+	    next = ((const uint16_t *)data)[i];
+
+	run = (next == base + i + 1) ? run + 1 : 0;
+	runs[i] = run;
+    }
+    sbi->run_sector[slot] = fat_sector;
+
+    return runs;
+}
+
+/*
+ * Return how many of the (at most MAX) clusters following CLUSTER in
+ * its chain are simply CLUSTER+1, CLUSTER+2, ...  With the decoded FAT
+ * sectors this costs one step per FAT sector instead of one per
+ * cluster.
+ */
+static uint32_t fat_cluster_run(struct fs_info *fs, uint32_t cluster,
+				uint32_t max)
+{
+    struct fat_sb_info *sbi = FAT_SB(fs);
+    uint32_t done = 0;
+    uint32_t run;
+
+    if (!sbi->runs) {
+	/* FAT12 entries straddle sectors; just walk the chain */
+	while (done < max && get_next_cluster(fs, cluster) == cluster + 1) {
+	    cluster++;
+	    done++;
+	}
+	return done;
+    }
+
+    while (done < max) {
+	run = get_fat_runs(fs, cluster >> sbi->run_shift)
+	    [cluster & ((UINT32_C(1) << sbi->run_shift) - 1)];
+	if (!run)
+	    break;
+	if (run > max - done)
+	    run = max - done;
+	cluster += run;
+	done += run;
+    }
+
+    return done;
+}
+
 static int fat_next_extent(struct inode *inode, uint32_t lstart)
 {
     struct fs_info *fs = inode->fs;
@@ -93,8 +165,8 @@ static int fat_next_extent(struct inode *inode, uint32_t lstart)
     uint32_t pcluster;
     uint32_t tcluster;
     uint32_t xcluster;
+    uint32_t run;
     const uint32_t cluster_bytes = UINT32_C(1) << sbi->clust_byte_shift;
-    const uint32_t cluster_secs  = UINT32_C(1) << sbi->clust_shift;
     sector_t data_area = sbi->data;
 
     tcluster = (inode->size + cluster_bytes - 1) >> sbi->clust_byte_shift;
@@ -118,21 +190,30 @@ static int fat_next_extent(struct inode *inode, uint32_t lstart)
 	if (lcluster >= mcluster)
 	    break;
 
+	/* Skip contiguous runs of the chain in one go */
+	run = fat_cluster_run(fs, pcluster, mcluster - lcluster);
+	if (run) {
+	    lcluster += run;
+	    pcluster += run;
+	    continue;
+	}
+
 	lcluster++;
 	pcluster = get_next_cluster(fs, pcluster);
     }
 
     inode->next_extent.pstart =
 	((sector_t)(pcluster-2) << sbi->clust_shift) + data_area;
-    inode->next_extent.len = cluster_secs;
-    xcluster = 0;		/* Nonsense */
 
-    while (++lcluster < tcluster) {
+    /* Extend the extent over the contiguous part of the chain */
+    run = fat_cluster_run(fs, pcluster, tcluster - lcluster - 1);
+    inode->next_extent.len = (run + 1) << sbi->clust_shift;
+    lcluster += run + 1;
+    pcluster += run;
+
+    xcluster = 0;		/* Nonsense */
+    if (lcluster < tcluster)
 	xcluster = get_next_cluster(fs, pcluster);
-	if (xcluster != ++pcluster)
-	    break;		/* Not contiguous */
-	inode->next_extent.len += cluster_secs;
-    }
 
     /* Note: ->here is bogus if ->offset >= EOF, but that's okay */
     PVT(inode)->offset = lcluster << sbi->clust_shift;
@@ -435,10 +516,294 @@ static inline enum dirent_type get_inode_mode(uint8_t attr)
 }
 
 
+/*
+ * Build an inode from its short directory entry.  The inode number is
+ * the first sector of the file, which is unique and lets directories
+ * be told apart in the lookup cache.
+ */
+static struct inode *vfat_new_inode(struct fs_info *fs,
+				    const struct fat_dir_entry *de)
+{
+    struct inode *inode;
+
+    inode = new_fat_inode(fs);
+    inode->size = de->file_size;
+    PVT(inode)->start_cluster = 
+	(de->first_cluster_high << 16) + de->first_cluster_low;
+    if (PVT(inode)->start_cluster == 0) {
+	/* Root directory */
+	int root_size = FAT_SB(fs)->root_size;
+
+	PVT(inode)->start_cluster = FAT_SB(fs)->root_cluster;
+	inode->size = root_size ? root_size << fs->sector_shift : ~0;
+	PVT(inode)->start = PVT(inode)->here = FAT_SB(fs)->root;
+    } else {
+	PVT(inode)->start = PVT(inode)->here = first_sector(fs, de);
+    }
+    inode->ino = PVT(inode)->start;
+    inode->mode = get_inode_mode(de->attr);
+
+    return inode;
+}
+
+/*
+ * Hashed name indexes for directories.
+ *
+ * Looking a name up in a FAT directory means walking every entry in
+ * it, which adds up quickly in directories with thousands of files.
+ * The first lookup in a directory instead records all of its names in
+ * a hash table, and later lookups - including ones for names that do
+ * not exist - are answered from there.  Only the most recently used
+ * FAT_DIR_INDEXES directories are kept.
+ */
+static uint32_t vfat_index_hash(char type, const char *key)
+{
+    uint32_t hash = 2166136261u ^ (uint8_t)type;
+
+    while (*key) {
+	hash ^= (uint8_t)*key++;
+	hash *= 16777619;
+    }
+    return hash;
+}
+
+static void vfat_index_free(struct fat_dir_index *ix)
+{
+    free(ix->buckets);
+    free(ix->names);
+    free(ix->pool);
+    memset(ix, 0, sizeof *ix);
+}
+
+/*
+ * Add one key, prefixed with its type ('L'ong or 'S'hort), to the index.
+ * Returns -1 if we ran out of memory.
+ */
+static int vfat_index_add(struct fat_dir_index *ix, uint32_t *names_size,
+			  uint32_t *pool_len, uint32_t *pool_size, char type,
+			  const char *key, const struct fat_dir_entry *de)
+{
+    struct fat_dir_name *name;
+    int len = strlen(key) + 2;
+
+    if (ix->count >= FAT_DIR_INDEX_MAX) {
+	ix->complete = false;
+	return 0;
+    }
+
+    if (ix->count >= *names_size) {
+	*names_size = *names_size ? *names_size * 2 : 64;
+	name = realloc(ix->names, *names_size * sizeof *name);
+	if (!name)
+	    return -1;
+	ix->names = name;
+    }
+
+    if (*pool_len + len > *pool_size) {
+	char *pool;
+
+	*pool_size = *pool_size ? *pool_size * 2 : 1024;
+	pool = realloc(ix->pool, *pool_size);
+	if (!pool)
+	    return -1;
+	ix->pool = pool;
+    }
+
+    name = &ix->names[ix->count++];
+    name->hash = vfat_index_hash(type, key);
+    name->key = *pool_len;
+    memcpy(&name->de, de, sizeof *de);
+
+    ix->pool[(*pool_len)++] = type;
+    memcpy(ix->pool + *pool_len, key, len - 1);
+    *pool_len += len - 1;
+
+    return 0;
+}
+
+/*
+ * Scan the directory starting at dir_sector and index all its names.
+ */
+static int vfat_index_build(struct fs_info *fs, struct fat_dir_index *ix,
+			    sector_t dir_sector)
+{
+    const struct fat_dir_entry *de;
+    const struct fat_long_name_entry *long_de;
+    uint16_t long_name[261];	/* == 20*13 + 1 (to guarantee null) */
+    char key[261];
+    uint32_t names_size = 0, pool_len = 0, pool_size = 0;
+    uint8_t vfat_next, vfat_csum;
+    uint8_t id;
+    bool long_entry = false;
+    int entries;
+    uint32_t i, b;
+
+    ix->dir = dir_sector;
+    ix->complete = true;
+    vfat_next = vfat_csum = 0xff;
+
+    while (dir_sector) {
+	de = get_cache(fs->fs_dev, dir_sector);
+	entries = 1 << (fs->sector_shift - 5);
+
+	while (entries--) {
+	    if (de->name[0] == 0)
+		goto done;
+	    if ((uint8_t)de->name[0] == 0xe5)
+		goto invalid;
+
+	    if (de->attr == 0x0f) {
+		long_de = (const struct fat_long_name_entry *)de;
+		id = long_de->id;
+
+		if (id & 0x40) {
+		    vfat_csum = long_de->checksum;
+		    id &= 0x3f;
+		    if (id > 20)
+			goto invalid;
+		    memset(long_name, 0, sizeof long_name);
+		} else if (long_de->checksum != vfat_csum || id != vfat_next) {
+		    goto invalid;
+		}
+
+		vfat_next = --id;
+		copy_long_chunk(long_name + id*13, de);
+
+		if (id == 0) {
+		    if (vfat_cvt_longname(key, long_name) > 0)
+			long_entry = true;
+		    else
+			ix->complete = false; /* Can't rule out a match */
+		}
+		de++;
+		continue;
+	    }
+
+	    if (de->attr & 0x08) /* ignore volume labels */
+		goto invalid;
+
+	    if (long_entry && get_checksum(de->name) == vfat_csum) {
+		char *p;
+
+		for (p = key; *p; p++)
+		    *p = codepage.upper[(uint8_t)*p];
+		if (vfat_index_add(ix, &names_size, &pool_len, &pool_size,
+				   'L', key, de))
+		    goto nomem;
+	    }
+
+	    memcpy(key, de->name, 11);
+	    key[11] = '\0';
+	    if (vfat_index_add(ix, &names_size, &pool_len, &pool_size,
+			       'S', key, de))
+		goto nomem;
+
+	invalid:
+	    long_entry = false;
+	    de++;
+	}
+
+	dir_sector = get_next_sector(fs, dir_sector);
+    }
+
+done:
+    for (ix->hash_mask = 15; ix->hash_mask < ix->count; )
+	ix->hash_mask = (ix->hash_mask << 1) | 1;
+
+    ix->buckets = malloc((ix->hash_mask + 1) * sizeof(uint32_t));
+    if (!ix->buckets)
+	goto nomem;
+    memset(ix->buckets, 0xff, (ix->hash_mask + 1) * sizeof(uint32_t));
+
+    for (i = 0; i < ix->count; i++) {
+	b = ix->names[i].hash & ix->hash_mask;
+	ix->names[i].next = ix->buckets[b];
+	ix->buckets[b] = i;
+    }
+
+    dprintf("fat: indexed %u names of directory at sector %llu%s\n",
+	    ix->count, (unsigned long long)ix->dir,
+	    ix->complete ? "" : " (partial)");
+    return 0;
+
+nomem:
+    vfat_index_free(ix);
+    return -1;
+}
+
+static const struct fat_dir_entry *
+vfat_index_search(const struct fat_dir_index *ix, char type, const char *key)
+{
+    uint32_t hash = vfat_index_hash(type, key);
+    uint32_t i;
+    const char *p;
+
+    for (i = ix->buckets[hash & ix->hash_mask]; i != (uint32_t)-1;
+	 i = ix->names[i].next) {
+	if (ix->names[i].hash != hash)
+	    continue;
+	p = ix->pool + ix->names[i].key;
+	if (p[0] == type && !strcmp(p + 1, key))
+	    return &ix->names[i].de;
+    }
+    return NULL;
+}
+
+/*
+ * Look up dname, and its short name version mangled, in the index of
+ * the directory starting at dir_sector, building the index if needed.
+ *
+ * Returns 1 and sets *dep if found, 0 if the name definitely does not
+ * exist, or -1 if the directory has to be scanned the slow way.
+ */
+static int vfat_index_find(struct fs_info *fs, sector_t dir_sector,
+			   const char *dname, const char *mangled,
+			   const struct fat_dir_entry **dep)
+{
+    struct fat_sb_info *sbi = FAT_SB(fs);
+    struct fat_dir_index *ix, *victim;
+    char key[261];
+    int i;
+
+    if (!sbi->dir_index)
+	return -1;
+
+    victim = sbi->dir_index;
+    for (i = 0; i < FAT_DIR_INDEXES; i++) {
+	ix = &sbi->dir_index[i];
+	if (ix->dir == dir_sector)
+	    goto found;
+	if (ix->last_used < victim->last_used)
+	    victim = ix;
+    }
+
+    ix = victim;
+    vfat_index_free(ix);
+    if (vfat_index_build(fs, ix, dir_sector))
+	return -1;
+
+found:
+    ix->last_used = ++sbi->dir_index_clock;
+
+    for (i = 0; dname[i]; i++) {
+	if (i >= 260)
+	    return 0;		/* Name too long */
+	key[i] = codepage.upper[(uint8_t)dname[i]];
+    }
+    key[i] = '\0';
+
+    *dep = vfat_index_search(ix, 'L', key);
+    if (!*dep)
+	*dep = vfat_index_search(ix, 'S', mangled);
+    if (*dep)
+	return 1;
+
+    return ix->complete ? 0 : -1;
+}
+
 static struct inode *vfat_find_entry(const char *dname, struct inode *dir)
 {
     struct fs_info *fs = dir->fs;
-    struct inode *inode;
     const struct fat_dir_entry *de;
     struct fat_long_name_entry *long_de;
 
@@ -465,6 +830,15 @@ static struct inode *vfat_find_entry(const char *dname, struct inode *dir)
     /* Produce the shortname version, in case we need it. */
     mangle_dos_name(mangled_name, dname);
 
+    switch (vfat_index_find(fs, dir_sector, dname, mangled_name, &de)) {
+    case 1:
+	goto found;
+    case 0:
+	return NULL;
+    default:
+	break;			/* Search the directory itself */
+    }
+
     while (dir_sector) {
 	de = get_cache(fs->fs_dev, dir_sector);
 	entries = 1 << (fs->sector_shift - 5);
@@ -545,23 +919,8 @@ static struct inode *vfat_find_entry(const char *dname, struct inode *dir)
     return NULL;		/* Nothing found... */
 
 found:
-    inode = new_fat_inode(fs);
-    inode->size = de->file_size;
-    PVT(inode)->start_cluster = 
-	(de->first_cluster_high << 16) + de->first_cluster_low;
-    if (PVT(inode)->start_cluster == 0) {
-	/* Root directory */
-	int root_size = FAT_SB(fs)->root_size;
-
-	PVT(inode)->start_cluster = FAT_SB(fs)->root_cluster;
-	inode->size = root_size ? root_size << fs->sector_shift : ~0;
-	PVT(inode)->start = PVT(inode)->here = FAT_SB(fs)->root;
-    } else {
-	PVT(inode)->start = PVT(inode)->here = first_sector(fs, de);
-    }
-    inode->mode = get_inode_mode(de->attr);
-
-    return inode;
+    dcache_insert(dir, dname, 0, de, sizeof *de);
+    return vfat_new_inode(fs, de);
 }
 
 static struct inode *vfat_iget_root(struct fs_info *fs)
@@ -576,6 +935,7 @@ static struct inode *vfat_iget_root(struct fs_info *fs)
     PVT(inode)->start_cluster = FAT_SB(fs)->root_cluster;
     inode->size = root_size ? root_size << fs->sector_shift : ~0;
     PVT(inode)->start = PVT(inode)->here = FAT_SB(fs)->root;
+    inode->ino = PVT(inode)->start;
     inode->mode = DT_DIR;
 
     return inode;
@@ -583,6 +943,12 @@ static struct inode *vfat_iget_root(struct fs_info *fs)
 
 static struct inode *vfat_iget(const char *dname, struct inode *parent)
 {
+    const struct dentry *dc;
+
+    dc = dcache_lookup(parent, dname);
+    if (dc)
+	return vfat_new_inode(parent->fs, (const void *)dc->data);
+
     return vfat_find_entry(dname, parent);
 }
 
@@ -778,6 +1144,26 @@ static int vfat_fs_init(struct fs_info *fs)
     }
     sbi->clusters = clusters;
 
+    /* Decoded FAT sectors for walking cluster chains */
+    sbi->runs = NULL;
+    sbi->run_sector = NULL;
+    if (sbi->fat_type != FAT12) {
+	sbi->run_shift = fs->sector_shift - (sbi->fat_type == FAT32 ? 2 : 1);
+	sbi->run_sector = malloc(FAT_RUN_SLOTS * sizeof(sector_t));
+	sbi->runs = malloc((FAT_RUN_SLOTS * sizeof(uint16_t)) << sbi->run_shift);
+	if (!sbi->run_sector || !sbi->runs) {
+	    free(sbi->run_sector);
+	    free(sbi->runs);
+	    sbi->runs = NULL;	/* Walk the chain one cluster at a time */
+	} else {
+	    memset(sbi->run_sector, 0xff, FAT_RUN_SLOTS * sizeof(sector_t));
+	}
+    }
+
+    /* Directory name indexes; without them we just scan directories */
+    sbi->dir_index = zalloc(FAT_DIR_INDEXES * sizeof(struct fat_dir_index));
+    sbi->dir_index_clock = 0;
+
     /* fs UUID - serial number */
     if (FAT32 == sbi->fat_type)
 	sbi->uuid = fat.fat32.num_serial;
@@ -2,6 +2,7 @@
 #define FAT_FS_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
 #define FAT_DIR_ENTRY_SIZE 32
 #define DIRENT_SHIFT 5
@@ -100,8 +101,22 @@ struct fat_sb_info {
 	int      fat_type;
 
 	uint32_t uuid;             /* fs UUID */
+
+	/* Decoded FAT sectors, see fat_cluster_run() */
+	sector_t *run_sector;	  /* FAT sector held by each slot */
+	uint16_t *runs;		  /* Contiguous run lengths, per slot */
+	int      run_shift;	  /* log2(FAT entries per sector) */
+
+	/* Name indexes of recently searched directories */
+	struct fat_dir_index *dir_index;
+	uint32_t dir_index_clock;
 } __attribute__ ((packed));
 
+/*
+ * Number of decoded FAT sectors kept around for cluster chain walking
+ */
+#define FAT_RUN_SLOTS	16
+
 struct fat_dir_entry {
         char     name[11];
         uint8_t  attr;
@@ -131,6 +146,32 @@ struct fat_long_name_entry {
         uint16_t name3[2];
 } __attribute__ ((packed));
 
+/*
+ * Hashed name index of one directory, see vfat_index_find().  Every
+ * entry is indexed under its 11-byte short name and, if it has one,
+ * under its upper-cased long name.
+ */
+struct fat_dir_name {
+	uint32_t hash;
+	uint32_t next;		  /* Next name in the bucket, or -1 */
+	uint32_t key;		  /* Offset of the key in the name pool */
+	struct fat_dir_entry de;  /* Copy of the short entry */
+};
+
+struct fat_dir_index {
+	sector_t dir;		  /* First sector of the directory, 0 = free */
+	uint32_t last_used;
+	bool     complete;	  /* Every entry made it into the index */
+	uint32_t count;
+	uint32_t hash_mask;
+	uint32_t *buckets;
+	struct fat_dir_name *names;
+	char     *pool;
+};
+
+#define FAT_DIR_INDEXES		4	/* Directories indexed at once */
+#define FAT_DIR_INDEX_MAX	16384	/* Names per directory index */
+
 static inline struct fat_sb_info *FAT_SB(struct fs_info *fs)
 {
         return fs->fs_info;
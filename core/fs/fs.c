@@ -49,6 +49,7 @@ void put_inode(struct inode *inode)
 	inode = dead->parent;
 	if (dead->name)
 	    free((char *)dead->name);
+	free(dead->extent_map);
 	free(dead);
     }
 }
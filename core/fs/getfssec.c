@@ -51,12 +51,31 @@
  * Note: the filesystem driver is not required to do extent coalescing,
  * if that is difficult to do; this routine will perform extent lookahead
  * and coalescing.
+ *
+ * Every extent returned by next_extent() is also recorded in a sorted
+ * per-inode extent map, so seeking backwards or reading a file again
+ * doesn't make the driver walk its block map from the start again.
+ * A driver which can decode a whole block map at once may also fill the
+ * map itself with extent_map_insert(), and use extent_map_find() for
+ * its own lookups.
  */
 
 #include <dprintf.h>
 #include <minmax.h>
 #include "fs.h"
 
+/*
+ * Sequential runs of reads at least this large which reach the end of
+ * the file are accounted as streamed reads in disk->stats.  A seek
+ * starts a new run.
+ */
+#define STREAM_MIN_BYTES	(1 << 20)
+
+/*
+ * Upper bound for the number of extents remembered per inode.
+ */
+#define EXTENT_MAP_MAX		1024
+
 static inline sector_t next_psector(sector_t psector, uint32_t skip)
 {
     if (EXTENT_SPECIAL(psector))
@@ -71,14 +90,130 @@ static inline sector_t next_pstart(const struct extent *e)
 }
 
 
+/*
+ * Find the index of the first extent in the map which ends beyond
+ * LSTART; this is the extent containing LSTART, if there is one.
+ */
+static uint32_t extent_map_search(const struct extent_map *map,
+				  uint32_t lstart)
+{
+    uint32_t lo = 0, hi = map->count;
+
+    while (lo < hi) {
+	uint32_t mid = (lo + hi) >> 1;
+	const struct extent *e = &map->ext[mid];
+
+	if (e->lstart + e->len <= lstart)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+
+    return lo;
+}
+
+/*
+ * Return the first extent in the map which ends beyond LSTART, or NULL.
+ * If it starts beyond LSTART, the map knows nothing of LSTART itself.
+ */
+const struct extent *extent_map_find(const struct inode *inode,
+				     uint32_t lstart)
+{
+    const struct extent_map *map = inode->extent_map;
+    uint32_t i;
+
+    if (!map)
+	return NULL;
+
+    i = extent_map_search(map, lstart);
+    return i < map->count ? &map->ext[i] : NULL;
+}
+
+static bool extent_map_lookup(struct inode *inode, uint32_t lstart)
+{
+    const struct extent *e;
+    uint32_t delta;
+
+    e = extent_map_find(inode, lstart);
+    if (!e || e->lstart > lstart)
+	return false;
+
+    delta = lstart - e->lstart;
+    inode->next_extent.pstart = next_psector(e->pstart, delta);
+    inode->next_extent.len = e->len - delta;
+    return true;
+}
+
+/*
+ * Record an extent in the map.  Returns false if the map is full, or
+ * out of memory, and the extent wasn't recorded.
+ */
+bool extent_map_insert(struct inode *inode, const struct extent *new)
+{
+    struct extent_map *map = inode->extent_map;
+    struct extent ext = *new;
+    struct extent *e;
+    uint32_t i;
+
+    if (!ext.len || ext.pstart == EXTENT_VOID)
+	return true;
+
+    i = map ? extent_map_search(map, ext.lstart) : 0;
+
+    if (map) {
+	e = &map->ext[i];
+
+	/* Don't overlap the extent which follows */
+	if (i < map->count) {
+	    if (e->lstart <= ext.lstart)
+		return true;	/* Already known */
+	    if (ext.lstart + ext.len > e->lstart)
+		ext.len = e->lstart - ext.lstart;
+	}
+
+	/* Merge with the preceding extent if it is contiguous */
+	if (i > 0 && e[-1].lstart + e[-1].len == ext.lstart &&
+	    !EXTENT_SPECIAL(ext.pstart) && next_pstart(&e[-1]) == ext.pstart) {
+	    e[-1].len += ext.len;
+	    return true;
+	}
+    }
+
+    if (!map || map->count == map->size) {
+	uint32_t size = map ? map->size << 1 : 8;
+
+	if (size > EXTENT_MAP_MAX)
+	    return false;
+
+	map = realloc(map, sizeof *map + size * sizeof(struct extent));
+	if (!map)
+	    return false;
+	if (!inode->extent_map)
+	    map->count = 0;
+	map->size = size;
+	inode->extent_map = map;
+    }
+
+    e = &map->ext[i];
+    memmove(e + 1, e, (map->count - i) * sizeof *e);
+    *e = ext;
+    map->count++;
+    return true;
+}
+
 static void get_next_extent(struct inode *inode)
 {
     /* The logical start address that we care about... */
     uint32_t lstart = inode->this_extent.lstart + inode->this_extent.len;
 
-    if (inode->fs->fs_ops->next_extent(inode, lstart))
-	inode->next_extent.len = 0; /* ERROR */
-    inode->next_extent.lstart = lstart;
+    if (extent_map_lookup(inode, lstart)) {
+	inode->next_extent.lstart = lstart;
+    } else {
+	if (inode->fs->fs_ops->next_extent(inode, lstart))
+	    inode->next_extent.len = 0; /* ERROR */
+	inode->next_extent.lstart = lstart;
+	extent_map_insert(inode, &inode->next_extent);
+    }
 
     dprintf("Extent: inode %p @ %u start %llu len %u\n",
 	    inode, inode->next_extent.lstart,
@@ -103,6 +238,11 @@ uint32_t generic_getfssec(struct file *file, char *buf,
     if (!sectors)
 	return 0;
 
+    if (!file->offset || file->offset != file->end_offset) {
+	file->start_ms = ms_timer();
+	file->start_offset = file->offset;
+    }
+
     lsector = file->offset >> SECTOR_SHIFT(fs);
     dprintf("Offset: %u  lsector: %u\n", file->offset, lsector);
 
@@ -186,6 +326,19 @@ uint32_t generic_getfssec(struct file *file, char *buf,
 
     bytes_read = min(bytes_read, bytes_left);
     file->offset += bytes_read;
+    file->end_offset = file->offset;
+
+    if (bytes_read == bytes_left &&
+	file->offset - file->start_offset >= STREAM_MIN_BYTES) {
+	uint32_t bytes = file->offset - file->start_offset;
+	uint32_t ms = ms_timer() - file->start_ms;
+
+	disk->stats.stream_bytes += bytes;
+	disk->stats.stream_ms += ms;
+	dprintf("getfssec: inode %p: %u bytes in %u ms (%u KiB/s)\n",
+		inode, bytes, ms,
+		ms ? (uint32_t)((uint64_t)(bytes >> 10) * 1000 / ms) : 0);
+    }
 
     if (have_more)
 	*have_more = bytes_read < bytes_left;
@@ -4,9 +4,11 @@
 #include <sys/dirent.h>
 #include <core.h>
 #include <cache.h>
+#include <dcache.h>
 #include <disk.h>
 #include <fs.h>
 #include <stdlib.h>
+#include <byteswap.h>
 #include "iso9660_fs.h"
 #include "susp_rr.h"
 
@@ -63,10 +65,67 @@ done:
     return p - dst;
 }
 
+/*
+ * Same as iso_convert_name(), for the UCS-2 (big endian) names of a
+ * Joliet directory tree.  They are converted to UTF-8, truncated to
+ * fit in 255 bytes.
+ */
+static size_t iso_convert_joliet(char *dst, const char *src, int len)
+{
+    const uint8_t *s = (const uint8_t *)src;
+    char *p = dst;
+    uint16_t c;
+
+    /* "." and ".." are the same single bytes as in the primary tree */
+    if (len == 1)
+	return iso_convert_name(dst, src, len);
+
+    for (; len >= 2; len -= 2, s += 2) {
+	c = (s[0] << 8) | s[1];
+	if (!c || c == ';')	/* Remove any filename version suffix */
+	    break;
+
+	if (c < 0x80) {
+	    if (p > dst + 254)
+		break;
+	    *p++ = iso_tolower(c);
+	} else if (c < 0x800) {
+	    if (p > dst + 253)
+		break;
+	    *p++ = 0xc0 | (c >> 6);
+	    *p++ = 0x80 | (c & 0x3f);
+	} else {
+	    if (p > dst + 252)
+		break;
+	    *p++ = 0xe0 | (c >> 12);
+	    *p++ = 0x80 | ((c >> 6) & 0x3f);
+	    *p++ = 0x80 | (c & 0x3f);
+	}
+    }
+
+    /* Then remove any terminal dots */
+    while (p > dst+1 && p[-1] == '.')
+	p--;
+
+    *p = '\0';
+    return p - dst;
+}
+
+/* The name of a directory record, without Rock Ridge */
+static size_t iso_get_name(struct fs_info *fs, char *dst,
+			   const struct iso_dir_entry *de)
+{
+    if (ISO_SB(fs)->joliet)
+	return iso_convert_joliet(dst, de->name, de->name_len);
+
+    return iso_convert_name(dst, de->name, de->name_len);
+}
+
 /* 
  * Unlike strcmp, it does return 1 on match, or reutrn 0 if not match.
  */
-static bool iso_compare_name(const char *de_name, size_t len,
+static bool iso_compare_name(struct fs_info *fs,
+			     const struct iso_dir_entry *de,
 			     const char *file_name)
 {
     char iso_file_name[256];
@@ -74,7 +133,7 @@ static bool iso_compare_name(const char *de_name, size_t len,
     char c1, c2;
     int i;
     
-    i = iso_convert_name(iso_file_name, de_name, len);
+    i = iso_get_name(fs, iso_file_name, de);
     (void)i;
     dprintf("Compare: \"%s\" to \"%s\" (len %zu)\n",
 	    file_name, iso_file_name, i);
@@ -92,22 +151,244 @@ static bool iso_compare_name(const char *de_name, size_t len,
 }
 
 /*
- * Find a entry in the specified dir with name _dname_.
+ * Hashed name indexes for directories.
+ *
+ * Finding a name means walking every record of the directory and
+ * decoding its Rock Ridge name, which adds up in live images with
+ * thousands of files in a directory.  The first lookup in a directory
+ * instead records all of its names in a hash table, which later
+ * lookups - including ones for names that do not exist - are answered
+ * from.  Only the most recently used ISO_DIR_INDEXES directories are
+ * kept.  Names are hashed in lower case, so that one hash serves both
+ * Rock Ridge names (matched exactly) and ISO 9660 names (matched
+ * regardless of case).
+ */
+static uint32_t iso_index_hash(const char *name)
+{
+    uint32_t hash = 2166136261u;
+
+    while (*name) {
+	hash ^= (uint8_t)iso_tolower(*name++);
+	hash *= 16777619;
+    }
+    return hash;
+}
+
+static void iso_index_free(struct iso_dir_index *ix)
+{
+    free(ix->buckets);
+    free(ix->names);
+    free(ix->pool);
+    memset(ix, 0, sizeof *ix);
+}
+
+/*
+ * Add one name to the index.  Returns -1 if we ran out of memory.
+ */
+static int iso_index_add(struct iso_dir_index *ix, uint32_t *names_size,
+			 uint32_t *pool_len, uint32_t *pool_size,
+			 const char *name, int len, bool rr,
+			 uint32_t block, uint16_t offset)
+{
+    struct iso_dir_name *n;
+
+    if (ix->count >= ISO_DIR_INDEX_MAX) {
+	ix->complete = false;
+	return 0;
+    }
+
+    if (ix->count >= *names_size) {
+	*names_size = *names_size ? *names_size * 2 : 64;
+	n = realloc(ix->names, *names_size * sizeof *n);
+	if (!n)
+	    return -1;
+	ix->names = n;
+    }
+
+    while (*pool_len + len + 1 > *pool_size) {
+	char *pool;
+
+	*pool_size = *pool_size ? *pool_size * 2 : 2048;
+	pool = realloc(ix->pool, *pool_size);
+	if (!pool)
+	    return -1;
+	ix->pool = pool;
+    }
+
+    n = &ix->names[ix->count++];
+    n->hash = iso_index_hash(name);
+    n->key = *pool_len;
+    n->block = block;
+    n->offset = offset;
+    n->rr = rr;
+
+    memcpy(ix->pool + *pool_len, name, len + 1);
+    *pool_len += len + 1;
+
+    return 0;
+}
+
+/*
+ * Read every record of the directory and index its name.
+ */
+static int iso_index_build(struct fs_info *fs, struct iso_dir_index *ix,
+			   struct inode *dir)
+{
+    const struct iso_dir_entry *de;
+    const char *data;
+    char name[256];
+    uint32_t names_size = 0, pool_len = 0, pool_size = 0;
+    uint32_t block, i, b;
+    int offset, de_len, len;
+    bool rr;
+
+    ix->dir = PVT(dir)->lba;
+    ix->complete = true;
+
+    for (block = PVT(dir)->lba; block < PVT(dir)->lba + dir->blocks;
+	 block++) {
+	data = get_cache(fs->fs_dev, block);
+
+	for (offset = 0; ; offset += de_len) {
+	    de = (const struct iso_dir_entry *)(data + offset);
+	    de_len = de->length;
+
+	    /* See iso_find_entry() */
+	    if (de_len < 33 || offset + de_len > BLOCK_SIZE(fs))
+		break;
+
+	    rr = susp_rr_copy_nm(fs, (char *)de, name, &len) > 0;
+	    if (!rr)
+		len = iso_get_name(fs, name, de);
+
+	    if (iso_index_add(ix, &names_size, &pool_len, &pool_size,
+			      name, len, rr, block, offset))
+		goto nomem;
+	}
+    }
+
+    for (ix->hash_mask = 15; ix->hash_mask < ix->count; )
+	ix->hash_mask = (ix->hash_mask << 1) | 1;
+
+    ix->buckets = malloc((ix->hash_mask + 1) * sizeof(uint32_t));
+    if (!ix->buckets)
+	goto nomem;
+    memset(ix->buckets, 0xff, (ix->hash_mask + 1) * sizeof(uint32_t));
+
+    /* Backwards, so the first of duplicate names heads its bucket */
+    for (i = ix->count; i--; ) {
+	b = ix->names[i].hash & ix->hash_mask;
+	ix->names[i].next = ix->buckets[b];
+	ix->buckets[b] = i;
+    }
+
+    dprintf("iso: indexed %u names of directory at block %u%s\n",
+	    ix->count, ix->dir, ix->complete ? "" : " (partial)");
+    return 0;
+
+nomem:
+    iso_index_free(ix);
+    return -1;
+}
+
+static bool iso_index_match(const struct iso_dir_name *n, const char *key,
+			    const char *dname)
+{
+    if (n->rr)
+	return !strcmp(key, dname);
+
+    while (*key == iso_tolower(*dname)) {
+	if (!*key)
+	    return true;
+	key++;
+	dname++;
+    }
+    return false;
+}
+
+/*
+ * Look up dname in the index of the directory dir, building the index
+ * if needed.
+ *
+ * Returns 1 and sets *dep if found, 0 if the name definitely does not
+ * exist, or -1 if the directory has to be scanned the slow way.
+ */
+static int iso_index_find(struct inode *dir, const char *dname,
+			  const struct iso_dir_entry **dep,
+			  uint32_t *block, uint16_t *offset)
+{
+    struct fs_info *fs = dir->fs;
+    struct iso_sb_info *sbi = ISO_SB(fs);
+    struct iso_dir_index *ix, *victim;
+    const struct iso_dir_name *n;
+    uint32_t hash, i;
+    const char *data;
+
+    if (!sbi->dir_index)
+	return -1;
+
+    victim = sbi->dir_index;
+    for (i = 0; i < ISO_DIR_INDEXES; i++) {
+	ix = &sbi->dir_index[i];
+	if (ix->dir == PVT(dir)->lba)
+	    goto found;
+	if (ix->last_used < victim->last_used)
+	    victim = ix;
+    }
+
+    ix = victim;
+    iso_index_free(ix);
+    if (iso_index_build(fs, ix, dir))
+	return -1;
+
+found:
+    ix->last_used = ++sbi->dir_index_clock;
+
+    hash = iso_index_hash(dname);
+    for (i = ix->buckets[hash & ix->hash_mask]; i != (uint32_t)-1;
+	 i = ix->names[i].next) {
+	n = &ix->names[i];
+	if (n->hash != hash || !iso_index_match(n, ix->pool + n->key, dname))
+	    continue;
+
+	data = get_cache(fs->fs_dev, n->block);
+	*dep = (const struct iso_dir_entry *)(data + n->offset);
+	*block = n->block;
+	*offset = n->offset;
+	return 1;
+    }
+
+    return ix->complete ? 0 : -1;
+}
+
+/*
+ * Find a entry in the specified dir with name _dname_, and return where
+ * its directory record is in *block and *rec_offset.
  */
 static const struct iso_dir_entry *
-iso_find_entry(const char *dname, struct inode *inode)
+iso_find_entry(const char *dname, struct inode *inode,
+	       uint32_t *block, uint16_t *rec_offset)
 {
     struct fs_info *fs = inode->fs;
     block_t dir_block = PVT(inode)->lba;
     int i = 0, offset = 0;
-    const char *de_name;
-    int de_name_len, de_len, rr_name_len, ret;
+    int de_len, rr_name_len, ret;
     const struct iso_dir_entry *de;
     const char *data = NULL;
-    char *rr_name = NULL;
+    char rr_name[256];
 
     dprintf("iso_find_entry: \"%s\"\n", dname);
-    
+
+    switch (iso_index_find(inode, dname, &de, block, rec_offset)) {
+    case 1:
+	dprintf("Found (in the index).\n");
+	return de;
+    case 0:
+	return NULL;
+    default:
+	break;			/* Search the directory itself */
+    }
+
     while (1) {
 	if (!data) {
 	    dprintf("Getting block %d from block %llu\n", i, dir_block);
@@ -133,23 +414,21 @@ iso_find_entry(const char *dname, struct inode *inode)
 	    continue;
 	}
 	
+	*block = dir_block - 1;
+	*rec_offset = offset - de_len;
+
 	/* Try to get Rock Ridge name */
-	ret = susp_rr_get_nm(fs, (char *) de, &rr_name, &rr_name_len);
+	ret = susp_rr_copy_nm(fs, (char *) de, rr_name, &rr_name_len);
 	if (ret > 0) {
 	    if (strcmp(rr_name, dname) == 0) {
 		dprintf("Found (by RR name).\n");
-		free(rr_name);
 		return de;
 	    }
-	    free(rr_name);
-	    rr_name = NULL;
 	    continue; /* Rock Ridge was valid and did not match */
 	}
 
 	/* Fall back to ISO name */
-	de_name_len = de->name_len;
-	de_name = de->name;
-	if (iso_compare_name(de_name, de_name_len, dname)) {
+	if (iso_compare_name(fs, de, dname)) {
 	    dprintf("Found (by ISO name).\n");
 	    return de;
 	}
@@ -158,11 +437,68 @@ iso_find_entry(const char *dname, struct inode *inode)
 
 static inline enum dirent_type get_inode_mode(uint8_t flags)
 {
-    return (flags & 0x02) ? DT_DIR : DT_REG;
+    return (flags & ISO_FLAG_DIRECTORY) ? DT_DIR : DT_REG;
+}
+
+/*
+ * Step from the directory record at *block and *offset to the next one,
+ * which may start the next block.  Returns NULL if there is none.
+ */
+static const struct iso_dir_entry *
+iso_next_record(struct fs_info *fs, uint32_t *block, uint16_t *offset)
+{
+    const struct iso_dir_entry *de;
+    const char *data;
+    int tries;
+
+    data = get_cache(fs->fs_dev, *block);
+    de = (const struct iso_dir_entry *)(data + *offset);
+    *offset += de->length;
+
+    for (tries = 0; tries < 2; tries++) {
+	de = (const struct iso_dir_entry *)(data + *offset);
+	if (*offset + 33 <= BLOCK_SIZE(fs) && de->length >= 33 &&
+	    *offset + de->length <= BLOCK_SIZE(fs))
+	    return de;
+
+	/* Records don't cross blocks; the rest of this one is padding */
+	data = get_cache(fs->fs_dev, ++*block);
+	*offset = 0;
+    }
+
+    return NULL;
+}
+
+/*
+ * Files of 4 GiB and more are split over several directory records
+ * with the same name, all but the last with ISO_FLAG_MULTI_EXTENT set.
+ * Add up the size of all parts.  File offsets are 32 bits, so anything
+ * past the first 4 GiB - 1 can't be read and is left out.
+ */
+static uint64_t iso_multi_extent_size(struct fs_info *fs,
+				      const struct iso_dir_entry *de,
+				      uint32_t block, uint16_t offset)
+{
+    uint64_t size = de->size_le;
+
+    while (de->flags & ISO_FLAG_MULTI_EXTENT) {
+	de = iso_next_record(fs, &block, &offset);
+	if (!de)
+	    break;
+	size += de->size_le;
+    }
+
+    if (size > UINT32_MAX) {
+	dprintf("iso: %llu byte file cut to 4 GiB\n", size);
+	size = UINT32_MAX;
+    }
+
+    return size;
 }
 
 static struct inode *iso_get_inode(struct fs_info *fs,
-				   const struct iso_dir_entry *de)
+				   const struct iso_dir_entry *de,
+				   uint32_t block, uint16_t offset)
 {
     struct inode *inode = new_iso_inode(fs);
     int blktosec = BLOCK_SHIFT(fs) - SECTOR_SHIFT(fs);
@@ -174,7 +510,18 @@ static struct inode *iso_get_inode(struct fs_info *fs,
 
     inode->mode   = get_inode_mode(de->flags);
     inode->size   = de->size_le;
+    inode->ino    = de->extent_le;	/* Unique, keys the lookup cache */
     PVT(inode)->lba = de->extent_le;
+
+    if (de->flags & ISO_FLAG_MULTI_EXTENT) {
+	/* Parts are mapped one by one by iso_next_extent() */
+	inode->size = iso_multi_extent_size(fs, de, block, offset);
+	inode->blocks = (inode->size + BLOCK_SIZE(fs) - 1) >> BLOCK_SHIFT(fs);
+	PVT(inode)->rec_block = block;
+	PVT(inode)->rec_offset = offset;
+	return inode;
+    }
+
     inode->blocks = (inode->size + BLOCK_SIZE(fs) - 1) >> BLOCK_SHIFT(fs);
 
     /* We have a single extent for all data */
@@ -184,24 +531,81 @@ static struct inode *iso_get_inode(struct fs_info *fs,
     return inode;
 }
 
+/*
+ * Map the part of a multi-extent file holding lstart.  Single-extent
+ * files are entirely mapped by iso_get_inode() already.
+ */
+static int iso_next_extent(struct inode *inode, uint32_t lstart)
+{
+    struct fs_info *fs = inode->fs;
+    const int blktosec = BLOCK_SHIFT(fs) - SECTOR_SHIFT(fs);
+    const struct iso_dir_entry *de;
+    uint32_t block = PVT(inode)->rec_block;
+    uint16_t offset = PVT(inode)->rec_offset;
+    uint32_t lpos = 0, len;
+    const char *data;
+
+    if (!block)
+	return -1;
+
+    data = get_cache(fs->fs_dev, block);
+    de = (const struct iso_dir_entry *)(data + offset);
+
+    for (;;) {
+	len = (de->size_le + SECTOR_SIZE(fs) - 1) >> SECTOR_SHIFT(fs);
+	if (lstart < lpos + len) {
+	    inode->next_extent.pstart =
+		((sector_t)de->extent_le << blktosec) + (lstart - lpos);
+	    inode->next_extent.len = lpos + len - lstart;
+	    return 0;
+	}
+	lpos += len;
+
+	if (!(de->flags & ISO_FLAG_MULTI_EXTENT))
+	    return -1;
+	de = iso_next_record(fs, &block, &offset);
+	if (!de)
+	    return -1;
+    }
+}
+
 static struct inode *iso_iget_root(struct fs_info *fs)
 {
     const struct iso_dir_entry *root = &ISO_SB(fs)->root;
 
-    return iso_get_inode(fs, root);
+    return iso_get_inode(fs, root, 0, 0);
 }
 
+/* Where a directory record is, as cached in the lookup cache */
+struct iso_dcache_rec {
+    uint32_t block;
+    uint16_t offset;
+};
+
 static struct inode *iso_iget(const char *dname, struct inode *parent)
 {
+    struct fs_info *fs = parent->fs;
     const struct iso_dir_entry *de;
+    const struct dentry *dc;
+    struct iso_dcache_rec rec;
+    const char *data;
     
     dprintf("iso_iget %p %s\n", parent, dname);
 
-    de = iso_find_entry(dname, parent);
+    dc = dcache_lookup(parent, dname);
+    if (dc) {
+	memcpy(&rec, dc->data, sizeof rec);
+	data = get_cache(fs->fs_dev, rec.block);
+	de = (const struct iso_dir_entry *)(data + rec.offset);
+	return iso_get_inode(fs, de, rec.block, rec.offset);
+    }
+
+    de = iso_find_entry(dname, parent, &rec.block, &rec.offset);
     if (!de)
 	return NULL;
-    
-    return iso_get_inode(parent->fs, de);
+
+    dcache_insert(parent, dname, de->extent_le, &rec, sizeof rec);
+    return iso_get_inode(fs, de, rec.block, rec.offset);
 }
 
 static int iso_readdir(struct file *file, struct dirent *dirent)
@@ -210,7 +614,6 @@ static int iso_readdir(struct file *file, struct dirent *dirent)
     struct inode *inode = file->inode;
     const struct iso_dir_entry *de;
     const char *data = NULL;
-    char *rr_name = NULL;
     int name_len, ret;
     
     while (1) {
@@ -238,13 +641,9 @@ static int iso_readdir(struct file *file, struct dirent *dirent)
     dirent->d_type = get_inode_mode(de->flags);
 
     /* Try to get Rock Ridge name */
-    ret = susp_rr_get_nm(fs, (char *) de, &rr_name, &name_len);
-    if (ret > 0) {
-	memcpy(dirent->d_name, rr_name, name_len + 1);
-	free(rr_name);
-	rr_name = NULL;
-    } else {
-	name_len = iso_convert_name(dirent->d_name, de->name, de->name_len);
+    ret = susp_rr_copy_nm(fs, (char *) de, dirent->d_name, &name_len);
+    if (ret <= 0) {
+	name_len = iso_get_name(fs, dirent->d_name, de);
     }
 
     dirent->d_reclen = offsetof(struct dirent, d_name) + 1 + name_len;
@@ -254,6 +653,38 @@ static int iso_readdir(struct file *file, struct dirent *dirent)
     return 0;
 }
 
+/*
+ * Look for a Joliet SVD after the PVD, and copy its root directory
+ * record into *root.  Returns true if there is one.
+ */
+static bool iso_find_joliet(struct fs_info *fs, uint32_t pvd_lba,
+			    struct iso_dir_entry *root)
+{
+    struct disk *disk = fs->fs_dev->disk;
+    int blktosec = fs->block_shift - fs->sector_shift;
+    char vd[2048];
+    const char *esc = vd + ISO_VD_ESCAPES_OFFSET;
+    uint32_t lba;
+
+    for (lba = pvd_lba + 1; lba < pvd_lba + ISO_VD_MAX; lba++) {
+	if (!disk->rdwr_sectors(disk, vd, (sector_t)lba << blktosec,
+				1 << blktosec, false))
+	    break;
+	if (memcmp(vd + 1, "CD001", 5) || (uint8_t)vd[0] == ISO_VD_END)
+	    break;
+
+	/* UCS-2 level 1, 2 or 3 */
+	if (vd[0] == ISO_VD_SUPPLEMENTARY && esc[0] == '%' && esc[1] == '/' &&
+	    (esc[2] == '@' || esc[2] == 'C' || esc[2] == 'E')) {
+	    dprintf("iso: Joliet SVD at block %u\n", lba);
+	    memcpy(root, vd + ROOT_DIR_OFFSET, sizeof(*root));
+	    return true;
+	}
+    }
+
+    return false;
+}
+
 /* Load the config file, return 1 if failed, or 0 */
 static int iso_open_config(struct com32_filedata *filedata)
 {
@@ -289,6 +720,10 @@ static int iso_fs_init(struct fs_info *fs)
     }
     fs->fs_info = sbi;
 
+    /* Directory name indexes; without them we just scan directories */
+    sbi->dir_index = zalloc(ISO_DIR_INDEXES * sizeof(struct iso_dir_index));
+    sbi->dir_index_clock = 0;
+
     /* 
      * XXX: handling iso9660 in hybrid mode on top of a 4K-logical disk
      * will really, really hurt...
@@ -307,6 +742,12 @@ static int iso_fs_init(struct fs_info *fs)
 		       1 << blktosec, false);
     memcpy(&sbi->root, pvd + ROOT_DIR_OFFSET, sizeof(sbi->root));
 
+    /* We don't ask a CD-ROM for its size; the volume will do */
+    if (!disk->sectors)
+	disk->sectors = disk->part_start +
+	    ((sector_t)get_le32((uint32_t *)(pvd + VOL_SPACE_OFFSET))
+	     << blktosec);
+
     /* Initialize the cache */
     cache_init(fs->fs_dev, fs->block_shift);
 
@@ -315,6 +756,11 @@ static int iso_fs_init(struct fs_info *fs)
     */
     susp_rr_check_signatures(fs, 1);
 
+    /* Without Rock Ridge, Joliet names beat 8.3 upper case ones */
+    sbi->joliet = false;
+    if (!sbi->do_rr && iso_find_joliet(fs, pvd_lba, &sbi->root))
+	sbi->joliet = true;
+
     return fs->block_shift;
 }
 
@@ -331,6 +777,6 @@ const struct fs_ops iso_fs_ops = {
     .iget_root     = iso_iget_root,
     .iget          = iso_iget,
     .readdir       = iso_readdir,
-    .next_extent   = no_next_extent,
+    .next_extent   = iso_next_extent,
     .fs_uuid       = NULL,
 };
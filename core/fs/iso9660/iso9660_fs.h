@@ -3,6 +3,7 @@
 
 #include <klibc/compiler.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 /* Boot info table */
 struct iso_boot_info {
@@ -18,6 +19,15 @@ extern struct iso_boot_info iso_boot_info; /* In isolinux.asm */
 /* The root dir entry offset in the primary volume descriptor */
 #define ROOT_DIR_OFFSET   156
 
+/* And the volume size in blocks, little endian */
+#define VOL_SPACE_OFFSET  80
+
+/* Volume descriptor types, and where a SVD keeps its escape sequences */
+#define ISO_VD_SUPPLEMENTARY	2
+#define ISO_VD_END		255
+#define ISO_VD_ESCAPES_OFFSET	88
+#define ISO_VD_MAX		32	/* Descriptors we look at, at most */
+
 struct iso_dir_entry {
     uint8_t length;                         /* 00 */
     uint8_t ext_attr_length;                /* 01 */    
@@ -35,6 +45,38 @@ struct iso_dir_entry {
     char    name[0];                        /* 21 */
 } __packed;
 
+/* Directory record flags */
+#define ISO_FLAG_DIRECTORY	0x02
+#define ISO_FLAG_MULTI_EXTENT	0x80	/* File continues in the next record */
+
+/*
+ * Hashed name index of one directory, see iso_index_find().  Every
+ * record is indexed under its Rock Ridge name if it has one, or else
+ * under its ISO 9660 name as converted by iso_convert_name().
+ */
+struct iso_dir_name {
+    uint32_t hash;
+    uint32_t next;		/* Next name in the bucket, or -1 */
+    uint32_t key;		/* Offset of the name in the pool */
+    uint32_t block;		/* Block holding the directory record... */
+    uint16_t offset;		/* ...and its offset within the block */
+    bool     rr;		/* Rock Ridge name, case sensitive */
+};
+
+struct iso_dir_index {
+    uint32_t dir;		/* LBA of the directory, 0 = free */
+    uint32_t last_used;
+    bool     complete;		/* Every record made it into the index */
+    uint32_t count;
+    uint32_t hash_mask;
+    uint32_t *buckets;
+    struct iso_dir_name *names;
+    char     *pool;
+};
+
+#define ISO_DIR_INDEXES		4	/* Directories indexed at once */
+#define ISO_DIR_INDEX_MAX	65536	/* Names per directory index */
+
 struct iso_sb_info {
     struct iso_dir_entry root;
 
@@ -42,6 +84,11 @@ struct iso_sb_info {
                         2 indicates that the id of RRIP 1.12 was found.
                      */
     int susp_skip;   /* Skip length from SUSP entry SP */
+    bool joliet;     /* root is that of a Joliet SVD, names are UCS-2 */
+
+    /* Name indexes of recently searched directories */
+    struct iso_dir_index *dir_index;
+    uint32_t dir_index_clock;
 };
 
 /*
@@ -49,6 +96,8 @@ struct iso_sb_info {
  */
 struct iso9660_pvt_inode {
     uint32_t lba;		/* Starting LBA of file data area*/
+    uint32_t rec_block;		/* First directory record of a file with */
+    uint16_t rec_offset;	/* several extents, see iso_next_extent() */
 };
 
 #define PVT(i) ((struct iso9660_pvt_inode *)((i)->pvt))
@@ -131,11 +131,12 @@ struct susp_rr_iter {
 };
 
 
-static int susp_rr_iter_new(struct susp_rr_iter **iter,
-			    struct fs_info *fs, char *dir_rec)
+/* Set up an iteration in caller provided memory.
+*/
+static int susp_rr_iter_init(struct susp_rr_iter *o,
+			     struct fs_info *fs, char *dir_rec)
 {
     struct iso_sb_info *sbi = fs->fs_info;
-    struct susp_rr_iter *o;
     uint8_t len_fi;
     int read_pos, read_end;
 
@@ -147,9 +148,6 @@ static int susp_rr_iter_new(struct susp_rr_iter **iter,
     if (dir_rec[read_pos + 3] != 1)
 	return 0; /* Not SUSP version 1 */
 
-    o= *iter= malloc(sizeof(struct susp_rr_iter));
-    if (susp_rr_is_out_of_mem(o))
-	return -1;
     o->fs = fs;
     o->dir_rec= dir_rec;
     o->in_ce= 0;
@@ -163,6 +161,34 @@ static int susp_rr_iter_new(struct susp_rr_iter **iter,
 }
 
 
+static int susp_rr_iter_new(struct susp_rr_iter **iter,
+			    struct fs_info *fs, char *dir_rec)
+{
+    struct susp_rr_iter o;
+    int ret;
+
+    ret = susp_rr_iter_init(&o, fs, dir_rec);
+    if (ret <= 0)
+	return ret;
+
+    *iter = malloc(sizeof(struct susp_rr_iter));
+    if (susp_rr_is_out_of_mem(*iter))
+	return -1;
+    **iter = o;
+    return 1;
+}
+
+
+/* Release what an iteration set up by susp_rr_iter_init() holds.
+*/
+static void susp_rr_iter_fini(struct susp_rr_iter *o)
+{
+    if (o->ce_data != NULL && o->ce_allocated)
+	free(o->ce_data);
+    o->ce_data = NULL;
+}
+
+
 static int susp_rr_iter_destroy(struct susp_rr_iter **iter)
 {
     struct susp_rr_iter *o;
@@ -170,8 +196,7 @@ static int susp_rr_iter_destroy(struct susp_rr_iter **iter)
     o = *iter;
     if (o == NULL)
 	return 0;
-    if (o->ce_data != NULL && o->ce_allocated)
-	free(o->ce_data);
+    susp_rr_iter_fini(o);
     free(o);
     *iter = NULL;
     return 1;
@@ -428,6 +453,76 @@ int susp_rr_get_nm(struct fs_info *fs, char *dir_rec,
 }
 
 
+/* Public function. See susp_rr.h
+
+   Same as susp_rr_get_nm(), but without malloc(), so that whole
+   directories can be read cheaply: the iteration state lives on the
+   stack and the NM payloads are collected right into the caller's buffer.
+*/
+int susp_rr_copy_nm(struct fs_info *fs, char *dir_rec,
+		    char *name, int *len_name)
+{
+    struct susp_rr_iter iter;
+    struct iso_sb_info *sbi = fs->fs_info;
+    int ret, nm_flags = -1;
+    uint8_t pay_len;
+    char *pos_pt;
+
+    *len_name = 0;
+    name[0] = 0;
+
+    if (!sbi->do_rr)
+	return 0; /* Rock Ridge is not enabled */
+
+    ret = susp_rr_iter_init(&iter, fs, dir_rec);
+    if (ret <= 0)
+	return ret;
+    for (;;) {
+	ret = susp_rr_iterate(&iter, &pos_pt);
+	if (ret <= 0)
+	    break;
+	if (pos_pt[0] != 'N' || pos_pt[1] != 'M')
+	    continue;
+
+	pay_len = ((uint8_t *) pos_pt)[2];
+	if (pay_len < 5) {
+	    dprintf("susp_rr.c: Short NM entry encountered.\n");
+	    ret = -1;
+	    break;
+	}
+	pay_len -= 5;
+	if (nm_flags < 0)
+	    nm_flags = ((uint8_t *) pos_pt)[4];
+	if (*len_name + pay_len >= 256) {
+	    dprintf("susp_rr.c: Rock Ridge name longer than 255 characters.\n");
+	    ret = -1;
+	    break;
+	}
+	memcpy(name + *len_name, pos_pt + 5, pay_len);
+	*len_name += pay_len;
+	if (!(pos_pt[4] & 1)) { /* No CONTINUE bit */
+	    ret = 1;
+	    break;
+	}
+    }
+    susp_rr_iter_fini(&iter);
+
+    if (ret < 0 || nm_flags < 0) {
+	*len_name = 0;
+	name[0] = 0;
+	return ret < 0 ? -1 : 0;
+    }
+
+    /* Interpret flags */
+    if (nm_flags & 0x6) {
+	strcpy(name, nm_flags & 0x2 ? "." : "..");
+	*len_name = strlen(name);
+    }
+    name[*len_name] = 0;
+    return 1;
+}
+
+
 /* Public function. See susp_rr.h
 */
 int susp_rr_check_signatures(struct fs_info *fs, int flag)
@@ -81,4 +81,14 @@ int susp_rr_get_nm(struct fs_info *fs, char *dir_rec,
                    char **name, int *len_name);
 
 
+/*  Obtain the Rock Ridge name of a directory record without allocating
+    memory. Same as susp_rr_get_nm(), except for:
+
+    @param name     Memory of at least 256 bytes, which returns the name
+                    and a trailing 0-byte.
+*/
+int susp_rr_copy_nm(struct fs_info *fs, char *dir_rec,
+                    char *name, int *len_name);
+
+
 #endif /* ! ISO9660_SUSP_H */
@@ -0,0 +1,132 @@
+/*
+ * lznt1.c -- decompression of NTFS compression units
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * A compression unit is a sequence of chunks, each holding up to 4 KiB
+ * of data.  Every chunk starts with a 16-bit header: the low 12 bits
+ * are its size minus 3, and bit 15 is set if it is compressed.  A zero
+ * header ends the unit.  A chunk which decompresses to less than 4 KiB
+ * is padded with zeroes.
+ *
+ * Compressed chunks are groups of up to 8 tokens, each group preceded
+ * by a flag byte.  A clear flag bit is a literal byte; a set one is a
+ * 16-bit back reference, split between offset and length depending on
+ * how far into the chunk we are.
+ */
+
+#include <dprintf.h>
+#include <string.h>
+#include <fs.h>
+#include "ntfs.h"
+
+#define LZNT1_CHUNK_SIZE        4096
+#define LZNT1_CHUNK_COMPRESSED  0x8000
+#define LZNT1_CHUNK_LEN_MASK    0x0FFF
+
+static int lznt1_decompress_chunk(uint8_t *dst, const uint8_t *src,
+                                  const uint8_t *src_end)
+{
+    uint8_t *out = dst;
+    uint8_t *const out_end = dst + LZNT1_CHUNK_SIZE;
+    uint8_t tag;
+    uint16_t token, lmask;
+    unsigned dshift, back, len, pos;
+    int i;
+
+    while (src < src_end) {
+        tag = *src++;
+        for (i = 0; i < 8 && src < src_end; i++, tag >>= 1) {
+            if (!(tag & 1)) {
+                if (out >= out_end)
+                    return -1;
+                *out++ = *src++;
+                continue;
+            }
+
+            if (src + 2 > src_end)
+                return -1;
+            token = src[0] | (src[1] << 8);
+            src += 2;
+
+            /* The further we are, the more bits go to the offset */
+            pos = out - dst;
+            if (!pos)
+                return -1;
+            lmask = 0xFFF;
+            dshift = 12;
+            for (pos--; pos >= 0x10; pos >>= 1) {
+                lmask >>= 1;
+                dshift--;
+            }
+
+            back = (token >> dshift) + 1;
+            len = (token & lmask) + 3;
+            if (back > (unsigned)(out - dst) ||
+                len > (unsigned)(out_end - out))
+                return -1;
+
+            /* Byte by byte, the copy may overlap itself */
+            while (len--) {
+                *out = *(out - back);
+                out++;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Decompress the compression unit at src into dst, which is dst_len
+ * bytes long and is zero-filled past the end of the data.
+ */
+int ntfs_lznt1_decompress(void *dst, size_t dst_len,
+                          const void *src, size_t src_len)
+{
+    uint8_t *out = dst;
+    const uint8_t *in = src;
+    const uint8_t *const in_end = in + src_len;
+    uint16_t hdr;
+    size_t size;
+
+    memset(dst, 0, dst_len);
+
+    while (dst_len && in + 2 <= in_end) {
+        hdr = in[0] | (in[1] << 8);
+        if (!hdr)
+            break;
+        in += 2;
+
+        size = (hdr & LZNT1_CHUNK_LEN_MASK) + 1;
+        if (in + size > in_end || dst_len < LZNT1_CHUNK_SIZE) {
+            dprintf("%s: chunk overruns the compression unit\n", __func__);
+            return -1;
+        }
+
+        if (hdr & LZNT1_CHUNK_COMPRESSED) {
+            if (lznt1_decompress_chunk(out, in, in + size)) {
+                dprintf("%s: corrupt chunk\n", __func__);
+                return -1;
+            }
+        } else {
+            memcpy(out, in, size);
+        }
+
+        in += size;
+        out += LZNT1_CHUNK_SIZE;
+        dst_len -= LZNT1_CHUNK_SIZE;
+    }
+
+    return 0;
+}
@@ -17,23 +17,22 @@
  * 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
 */
 
-/* Note: No support for compressed files */
-
 #include <dprintf.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/dirent.h>
 #include <cache.h>
+#include <dcache.h>
 #include <core.h>
 #include <disk.h>
 #include <fs.h>
 #include <ilog2.h>
 #include <klibc/compiler.h>
 #include <ctype.h>
+#include <minmax.h>
 
 #include "codepage.h"
 #include "ntfs.h"
-#include "runlist.h"
 
 static struct ntfs_readdir_state *readdir_state;
 
@@ -41,9 +40,12 @@ static struct ntfs_readdir_state *readdir_state;
 static f_mft_record_lookup ntfs_mft_record_lookup_3_0;
 static f_mft_record_lookup ntfs_mft_record_lookup_3_1;
 static inline enum dirent_type get_inode_mode(struct ntfs_mft_record *mrec);
+static struct ntfs_attr_record *__ntfs_attr_lookup(struct fs_info *fs, uint32_t type, struct ntfs_mft_record **mrec);
 static inline struct ntfs_attr_record * ntfs_attr_lookup(struct fs_info *fs, uint32_t type, struct ntfs_mft_record **mmrec, struct ntfs_mft_record *mrec);
 static inline uint8_t *mapping_chunk_init(struct ntfs_attr_record *attr,struct mapping_chunk *chunk,uint32_t *offset);
 static int parse_data_run(const void *stream, uint32_t *offset, uint8_t *attr_len, struct mapping_chunk *chunk);
+static int ntfs_load_runlist(struct inode *inode, struct ntfs_attr_record *attr);
+static int ntfs_attr_read(struct inode *inode, struct ntfs_attr_record *attr, uint64_t pos, void *buf, size_t len);
 
 /*** Function definitions */
 
@@ -104,79 +106,109 @@ static void ntfs_fixups_writeback(struct fs_info *fs, struct ntfs_record *nrec)
     }
 }
 
-/* read content from cache */
-static int ntfs_read(struct fs_info *fs, void *buf, size_t len, uint64_t count,
-                    block_t *blk, uint64_t *blk_offset,
-                    uint64_t *blk_next_offset, uint64_t *lcn)
+/* Find a cached MFT record */
+static struct ntfs_mft_cache *ntfs_mft_cache_lookup(struct fs_info *fs,
+                                                    uint32_t file)
 {
-    uint8_t *data;
-    uint64_t offset = *blk_offset;
-    const uint32_t clust_byte_shift = NTFS_SB(fs)->clust_byte_shift;
-    const uint64_t blk_size = UINT64_C(1) << BLOCK_SHIFT(fs);
-    uint64_t bytes;
-    uint64_t lbytes;
-    uint64_t loffset;
-    uint64_t k;
+    struct ntfs_sb_info *sbi = NTFS_SB(fs);
+    struct ntfs_mft_cache *mc;
+    int i;
+
+    for (i = 0; i < NTFS_MFT_CACHE; i++) {
+        mc = sbi->mft_cache + i;
+        if (mc->last_used && mc->mft_no == file) {
+            mc->last_used = ++sbi->mft_clock;
+            return mc;
+        }
+    }
 
-    dprintf("in %s()\n", __func__);
+    return NULL;
+}
 
-    if (count > len)
-        goto out;
+/* Keep a copy of a fixed-up MFT record, replacing the least recently used */
+static void ntfs_mft_cache_insert(struct fs_info *fs, uint32_t file,
+                                  const struct ntfs_mft_record *mrec)
+{
+    struct ntfs_sb_info *sbi = NTFS_SB(fs);
+    struct ntfs_mft_cache *mc, *victim = sbi->mft_cache;
+    int i;
 
-    data = (uint8_t *)get_cache(fs->fs_dev, *blk);
-    if (!data)
-        goto out;
+    for (i = 1; i < NTFS_MFT_CACHE; i++) {
+        mc = sbi->mft_cache + i;
+        if (mc->last_used < victim->last_used)
+            victim = mc;
+    }
 
-    if (!offset)
-        offset = (*lcn << clust_byte_shift) % blk_size;
+    if (!victim->mrec) {
+        victim->mrec = malloc(sbi->mft_record_size);
+        if (!victim->mrec)
+            return;
+    }
 
-    dprintf("LCN:            0x%X\n", *lcn);
-    dprintf("offset:         0x%X\n", offset);
+    memcpy(victim->mrec, mrec, sbi->mft_record_size);
+    victim->mft_no = file;
+    victim->last_used = ++sbi->mft_clock;
+}
 
-    bytes = count;              /* bytes to copy */
-    lbytes = blk_size - offset; /* bytes left to copy */
-    if (lbytes >= bytes) {
-        /* so there's room enough, then copy the whole content */
-        memcpy(buf, data + offset, bytes);
-        loffset = offset;
-        offset += count;
-    } else {
-        dprintf("bytes:             %u\n", bytes);
-        dprintf("bytes left:        %u\n", lbytes);
-        /* otherwise, let's copy it partially... */
-        k = 0;
-        while (bytes) {
-            memcpy(buf + k, data + offset, lbytes);
-            bytes -= lbytes;
-            loffset = offset;
-            offset += lbytes;
-            k += lbytes;
-            if (offset >= blk_size) {
-                /* then fetch a new FS block */
-                data = (uint8_t *)get_cache(fs->fs_dev, ++*blk);
-                if (!data)
-                    goto out;
+/*
+ * Load the runlist of $MFT, so records beyond its first cluster can be
+ * found without going back to MFT record 0 every time.
+ */
+static int ntfs_mft_setup(struct fs_info *fs)
+{
+    static bool busy;
+    struct ntfs_sb_info *sbi = NTFS_SB(fs);
+    struct ntfs_mft_record *mrec, *drec;
+    struct ntfs_attr_record *attr;
+    struct inode *inode;
 
-                lbytes = bytes;
-                loffset = offset;
-                offset = 0;
-            }
-        }
-    }
+    if (busy)
+        return -1;      /* $MFT's own attribute list is beyond cluster 0 */
+    busy = true;
 
-    if (loffset >= blk_size)
-        loffset = 0;    /* it must be aligned on a block boundary */
+    mrec = sbi->mft_record_lookup(fs, FILE_MFT, NULL);
+    if (!mrec) {
+        dprintf("%s: read MFT(0) failed\n", __func__);
+        goto out;
+    }
 
-    *blk_offset = loffset;
+    if (get_inode_mode(mrec) != DT_REG) {
+        dprintf("%s: $MFT is not a file\n", __func__);
+        goto out;
+    }
 
-    if (blk_next_offset)
-        *blk_next_offset = offset;
+    /*
+     * Through an attribute list, $DATA may live in an extension record.
+     * Keep the record which holds it, not the base record.
+     */
+    drec = mrec;
+    attr = __ntfs_attr_lookup(fs, NTFS_AT_DATA, &drec);
+    if (drec != mrec) {
+        free(mrec);
+        mrec = drec;
+    }
+    if (!attr || !attr->non_resident) {
+        dprintf("%s: $MFT has no non-resident data attr\n", __func__);
+        goto out;
+    }
 
-    *lcn += blk_size / count;   /* update LCN */
+    inode = new_ntfs_inode(fs);
+    if (ntfs_load_runlist(inode, attr)) {
+        dprintf("%s: $MFT data run parse failed\n", __func__);
+        free(inode->extent_map);
+        free(inode);
+        goto out;
+    }
 
+    sbi->mft = inode;
+    sbi->mft_mrec = mrec;
+    sbi->mft_data = attr;
+    busy = false;
     return 0;
 
 out:
+    free(mrec);
+    busy = false;
     return -1;
 }
 
@@ -184,77 +216,43 @@ out:
 static struct ntfs_mft_record *ntfs_mft_record_lookup_any(struct fs_info *fs,
                                                 uint32_t file, block_t *out_blk, bool is_v31)
 {
-    const uint64_t mft_record_size = NTFS_SB(fs)->mft_record_size;
-    uint8_t *buf = NULL;
+    struct ntfs_sb_info *sbi = NTFS_SB(fs);
+    const uint64_t mft_record_size = sbi->mft_record_size;
     const uint32_t mft_record_shift = ilog2(mft_record_size);
-    const uint32_t clust_byte_shift = NTFS_SB(fs)->clust_byte_shift;
-    uint64_t next_offset = 0;
-    uint64_t lcn = 0;
-    block_t blk = 0;
-    uint64_t offset = 0;
-
-    struct ntfs_mft_record *mrec = NULL, *lmrec = NULL;
-    uint64_t start_blk = 0;
-    struct ntfs_attr_record *attr = NULL;
-    uint8_t *stream = NULL;
-    uint32_t attr_offset = 0;
-    uint8_t *attr_len = NULL;
-    struct mapping_chunk chunk;
-
-    int err = 0;
+    const uint32_t clust_byte_shift = sbi->clust_byte_shift;
+    const uint64_t pos = (uint64_t)file << mft_record_shift;
+    struct ntfs_mft_cache *mc;
+    struct ntfs_mft_record *mrec;
+    uint8_t *buf;
+    int err;
 
-    /* determine MFT record's LCN */
-    uint64_t vcn = (file << mft_record_shift >> clust_byte_shift);
     dprintf("in %s(%s)\n", __func__,(is_v31?"v3.1":"v3.0"));
-    if (0==vcn) {
-      lcn = NTFS_SB(fs)->mft_lcn;
-    } else do {
-      dprintf("%s: looking for VCN %u for MFT record %u\n", __func__,(unsigned)vcn,(unsigned)file);
-      mrec = NTFS_SB(fs)->mft_record_lookup(fs, 0, &start_blk);
-      if (!mrec) {dprintf("%s: read MFT(0) failed\n", __func__); break;}
-      lmrec = mrec;
-      if (get_inode_mode(mrec) != DT_REG) {dprintf("%s: $MFT is not a file\n", __func__); break;}
-      attr = ntfs_attr_lookup(fs, NTFS_AT_DATA, &mrec, lmrec);
-      if (!attr) {dprintf("%s: $MFT have no data attr\n", __func__); break;}
-      if (!attr->non_resident) {dprintf("%s: $MFT data attr is resident\n", __func__); break;}
-      attr_len = (uint8_t *)attr + attr->len;
-      stream = mapping_chunk_init(attr, &chunk, &attr_offset);
-      while (true) {
-        err = parse_data_run(stream, &attr_offset, attr_len, &chunk);
-        if (err) {dprintf("%s: $MFT data run parse failed with error %d\n", __func__,err); break;}
-        if (chunk.flags & MAP_UNALLOCATED) continue;
-        if (chunk.flags & MAP_END) break;
-        if (chunk.flags & MAP_ALLOCATED) {
-          dprintf("%s: Chunk: VCN=%u, LCN=%u, len=%u\n", __func__,(unsigned)chunk.vcn,(unsigned)chunk.lcn,(unsigned)chunk.len);
-          if ((vcn>=chunk.vcn)&&(vcn<chunk.vcn+chunk.len)) {
-            lcn=vcn-chunk.vcn+chunk.lcn;
-            dprintf("%s: VCN %u for MFT record %u maps to lcn %u\n", __func__,(unsigned)vcn,(unsigned)file,(unsigned)lcn);
-            break;
-          }
-          chunk.vcn += chunk.len;
-        }
-      }
-    } while(false);
-    if (mrec!=NULL) free(mrec);
-    mrec = NULL;
-    if (0==lcn) {
-      dprintf("%s: unable to map VCN %u for MFT record %u\n", __func__,(unsigned)vcn,(unsigned)file);
-      return NULL;
-    }
-
-    /* determine MFT record's block number */
-    blk = (lcn << clust_byte_shift >> BLOCK_SHIFT(fs));
-    offset = (file << mft_record_shift) % BLOCK_SIZE(fs);
 
     /* Allocate buffer */
     buf = (uint8_t *)malloc(mft_record_size);
     if (!buf) {malloc_error("uint8_t *");return 0;}
 
-    /* Read block */
-    err = ntfs_read(fs, buf, mft_record_size, mft_record_size, &blk,
-                    &offset, &next_offset, &lcn);
+    mc = ntfs_mft_cache_lookup(fs, file);
+    if (mc) {
+        memcpy(buf, mc->mrec, mft_record_size);
+        mrec = (struct ntfs_mft_record *)buf;
+        goto check;
+    }
+
+    if (!(pos >> clust_byte_shift)) {
+        /* The first cluster of $MFT is given by the boot sector */
+        err = cache_read(fs, buf, (sbi->mft_lcn << clust_byte_shift) + pos,
+                         mft_record_size) != mft_record_size;
+    } else if (sbi->mft || !ntfs_mft_setup(fs)) {
+        err = ntfs_attr_read(sbi->mft, sbi->mft_data, pos, buf,
+                             mft_record_size);
+    } else {
+        dprintf("%s: unable to map MFT record %u\n", __func__, (unsigned)file);
+        free(buf);
+        return NULL;
+    }
     if (err) {
-      dprintf("%s: error read block %u from cache\n", __func__, blk);
+      dprintf("%s: error reading MFT record %u\n", __func__, (unsigned)file);
       printf("Error while reading from cache.\n");
       free(buf);
       return NULL;
@@ -263,7 +261,10 @@ static struct ntfs_mft_record *ntfs_mft_record_lookup_any(struct fs_info *fs,
     /* Process fixups and make structure pointer */
     ntfs_fixups_writeback(fs, (struct ntfs_record *)buf);
     mrec = (struct ntfs_mft_record *)buf;
+    if (mrec->magic == NTFS_MAGIC_FILE)
+      ntfs_mft_cache_insert(fs, file, mrec);
 
+check:
     /* check if it has a valid magic number and record number */
     if (mrec->magic != NTFS_MAGIC_FILE) mrec = NULL;
     if (mrec && is_v31) if (mrec->mft_record_no != file) mrec = NULL;
@@ -378,6 +379,13 @@ static int parse_data_run(const void *stream, uint32_t *offset,
 
     chunk->len = res;   /* get length data */
 
+    /* A run without an LCN is sparse, and leaves the current LCN alone */
+    if (!l) {
+        chunk->flags |= MAP_UNALLOCATED;
+        *offset += v + 1;
+        return 0;
+    }
+
     byte = (uint8_t *)buf + v + l;
     count = l;
 
@@ -390,11 +398,7 @@ static int parse_data_run(const void *stream, uint32_t *offset,
         res = (res << byte_shift) | *byte--;
 
     chunk->lcn += res;
-    /* are VCNS from cur_vcn to next_vcn - 1 unallocated ? */
-    if (!chunk->lcn)
-        chunk->flags |= MAP_UNALLOCATED;
-    else
-        chunk->flags |= MAP_ALLOCATED;
+    chunk->flags |= MAP_ALLOCATED;
 
     *offset += v + l + 1;
 
@@ -404,6 +408,210 @@ out:
     return -1;
 }
 
+/*
+ * Decode the runlist of a non-resident attribute into the inode's
+ * extent map, in sectors.  Unallocated runs are left out and read back
+ * as holes.  If the map fills up, the rest is parsed as needed by
+ * ntfs_find_run().
+ */
+static int ntfs_load_runlist(struct inode *inode, struct ntfs_attr_record *attr)
+{
+    const unsigned clust_shift = NTFS_SB(inode->fs)->clust_shift;
+    struct mapping_chunk chunk;
+    struct extent ext;
+    uint8_t *attr_len;
+    uint8_t *stream;
+    uint32_t offset;
+
+    NTFS_PVT(inode)->runs = NTFS_RUNS_PARTIAL;
+
+    attr_len = (uint8_t *)attr + attr->len;
+    stream = mapping_chunk_init(attr, &chunk, &offset);
+    chunk.vcn = attr->data.non_resident.lowest_vcn;
+    for (;;) {
+        if (parse_data_run(stream, &offset, attr_len, &chunk))
+            return -1;
+        if (chunk.flags & MAP_END)
+            break;
+
+        if (chunk.flags & MAP_ALLOCATED) {
+            /* Sectors past 2 TiB don't fit in struct extent */
+            if ((chunk.vcn + chunk.len) << clust_shift >> 32)
+                return 0;
+
+            ext.lstart = chunk.vcn << clust_shift;
+            ext.pstart = (sector_t)chunk.lcn << clust_shift;
+            ext.len = chunk.len << clust_shift;
+            if (!extent_map_insert(inode, &ext))
+                return 0;
+        }
+
+        chunk.vcn += chunk.len;
+    }
+
+    NTFS_PVT(inode)->runs = NTFS_RUNS_COMPLETE;
+    return 0;
+}
+
+/* Find the run covering vcn by parsing the attribute's mapping pairs */
+static int ntfs_find_run(struct ntfs_attr_record *attr, uint64_t vcn,
+                         struct mapping_chunk *chunk)
+{
+    uint8_t *attr_len;
+    uint8_t *stream;
+    uint32_t offset;
+
+    attr_len = (uint8_t *)attr + attr->len;
+    stream = mapping_chunk_init(attr, chunk, &offset);
+    chunk->vcn = attr->data.non_resident.lowest_vcn;
+    for (;;) {
+        if (parse_data_run(stream, &offset, attr_len, chunk))
+            return -1;
+        if (chunk->flags & MAP_END)
+            return -1;
+        if (vcn >= chunk->vcn && vcn < chunk->vcn + chunk->len)
+            return 0;
+        chunk->vcn += chunk->len;
+    }
+}
+
+/*
+ * Map vcn of a non-resident attribute.  Returns the number of clusters
+ * from vcn to the end of its run, with *lcn set to the cluster vcn maps
+ * to, or to -1 in a hole.  Returns 0 if vcn can't be mapped.
+ */
+static uint64_t ntfs_map_vcn(struct inode *inode,
+                             struct ntfs_attr_record *attr, uint64_t vcn,
+                             int64_t *lcn)
+{
+    const struct ntfs_sb_info *sbi = NTFS_SB(inode->fs);
+    const unsigned clust_shift = sbi->clust_shift;
+    const uint64_t lsec = vcn << clust_shift;
+    const struct extent *e;
+    struct mapping_chunk chunk;
+
+    e = lsec >> 32 ? NULL : extent_map_find(inode, lsec);
+    if (e && e->lstart <= lsec) {
+        if (EXTENT_SPECIAL(e->pstart))
+            *lcn = -1;
+        else
+            *lcn = (e->pstart + (lsec - e->lstart)) >> clust_shift;
+        return (e->lstart + e->len - lsec + sbi->clust_mask) >> clust_shift;
+    }
+
+    if (NTFS_PVT(inode)->runs == NTFS_RUNS_PARTIAL) {
+        if (!attr || ntfs_find_run(attr, vcn, &chunk))
+            return 0;
+        if (chunk.flags & MAP_ALLOCATED)
+            *lcn = chunk.lcn + (vcn - chunk.vcn);
+        else
+            *lcn = -1;
+        return chunk.len - (vcn - chunk.vcn);
+    }
+
+    /* Not in the runlist, so it's a hole up to the next run */
+    *lcn = -1;
+    if (!e)
+        return UINT64_MAX >> sbi->clust_byte_shift;
+    return (e->lstart - lsec) >> clust_shift;
+}
+
+/*
+ * Read len bytes at byte offset pos of the non-resident attribute attr,
+ * whose runlist has been loaded into inode's extent map.  Each piece
+ * of a run is fetched with a single cache_read(); holes read as zeroes.
+ */
+static int ntfs_attr_read(struct inode *inode, struct ntfs_attr_record *attr,
+                          uint64_t pos, void *buf, size_t len)
+{
+    struct fs_info *fs = inode->fs;
+    const unsigned clust_byte_shift = NTFS_SB(fs)->clust_byte_shift;
+    const uint32_t offset_mask = NTFS_SB(fs)->clust_size - 1;
+    uint64_t clusters;
+    int64_t lcn;
+    size_t count;
+
+    while (len) {
+        clusters = ntfs_map_vcn(inode, attr, pos >> clust_byte_shift, &lcn);
+        if (!clusters)
+            return -1;
+
+        count = min(len, (clusters << clust_byte_shift) - (pos & offset_mask));
+        if (lcn < 0)
+            memset(buf, 0, count);
+        else if (cache_read(fs, buf, ((uint64_t)lcn << clust_byte_shift) +
+                            (pos & offset_mask), count) != count)
+            return -1;
+
+        buf = (uint8_t *)buf + count;
+        pos += count;
+        len -= count;
+    }
+
+    return 0;
+}
+
+/*
+ * Decode the compression unit holding vcn into sbi->cu_data.  The
+ * clusters of a compressed unit are allocated at its start and the rest
+ * of it is sparse.  A unit with no sparse clusters is stored as is, and
+ * one with no allocated clusters reads as zeroes.
+ */
+static int ntfs_read_cu(struct inode *inode, struct ntfs_attr_record *attr,
+                        uint64_t vcn)
+{
+    struct ntfs_sb_info *sbi = NTFS_SB(inode->fs);
+    const unsigned clust_byte_shift = sbi->clust_byte_shift;
+    const uint64_t cu_clusters = UINT64_C(1) << NTFS_PVT(inode)->cu_shift;
+    const size_t cu_size = (size_t)sbi->clust_size << NTFS_PVT(inode)->cu_shift;
+    const uint64_t first = vcn & ~(cu_clusters - 1);
+    const uint64_t last = first + cu_clusters;
+    uint64_t v, clusters;
+    int64_t lcn;
+    size_t raw_size;
+
+    if (sbi->cu_vcn == first && sbi->cu_mft_no == NTFS_PVT(inode)->mft_no)
+        return 0;
+
+    if (!sbi->cu_data) {
+        sbi->cu_data = malloc(1 << NTFS_MAX_CU_SHIFT);
+        sbi->cu_raw = malloc(1 << NTFS_MAX_CU_SHIFT);
+        if (!sbi->cu_data || !sbi->cu_raw)
+            malloc_error("compression unit buffers");
+    }
+
+    sbi->cu_vcn = -1;
+
+    /* Find where the allocated clusters of the unit end */
+    for (v = first; v < last; v += min(clusters, last - v)) {
+        clusters = ntfs_map_vcn(inode, attr, v, &lcn);
+        if (!clusters)
+            return -1;
+        if (lcn < 0)
+            break;
+    }
+
+    raw_size = (v - first) << clust_byte_shift;
+    if (v == first) {
+        memset(sbi->cu_data, 0, cu_size);
+    } else if (v >= last) {
+        if (ntfs_attr_read(inode, attr, first << clust_byte_shift,
+                           sbi->cu_data, cu_size))
+            return -1;
+    } else {
+        if (ntfs_attr_read(inode, attr, first << clust_byte_shift,
+                           sbi->cu_raw, raw_size))
+            return -1;
+        if (ntfs_lznt1_decompress(sbi->cu_data, cu_size, sbi->cu_raw,
+                                  raw_size))
+            return -1;
+    }
+
+    sbi->cu_vcn = first;
+    sbi->cu_mft_no = NTFS_PVT(inode)->mft_no;
+    return 0;
+}
+
 static struct ntfs_mft_record *
 ntfs_attr_list_lookup(struct fs_info *fs, struct ntfs_attr_record *attr,
                       uint32_t type, struct ntfs_mft_record *mrec)
@@ -415,11 +623,7 @@ ntfs_attr_list_lookup(struct fs_info *fs, struct ntfs_attr_record *attr,
     int err;
     const uint64_t blk_size = UINT64_C(1) << BLOCK_SHIFT(fs);
     uint8_t buf[blk_size];
-    uint64_t blk_offset;
     int64_t vcn;
-    int64_t lcn;
-    int64_t last_lcn;
-    block_t blk;
     struct ntfs_attr_list_entry *attr_entry;
     uint32_t len = 0;
     struct ntfs_mft_record *retval;
@@ -461,16 +665,10 @@ handle_non_resident_attr:
             break;
         if (chunk.flags & MAP_ALLOCATED) {
             vcn = 0;
-            lcn = chunk.lcn;
             while (vcn < chunk.len) {
-                blk = (lcn + vcn) << NTFS_SB(fs)->clust_byte_shift >>
-                    BLOCK_SHIFT(fs);
-                blk_offset = 0;
-                last_lcn = lcn;
-                lcn += vcn;
-                err = ntfs_read(fs, buf, blk_size, blk_size, &blk,
-                                &blk_offset, NULL, (uint64_t *)&lcn);
-                if (err) {
+                if (cache_read(fs, buf, (uint64_t)(chunk.lcn + vcn) <<
+                               NTFS_SB(fs)->clust_byte_shift,
+                               blk_size) != blk_size) {
                     printf("Error while reading from cache.\n");
                     goto out;
                 }
@@ -486,7 +684,6 @@ handle_non_resident_attr:
                         goto found; /* We got the attribute! :-) */
                 }
 
-                lcn = last_lcn; /* restore original LCN */
                 /* go to the next VCN */
                 vcn += (blk_size / (1 << NTFS_SB(fs)->clust_byte_shift));
             }
@@ -571,6 +768,7 @@ again:
         attr = NULL;
     }
 
+    *mrec = _mrec;      /* The record holding attr */
     return attr;
 
 out:
@@ -614,11 +812,7 @@ static int index_inode_setup(struct fs_info *fs, unsigned long mft_no,
     struct ntfs_mft_record *mrec, *lmrec;
     struct ntfs_attr_record *attr;
     enum dirent_type d_type;
-    uint8_t *attr_len;
-    struct mapping_chunk chunk;
-    int err;
-    uint8_t *stream;
-    uint32_t offset;
+    uint8_t cu_shift;
 
     dprintf("in %s()\n", __func__);
 
@@ -630,6 +824,7 @@ static int index_inode_setup(struct fs_info *fs, unsigned long mft_no,
 
     lmrec = mrec;
 
+    inode->ino = mft_no;
     NTFS_PVT(inode)->mft_no = mft_no;
     NTFS_PVT(inode)->seq_no = mrec->seq_no;
 
@@ -672,35 +867,29 @@ static int index_inode_setup(struct fs_info *fs, unsigned long mft_no,
 
         if (!attr->non_resident) {
             NTFS_PVT(inode)->data.resident.offset =
-                (uint32_t)((uint8_t *)attr + attr->data.resident.value_offset);
+                (uint32_t)(uintptr_t)((uint8_t *)attr +
+                                       attr->data.resident.value_offset);
             inode->size = attr->data.resident.value_len;
         } else {
-            attr_len = (uint8_t *)attr + attr->len;
-
-            stream = mapping_chunk_init(attr, &chunk, &offset);
-            NTFS_PVT(inode)->data.non_resident.rlist = NULL;
-            for (;;) {
-                err = parse_data_run(stream, &offset, attr_len, &chunk);
-                if (err) {
-                    printf("parse_data_run()\n");
-                    goto out;
-                }
+            if (attr->flags & NTFS_ATTR_ENCRYPTED) {
+                printf("Encrypted files are not supported.\n");
+                goto out;
+            }
 
-                if (chunk.flags & MAP_UNALLOCATED)
-                    continue;
-                if (chunk.flags & MAP_END)
-                    break;
-                if (chunk.flags &  MAP_ALLOCATED) {
-                    /* append new run to the runlist */
-                    runlist_append(&NTFS_PVT(inode)->data.non_resident.rlist,
-                                    (struct runlist_element *)&chunk);
-                    /* update for next VCN */
-                    chunk.vcn += chunk.len;
+            if (attr->flags & NTFS_ATTR_COMPRESSION_MASK) {
+                cu_shift = attr->data.non_resident.compression_unit;
+                if ((attr->flags & NTFS_ATTR_COMPRESSION_MASK) !=
+                    NTFS_ATTR_COMPRESSED || !cu_shift ||
+                    cu_shift + NTFS_SB(fs)->clust_byte_shift >
+                    NTFS_MAX_CU_SHIFT) {
+                    printf("Unsupported compression format.\n");
+                    goto out;
                 }
+                NTFS_PVT(inode)->cu_shift = cu_shift;
             }
 
-            if (runlist_is_empty(NTFS_PVT(inode)->data.non_resident.rlist)) {
-                printf("No mapping found\n");
+            if (ntfs_load_runlist(inode, attr)) {
+                printf("parse_data_run()\n");
                 goto out;
             }
 
@@ -720,12 +909,59 @@ out:
     return -1;
 }
 
+/*
+ * Load the $BITMAP of a directory's index allocation: bit n is set if
+ * index block n is in use.  Blocks marked free may still hold stale
+ * entries.  Returns a malloc()ed copy and its length in *len, or NULL
+ * if there is none.
+ */
+static uint8_t *ntfs_idx_bitmap(struct fs_info *fs,
+                                struct ntfs_attr_record *attr, uint64_t *len)
+{
+    const struct ntfs_sb_info *sbi = NTFS_SB(fs);
+    struct mapping_chunk chunk;
+    uint64_t size, pos, vcn;
+    uint8_t *bits;
+
+    if (!attr->non_resident) {
+        size = attr->data.resident.value_len;
+        bits = malloc(size);
+        if (!bits)
+            return NULL;
+        memcpy(bits, (uint8_t *)attr + attr->data.resident.value_offset, size);
+        *len = size;
+        return bits;
+    }
+
+    size = attr->data.non_resident.initialized_size;
+    bits = malloc((size + sbi->clust_size - 1) & ~(uint64_t)(sbi->clust_size - 1));
+    if (!bits)
+        return NULL;
+
+    for (pos = 0; pos < size; pos += sbi->clust_size) {
+        vcn = pos >> sbi->clust_byte_shift;
+        if (ntfs_find_run(attr, vcn, &chunk))
+            goto err;
+        if (!(chunk.flags & MAP_ALLOCATED))
+            memset(bits + pos, 0, sbi->clust_size);
+        else if (cache_read(fs, bits + pos, (uint64_t)(chunk.lcn + vcn -
+                            chunk.vcn) << sbi->clust_byte_shift,
+                            sbi->clust_size) != sbi->clust_size)
+            goto err;
+    }
+
+    *len = size;
+    return bits;
+
+err:
+    free(bits);
+    return NULL;
+}
+
 static struct inode *ntfs_index_lookup(const char *dname, struct inode *dir)
 {
     struct fs_info *fs = dir->fs;
     struct ntfs_mft_record *mrec, *lmrec;
-    block_t blk;
-    uint64_t blk_offset;
     struct ntfs_attr_record *attr;
     struct ntfs_idx_root *ir;
     struct ntfs_idx_entry *ie;
@@ -733,13 +969,10 @@ static struct inode *ntfs_index_lookup(const char *dname, struct inode *dir)
     uint8_t buf[blk_size];
     struct ntfs_idx_allocation *iblk;
     int err;
-    uint8_t *stream;
-    uint8_t *attr_len;
-    struct mapping_chunk chunk;
-    uint32_t offset;
-    int64_t vcn;
-    int64_t lcn;
-    int64_t last_lcn;
+    uint64_t pos, blkno;
+    uint8_t *bitmap = NULL;
+    uint64_t bitmap_len = 0;
+    struct ntfs_attr_record *battr;
     struct inode *inode;
 
     dprintf("in %s()\n", __func__);
@@ -799,75 +1032,61 @@ static struct inode *ntfs_index_lookup(const char *dname, struct inode *dir)
         goto out;
     }
 
-    attr_len = (uint8_t *)attr + attr->len;
-    stream = mapping_chunk_init(attr, &chunk, &offset);
-    do {
-        err = parse_data_run(stream, &offset, attr_len, &chunk);
-        if (err)
-            break;
-
-        if (chunk.flags & MAP_UNALLOCATED)
-            continue;
+    /* The directory inode keeps the runlist of its index allocation */
+    if (NTFS_PVT(dir)->runs == NTFS_RUNS_UNKNOWN &&
+        ntfs_load_runlist(dir, attr)) {
+        printf("parse_data_run()\n");
+        goto out;
+    }
 
-        if (chunk.flags & MAP_ALLOCATED) {
-            dprintf("%d cluster(s) starting at 0x%08llX\n", chunk.len,
-                    chunk.lcn);
+    battr = ntfs_attr_lookup(fs, NTFS_AT_BITMAP, &mrec, lmrec);
+    if (battr)
+        bitmap = ntfs_idx_bitmap(fs, battr, &bitmap_len);
 
-            vcn = 0;
-            lcn = chunk.lcn;
-            while (vcn < chunk.len) {
-                blk = (lcn + vcn) << NTFS_SB(fs)->clust_shift <<
-                    SECTOR_SHIFT(fs) >> BLOCK_SHIFT(fs);
-
-                blk_offset = 0;
-                last_lcn = lcn;
-                lcn += vcn;
-                err = ntfs_read(fs, &buf, blk_size, blk_size, &blk,
-                                &blk_offset, NULL, (uint64_t *)&lcn);
-                if (err) {
-                    printf("Error while reading from cache.\n");
-                    goto not_found;
-                }
+    for (pos = 0; pos < attr->data.non_resident.data_size; pos += blk_size) {
+        /* Skip blocks which $BITMAP says are free */
+        blkno = pos >> BLOCK_SHIFT(fs);
+        if (bitmap && (blkno >> 3 >= bitmap_len ||
+                       !(bitmap[blkno >> 3] & (1 << (blkno & 7)))))
+            continue;
 
-                ntfs_fixups_writeback(fs, (struct ntfs_record *)&buf);
+        if (ntfs_attr_read(dir, attr, pos, buf, blk_size)) {
+            printf("Error while reading from cache.\n");
+            goto not_found;
+        }
 
-                iblk = (struct ntfs_idx_allocation *)&buf;
-                if (iblk->magic != NTFS_MAGIC_INDX) {
-                    printf("Not a valid INDX record.\n");
-                    goto not_found;
-                }
+        ntfs_fixups_writeback(fs, (struct ntfs_record *)&buf);
 
-                ie = (struct ntfs_idx_entry *)((uint8_t *)&iblk->index +
-                                            iblk->index.entries_offset);
-                for (;; ie = (struct ntfs_idx_entry *)((uint8_t *)ie +
-                        ie->len)) {
-                    /* bounds checks */
-                    if ((uint8_t *)ie < (uint8_t *)iblk || (uint8_t *)ie +
-                        sizeof(struct ntfs_idx_entry_header) >
-                        (uint8_t *)&iblk->index + iblk->index.index_len ||
-                        (uint8_t *)ie + ie->len >
-                        (uint8_t *)&iblk->index + iblk->index.index_len)
-                        goto index_err;
-
-                    /* last entry cannot contain a key */
-                    if (ie->flags & INDEX_ENTRY_END)
-                        break;
-
-                    if (ntfs_filename_cmp(dname, ie))
-                        goto found;
-                }
+        /* Index blocks not in use by the B+ tree are just skipped */
+        iblk = (struct ntfs_idx_allocation *)&buf;
+        if (iblk->magic != NTFS_MAGIC_INDX)
+            continue;
 
-                lcn = last_lcn; /* restore the original LCN */
-                /* go to the next VCN */
-                vcn += (blk_size / (1 << NTFS_SB(fs)->clust_byte_shift));
-            }
+        ie = (struct ntfs_idx_entry *)((uint8_t *)&iblk->index +
+                                    iblk->index.entries_offset);
+        for (;; ie = (struct ntfs_idx_entry *)((uint8_t *)ie + ie->len)) {
+            /* bounds checks */
+            if ((uint8_t *)ie < (uint8_t *)iblk || (uint8_t *)ie +
+                sizeof(struct ntfs_idx_entry_header) >
+                (uint8_t *)&iblk->index + iblk->index.index_len ||
+                (uint8_t *)ie + ie->len >
+                (uint8_t *)&iblk->index + iblk->index.index_len)
+                goto index_err;
+
+            /* last entry cannot contain a key */
+            if (ie->flags & INDEX_ENTRY_END)
+                break;
+
+            if (ntfs_filename_cmp(dname, ie))
+                goto found;
         }
-    } while (!(chunk.flags & MAP_END));
+    }
 
 not_found:
     dprintf("Index not found\n");
 
 out:
+    free(bitmap);
     free(mrec);
 
     return NULL;
@@ -882,6 +1101,8 @@ found:
         goto out;
     }
 
+    dcache_insert(dir, dname, ie->data.dir.indexed_file, NULL, 0);
+    free(bitmap);
     free(mrec);
 
     return inode;
@@ -910,13 +1131,48 @@ static uint8_t ntfs_cvt_filename(char *filename,
     return entry_fn_len;
 }
 
+/* Map lstart by parsing the runlist again, if it didn't fit in the map */
+static int ntfs_next_run(struct inode *inode, uint32_t lstart)
+{
+    struct fs_info *fs = inode->fs;
+    struct ntfs_sb_info *sbi = NTFS_SB(fs);
+    struct ntfs_mft_record *mrec, *lmrec;
+    struct ntfs_attr_record *attr;
+    struct mapping_chunk chunk;
+    uint32_t delta;
+    int err = -1;
+
+    mrec = sbi->mft_record_lookup(fs, NTFS_PVT(inode)->mft_no, NULL);
+    if (!mrec) {
+        printf("No MFT record found.\n");
+        return -1;
+    }
+
+    lmrec = mrec;
+    attr = ntfs_attr_lookup(fs, NTFS_AT_DATA, &mrec, lmrec);
+    if (!attr || ntfs_find_run(attr, lstart >> sbi->clust_shift, &chunk))
+        goto out;
+
+    delta = lstart - (chunk.vcn << sbi->clust_shift);
+    if (chunk.flags & MAP_ALLOCATED)
+        inode->next_extent.pstart = (chunk.lcn << sbi->clust_shift) + delta;
+    else
+        inode->next_extent.pstart = EXTENT_ZERO;
+    inode->next_extent.len = (chunk.len << sbi->clust_shift) - delta;
+    err = 0;
+
+out:
+    free(mrec);
+    return err;
+}
+
 static int ntfs_next_extent(struct inode *inode, uint32_t lstart)
 {
     struct fs_info *fs = inode->fs;
     struct ntfs_sb_info *sbi = NTFS_SB(fs);
     sector_t pstart = 0;
-    struct runlist *rlist;
-    struct runlist *ret;
+    const struct extent *e;
+    uint32_t lend;
     const uint32_t sec_size = SECTOR_SIZE(fs);
     const uint32_t sec_shift = SECTOR_SHIFT(fs);
 
@@ -927,35 +1183,78 @@ static int ntfs_next_extent(struct inode *inode, uint32_t lstart)
                 sec_shift;
         inode->next_extent.len = (inode->size + sec_size - 1) >> sec_shift;
     } else {
-        rlist = NTFS_PVT(inode)->data.non_resident.rlist;
+        /*
+         * The runs are already in the extent map, so generic_getfssec()
+         * only asks us about holes, unless the map ran out of room.
+         */
+        if (NTFS_PVT(inode)->runs == NTFS_RUNS_PARTIAL)
+            return ntfs_next_run(inode, lstart);
 
-        if (!lstart || lstart >= NTFS_PVT(inode)->here) {
-            if (runlist_is_empty(rlist))
-                goto out;   /* nothing to do ;-) */
+        e = extent_map_find(inode, lstart);
+        lend = e ? e->lstart : (inode->size + sec_size - 1) >> sec_shift;
+        if (lend <= lstart)
+            goto out;
 
-            ret = runlist_remove(&rlist);
+        pstart = EXTENT_ZERO;
+        inode->next_extent.len = lend - lstart;
+    }
 
-            NTFS_PVT(inode)->here =
-                ((ret->run.len << sbi->clust_byte_shift) >> sec_shift);
+    inode->next_extent.pstart = pstart;
 
-            pstart = ret->run.lcn << sbi->clust_shift;
-            inode->next_extent.len =
-                ((ret->run.len << sbi->clust_byte_shift) + sec_size - 1) >>
-                sec_shift;
+    return 0;
 
-            NTFS_PVT(inode)->data.non_resident.rlist = rlist;
+out:
+    return -1;
+}
 
-            free(ret);
-            ret = NULL;
+/* Read a compressed file, one compression unit at a time */
+static uint32_t ntfs_getfssec_compressed(struct file *file, char *buf,
+                                         int sectors, bool *have_more)
+{
+    struct fs_info *fs = file->fs;
+    struct inode *inode = file->inode;
+    struct ntfs_sb_info *sbi = NTFS_SB(fs);
+    struct ntfs_mft_record *mrec = NULL, *lmrec;
+    struct ntfs_attr_record *attr = NULL;
+    const uint32_t cu_mask =
+        (sbi->clust_size << NTFS_PVT(inode)->cu_shift) - 1;
+    const uint32_t bytes_left = inode->size - file->offset;
+    const uint32_t bytes = min((uint32_t)sectors << SECTOR_SHIFT(fs),
+                               bytes_left);
+    uint32_t done = 0;
+    uint32_t pos, count;
+
+    /* The attribute is only needed for runs that didn't fit the map */
+    if (NTFS_PVT(inode)->runs == NTFS_RUNS_PARTIAL) {
+        mrec = sbi->mft_record_lookup(fs, NTFS_PVT(inode)->mft_no, NULL);
+        if (!mrec) {
+            printf("No MFT record found.\n");
+            return 0;
         }
+
+        lmrec = mrec;
+        attr = ntfs_attr_lookup(fs, NTFS_AT_DATA, &mrec, lmrec);
     }
 
-    inode->next_extent.pstart = pstart;
+    while (done < bytes) {
+        pos = file->offset + done;
+        if (ntfs_read_cu(inode, attr, pos >> sbi->clust_byte_shift)) {
+            printf("Error while decompressing.\n");
+            break;
+        }
 
-    return 0;
+        count = min(bytes - done, cu_mask + 1 - (pos & cu_mask));
+        memcpy(buf + done, sbi->cu_data + (pos & cu_mask), count);
+        done += count;
+    }
 
-out:
-    return -1;
+    free(mrec);
+
+    file->offset += done;
+    if (have_more)
+        *have_more = done < bytes_left;
+
+    return done;
 }
 
 static uint32_t ntfs_getfssec(struct file *file, char *buf, int sectors,
@@ -973,6 +1272,9 @@ static uint32_t ntfs_getfssec(struct file *file, char *buf, int sectors,
 
     non_resident = NTFS_PVT(inode)->non_resident;
 
+    if (NTFS_PVT(inode)->cu_shift)
+        return ntfs_getfssec_compressed(file, buf, sectors, have_more);
+
     ret = generic_getfssec(file, buf, sectors, have_more);
     if (!ret)
         return ret;
@@ -1020,8 +1322,6 @@ static int ntfs_readdir(struct file *file, struct dirent *dirent)
     struct fs_info *fs = file->fs;
     struct inode *inode = file->inode;
     struct ntfs_mft_record *mrec, *lmrec;
-    block_t blk;
-    uint64_t blk_offset;
     const uint64_t blk_size = UINT64_C(1) << BLOCK_SHIFT(fs);
     struct ntfs_attr_record *attr;
     struct ntfs_idx_root *ir;
@@ -1125,13 +1425,8 @@ next_vcn:
     }
 
     lcn = chunk.lcn;
-    blk = (lcn + vcn) << NTFS_SB(fs)->clust_shift << SECTOR_SHIFT(fs) >>
-            BLOCK_SHIFT(fs);
-
-    blk_offset = 0;
-    err = ntfs_read(fs, &buf, blk_size, blk_size, &blk, &blk_offset, NULL,
-                    (uint64_t *)&lcn);
-    if (err) {
+    if (cache_read(fs, buf, (uint64_t)(lcn + vcn) <<
+                   NTFS_SB(fs)->clust_byte_shift, blk_size) != blk_size) {
         printf("Error while reading from cache.\n");
         goto not_found;
     }
@@ -1218,9 +1513,22 @@ index_err:
     goto out;
 }
 
-static inline struct inode *ntfs_iget(const char *dname, struct inode *parent)
+static struct inode *ntfs_iget(const char *dname, struct inode *parent)
 {
-    return ntfs_index_lookup(dname, parent);
+    const struct dentry *dc;
+    struct inode *inode;
+
+    dc = dcache_lookup(parent, dname);
+    if (!dc)
+        return ntfs_index_lookup(dname, parent);
+
+    inode = new_ntfs_inode(parent->fs);
+    if (index_inode_setup(parent->fs, dc->ino, inode)) {
+        free(inode);
+        return NULL;
+    }
+
+    return inode;
 }
 
 static struct inode *ntfs_iget_root(struct fs_info *fs)
@@ -1318,12 +1626,17 @@ static int ntfs_fs_init(struct fs_info *fs)
 
     SECTOR_SIZE(fs) = 1 << SECTOR_SHIFT(fs);
 
-    sbi = malloc(sizeof *sbi);
+    sbi = zalloc(sizeof *sbi);
     if (!sbi)
         malloc_error("ntfs_sb_info structure");
 
     fs->fs_info = sbi;
 
+    sbi->mft_cache = zalloc(NTFS_MFT_CACHE * sizeof *sbi->mft_cache);
+    if (!sbi->mft_cache)
+        malloc_error("ntfs_mft_cache structure");
+    sbi->cu_vcn = -1;
+
     sbi->clust_shift            = ilog2(ntfs.sec_per_clust);
     sbi->clust_byte_shift       = sbi->clust_shift + SECTOR_SHIFT(fs);
     sbi->clust_mask             = ntfs.sec_per_clust - 1;
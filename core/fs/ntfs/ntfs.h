@@ -17,8 +17,6 @@
  * 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
 */
 
-#include "runlist.h"
-
 #ifndef _NTFS_H_
 #define _NTFS_H_
 
@@ -55,6 +53,15 @@ struct ntfs_mft_record;
 typedef struct ntfs_mft_record *f_mft_record_lookup(struct fs_info *,
                                                     uint32_t, block_t *);
 
+/* Recently used MFT records, already fixed up */
+#define NTFS_MFT_CACHE 16
+
+struct ntfs_mft_cache {
+    uint32_t mft_no;
+    uint32_t last_used;             /* 0 if the slot is free */
+    struct ntfs_mft_record *mrec;
+};
+
 struct ntfs_sb_info {
     block_t mft_blk;                /* The first MFT record block */
     uint64_t mft_lcn;               /* LCN of the first MFT record */
@@ -75,8 +82,30 @@ struct ntfs_sb_info {
 
     /* NTFS-version-dependent MFT record lookup function to use */
     f_mft_record_lookup *mft_record_lookup;
+
+    /* $MFT itself, to find records beyond its first cluster */
+    struct inode *mft;                      /* Runlist in ->extent_map */
+    struct ntfs_mft_record *mft_mrec;       /* Its MFT record... */
+    struct ntfs_attr_record *mft_data;      /* ...and $DATA attribute */
+
+    struct ntfs_mft_cache *mft_cache;       /* NTFS_MFT_CACHE slots */
+    uint32_t mft_clock;
+
+    /* The last compression unit decoded, see ntfs_read_cu() */
+    uint8_t *cu_data;                       /* Decompressed unit */
+    uint8_t *cu_raw;                        /* Its compressed clusters */
+    unsigned long cu_mft_no;                /* File it belongs to */
+    uint64_t cu_vcn;                        /* First VCN, or -1 if none */
 } __attribute__((__packed__));
 
+/* Compression units are at most this large (16 clusters of 4 KiB) */
+#define NTFS_MAX_CU_SHIFT   16
+
+/* ntfs_inode.runs: what inode->extent_map holds of the runlist */
+#define NTFS_RUNS_UNKNOWN   0       /* Not loaded yet */
+#define NTFS_RUNS_COMPLETE  1       /* All of it; anything else is a hole */
+#define NTFS_RUNS_PARTIAL   2       /* Too many runs, parse the rest */
+
 /* The NTFS in-memory inode structure */
 struct ntfs_inode {
     int64_t initialized_size;
@@ -85,13 +114,12 @@ struct ntfs_inode {
     uint16_t seq_no;            /* Sequence number of the mft record */
     uint32_t type;              /* Attribute type of this inode */
     uint8_t non_resident;
+    uint8_t runs;           /* Runlist of $DATA, or $INDEX_ALLOCATION */
+    uint8_t cu_shift;       /* log2(clusters) per compression unit, or 0 */
     union {                 /* Non-resident $DATA attribute */
         struct {            /* Used only if non_resident flags isn't set */
             uint32_t offset;    /* Data offset */
         } resident;
-        struct {            /* Used only if non_resident is set */
-            struct runlist *rlist;
-        } non_resident;
     } data;
     uint32_t start_cluster; /* Starting cluster address */
     sector_t start;         /* Starting sector */
@@ -175,6 +203,14 @@ enum {
     NTFS_FILE_ATTR_DUP_VIEW_INDEX_PRESENT       = 0x20000000,
 };
 
+/* Attribute record flags (16-bit) */
+enum {
+    NTFS_ATTR_COMPRESSED                        = 0x0001,
+    NTFS_ATTR_COMPRESSION_MASK                  = 0x00FF,
+    NTFS_ATTR_ENCRYPTED                         = 0x4000,
+    NTFS_ATTR_SPARSE                            = 0x8000,
+};
+
 /*
  * Magic identifiers present at the beginning of all ntfs record containing
  * records (like mft records for example).
@@ -199,7 +235,7 @@ struct ntfs_record {
     uint32_t magic;
     uint16_t usa_ofs;
     uint16_t usa_count;
-} __attribute__((__packed__)) NTFS_RECORD;
+} __attribute__((__packed__));
 
 /* The $MFT metadata file types */
 enum ntfs_system_file {
@@ -482,4 +518,8 @@ static inline struct ntfs_sb_info *NTFS_SB(struct fs_info *fs)
 
 #define NTFS_PVT(i) ((struct ntfs_inode *)((i)->pvt))
 
+/* lznt1.c */
+int ntfs_lznt1_decompress(void *dst, size_t dst_len,
+                          const void *src, size_t src_len);
+
 #endif /* _NTFS_H_ */
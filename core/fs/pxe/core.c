@@ -1,7 +1,11 @@
 #include <syslinux/pxe_api.h>
 #include <lwip/api.h>
+#include <lwip/tcp.h>
 #include <lwip/tcpip.h>
 #include <lwip/dns.h>
+#include <lwip/netif.h>
+#include <lwip/udp.h>
+#include <minmax.h>
 #include <core.h>
 #include <net.h>
 #include "pxe.h"
@@ -118,7 +122,7 @@ int core_udp_recv(struct pxe_pvt_inode *socket, void *buf, uint16_t *buf_len,
     if (nbuf_len <= *buf_len)
 	netbuf_copy(nbuf, buf, nbuf_len);
     else
-	nbuf_len = 0; /* impossible mtu < PKTBUF_SIZE */
+	nbuf_len = 0; /* larger than we asked the peer for */
     netbuf_delete(nbuf);
 
     *buf_len = nbuf_len;
@@ -208,6 +212,29 @@ out:
     netbuf_delete(nbuf);
 }
 
+/**
+ * Largest UDP payload we can receive
+ *
+ * @param:frag, whether IP fragmentation is acceptable
+ *
+ * @out: payload size in bytes, 0 if the link MTU is not known
+ */
+size_t core_udp_maxlen(bool frag)
+{
+    struct netif *netif = netif_default;
+    size_t len;
+
+    if (!netif || netif->mtu <= IP_HLEN + UDP_HLEN)
+	return 0;
+
+    if (!frag)
+	return netif->mtu - IP_HLEN - UDP_HLEN;
+
+    /* All the fragments of a datagram have to fit the reassembly queue */
+    len = IP_REASS_MAX_PBUFS * ((netif->mtu - IP_HLEN) & ~7) - UDP_HLEN;
+    return min(len, 0xffff - IP_HLEN - UDP_HLEN);
+}
+
 /**
  * Network stack-specific initialization
  */
@@ -248,6 +275,11 @@ void probe_undi(void)
 
 int core_tcp_open(struct pxe_pvt_inode *socket)
 {
+    /* The receive window is fixed when the pcb is allocated */
+    tcp_set_rcv_wnd(TcpWindow,
+		    ((TcpOptions & TCP_OPT_WSCALE) ? TCP_RCV_WND_SCALE : 0) |
+		    ((TcpOptions & TCP_OPT_SACK) ? TCP_RCV_SACK : 0));
+
     socket->net.lwip.conn = netconn_new(NETCONN_TCP);
     if (!socket->net.lwip.conn)
 	return -1;
@@ -133,6 +133,22 @@ static void pxelinux_reboottime(const void *data, int opt_len)
     DHCPMagic |= 8;     /* Got reboot time */
 }
 
+static void pxelinux_tcpwindow(const void *data, int opt_len)
+{
+    if (opt_len != 4)
+        return;
+
+    TcpWindow = ntohl(*(const uint32_t *)data);
+}
+
+static void pxelinux_tcpoptions(const void *data, int opt_len)
+{
+    if (opt_len != 1)
+        return;
+
+    TcpOptions = *(const uint8_t *)data;
+}
+
 
 struct dhcp_options {
     int opt_num;
@@ -152,7 +168,9 @@ static const struct dhcp_options dhcp_opts[] = {
     {97,  uuid_client_identifier},
     {209, pxelinux_configfile},
     {210, pxelinux_pathprefix},
-    {211, pxelinux_reboottime}
+    {211, pxelinux_reboottime},
+    {224, pxelinux_tcpwindow},
+    {225, pxelinux_tcpoptions}
 };
 
 /*
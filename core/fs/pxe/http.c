@@ -1,5 +1,6 @@
 #include <syslinux/sysappend.h>
 #include <ctype.h>
+#include <minmax.h>
 #include <lwip/api.h>
 #include "pxe.h"
 #include "version.h"
@@ -146,18 +147,140 @@ __export void http_bake_cookies(void)
     http_do_bake_cookies(cookie_buf);
 }
 
-static const struct pxe_conn_ops http_conn_ops = {
-    .fill_buffer	= core_tcp_fill_buffer,
-    .close		= core_tcp_close_file,
-    .readdir		= http_readdir,
+/*
+ * Parallel range downloads.  A large file is split into ranges which
+ * are fetched over several connections at once, each connection
+ * taking every nth range, and handed out in order.  Each range has to
+ * fit in the TCP receive window: then the connections we aren't
+ * reading from can take in the whole of their range meanwhile, and
+ * the file arrives as fast as all the windows together allow.
+ */
+#define HTTP_RANGE_SIZE	(60 << 10)	/* Below TCP_WND in lwipopts.h */
+#define HTTP_RANGE_MAX	8		/* Connections per file */
+
+__export uint32_t HttpRanges = 0; /* Connections per file, 0/1 = one */
+
+struct http_range {
+    struct inode *conn;		/* Connection, or NULL */
+    uint32_t start;		/* File offset of the range */
+    uint32_t left;		/* Body bytes still to read */
+    uint32_t next_start;	/* Pipelined request, if next_len */
+    uint32_t next_len;
+    bool header;		/* Response header not yet read */
+    bool keep_alive;		/* Server keeps the connection open */
+    bool reused;		/* Request went out on a used connection */
 };
 
-void http_open(struct url_info *url, int flags, struct inode *inode,
-	       const char **redir)
+struct http_ranges {
+    struct fs_info *fs;
+    uint32_t ip;
+    uint16_t port;
+    int nconn;			/* Connections in use */
+    int cur;			/* The one we are reading from */
+    uint32_t next;		/* File offset of the next range to request */
+    char *request;		/* Request header, less Range: and Connection: */
+    size_t request_len;
+    struct http_range range[HTTP_RANGE_MAX];
+};
+
+/*
+ * Persistent connections.  A connection whose response has been read
+ * to the end is kept in a small pool, if the server agrees, and the
+ * next file from the same server address and port goes out on it;
+ * that saves the handshake and the TCP slow start.  With
+ * HTTP_PIPELINE, range requests are also sent on a connection as soon
+ * as the previous response on it starts, rather than when it ends.
+ */
+#define HTTP_POOL_SIZE	4
+
+#define HTTP_KEEPALIVE	1
+#define HTTP_PIPELINE	2
+
+__export uint32_t HttpKeepAlive = HTTP_KEEPALIVE;
+
+static struct http_idle {
+    struct inode *conn;		/* Connection, or NULL */
+    uint32_t ip;
+    uint16_t port;
+} http_pool[HTTP_POOL_SIZE];
+static unsigned int http_pool_victim;
+
+/* What we care about in a response header */
+struct http_response {
+    int status;
+    uint32_t content_length;	/* -1 if unknown */
+    uint32_t range_start;	/* From Content-Range: */
+    uint32_t range_total;	/* -1 if unknown */
+    bool keep_alive;
+};
+
+static char location[FILENAME_MAX];
+
+/*
+ * Parse a decimal number; return a pointer past it, or NULL if there
+ * is no number or it overflows.
+ */
+static const char *http_number(const char *p, uint32_t *val)
+{
+    uint32_t v = 0;
+
+    if (*p < '0' || *p > '9')
+	return NULL;
+
+    for (; *p >= '0' && *p <= '9'; p++) {
+	if ((v * 10) < v)
+	    return NULL;
+	v = (v * 10) + (*p - '0');
+    }
+
+    *val = v;
+    return p;
+}
+
+static void http_field(struct http_response *resp,
+		       const char *name, const char *value)
 {
-    struct pxe_pvt_inode *socket = PVT(inode);
-    int header_bytes;
     const char *next;
+    uint32_t end;
+
+    /* Skip leading whitespace */
+    while (isspace(*value))
+	value++;
+
+    if (strcasecmp(name, "Content-Length") == 0) {
+	next = http_number(value, &resp->content_length);
+	/* In the case of overflow or other error ignore Content-Length. */
+	if (!next || *next)
+	    resp->content_length = -1;
+    } else if (strcasecmp(name, "Content-Range") == 0) {
+	/* bytes first-last/total */
+	if (strncasecmp(value, "bytes ", 6))
+	    return;
+	next = http_number(value + 6, &resp->range_start);
+	if (!next || *next++ != '-')
+	    return;
+	next = http_number(next, &end);
+	if (!next || *next++ != '/' || end < resp->range_start)
+	    return;
+	next = http_number(next, &resp->range_total);
+	if (!next || *next)
+	    resp->range_total = -1;
+    } else if (strcasecmp(name, "Connection") == 0) {
+	resp->keep_alive = !strcasecmp(value, "keep-alive");
+    } else if (strcasecmp(name, "Location") == 0) {
+	strlcpy(location, value, sizeof location);
+    }
+}
+
+/*
+ * Read and parse the response header.  Anything past it is left in
+ * the buffer as body data.
+ *
+ * @out: the status code, or 0 if the header is broken
+ */
+static int http_get_response(struct inode *inode, struct http_response *resp,
+			     size_t *response_size)
+{
     char field_name[20];
     char field_value[1024];
     size_t field_name_len, field_value_len;
@@ -172,75 +295,31 @@ void http_open(struct url_info *url, int flags, struct inode *inode,
 	st_skip_fieldvalue,
 	st_eoh,
     } state;
-    static char location[FILENAME_MAX];
-    uint32_t content_length; /* same as inode->size */
-    size_t response_size;
     int status;
     int pos;
-    int err;
-
-    (void)flags;
-
-    if (!header_buf)
-	return;			/* http is broken... */
-
-    /* This is a straightforward TCP connection after headers */
-    socket->ops = &http_conn_ops;
-
-    /* Reset all of the variables */
-    inode->size = content_length = -1;
 
-    /* Start the http connection */
-    err = core_tcp_open(socket);
-    if (err)
-        return;
+    resp->content_length = -1;
+    resp->range_total = -1;
+    resp->keep_alive = false;
+    location[0] = '\0';
 
-    if (!url->port)
-	url->port = HTTP_PORT;
-
-    err = core_tcp_connect(socket, url->ip, url->port);
-    if (err)
-	goto fail;
-
-    strcpy(header_buf, "GET /");
-    header_bytes = 5;
-    header_bytes += url_escape_unsafe(header_buf+5, url->path,
-				      header_len - 5);
-    if (header_bytes >= header_len)
-	goto fail;		/* Buffer overflow */
-    header_bytes += snprintf(header_buf + header_bytes,
-			     header_len - header_bytes,
-			     " HTTP/1.0\r\n"
-			     "Host: %s\r\n"
-			     "User-Agent: Syslinux/" VERSION_STR "\r\n"
-			     "Connection: close\r\n"
-			     "%s"
-			     "\r\n",
-			     url->host, cookie_buf ? cookie_buf : "");
-    if (header_bytes >= header_len)
-	goto fail;		/* Buffer overflow */
-
-    err = core_tcp_write(socket, header_buf, header_bytes, false);
-    if (err)
-	goto fail;
-
-    /* Parse the HTTP header */
     state = st_httpver;
     pos = 0;
     status = 0;
-    response_size = 0;
+    *response_size = 0;
     field_value_len = 0;
     field_name_len = 0;
+    field_name[0] = '\0';
 
     while (state != st_eoh) {
 	int ch = pxe_getc(inode);
 	/* Eof before I finish paring the header */
 	if (ch == -1)
-	    goto fail;
+	    return 0;
 #if 0
         printf("%c", ch);
 #endif
-	response_size++;
+	(*response_size)++;
 	if (ch == '\r' || ch == '\0')
 	    continue;
 	switch (state) {
@@ -253,7 +332,7 @@ void http_open(struct url_info *url, int flags, struct inode *inode,
 
 	case st_stcode:
 	    if (ch < '0' || ch > '9')
-	       goto fail;
+	       return 0;
 	    status = (status*10) + (ch - '0');
 	    if (++pos == 3)
 		state = st_skipline;
@@ -265,8 +344,10 @@ void http_open(struct url_info *url, int flags, struct inode *inode,
 	    break;
 
 	case st_fieldfirst:
-	    if (ch == '\n')
+	    if (ch == '\n') {
+		http_field(resp, field_name, field_value);
 		state = st_eoh;
+	    }
 	    else if (isspace(ch)) {
 		/* A continuation line */
 		state = st_fieldvalue;
@@ -274,30 +355,7 @@ void http_open(struct url_info *url, int flags, struct inode *inode,
 	    }
 	    else if (is_token(ch)) {
 		/* Process the previous field before starting on the next one */
-		if (strcasecmp(field_name, "Content-Length") == 0) {
-		    next = field_value;
-		    /* Skip leading whitespace */
-		    while (isspace(*next))
-			next++;
-		    content_length = 0;
-		    for (;(*next >= '0' && *next <= '9'); next++) {
-			if ((content_length * 10) < content_length)
-			    break;
-			content_length = (content_length * 10) + (*next - '0');
-		    }
-		    /* In the case of overflow or other error ignore
-		     * Content-Length.
-		     */
-		    if (*next)
-			content_length = -1;
-		}
-		else if (strcasecmp(field_name, "Location") == 0) {
-		    next = field_value;
-		    /* Skip leading whitespace */
-		    while (isspace(*next))
-			next++;
-		    strlcpy(location, next, sizeof location);
-		}
+		http_field(resp, field_name, field_value);
 		/* Start the field name and field value afress */
 		field_name_len = 1;
 		field_name[0] = ch;
@@ -359,10 +417,543 @@ void http_open(struct url_info *url, int flags, struct inode *inode,
 	}
     }
 
-    if (state != st_eoh)
-	status = 0;
+    resp->status = status;
+    return status;
+}
+
+static void http_drop_conn(struct inode *conn)
+{
+    if (core_tcp_is_connected(PVT(conn)))
+	core_tcp_close_file(conn);
+    free_socket(conn);
+}
+
+/* Hand a connection, and whatever data we have from it, to another socket */
+static void http_move_conn(struct pxe_pvt_inode *to,
+			   struct pxe_pvt_inode *from)
+{
+    to->net = from->net;
+    to->tftp_dataptr = from->tftp_dataptr;
+    to->tftp_bytesleft = from->tftp_bytesleft;
+    memset(&from->net, 0, sizeof from->net);
+    from->tftp_bytesleft = 0;
+}
+
+static struct inode *http_pool_get(uint32_t ip, uint16_t port)
+{
+    struct http_idle *idle;
+    struct inode *conn;
+
+    for (idle = http_pool; idle < &http_pool[HTTP_POOL_SIZE]; idle++) {
+	if (idle->conn && idle->ip == ip && idle->port == port) {
+	    conn = idle->conn;
+	    idle->conn = NULL;
+	    return conn;
+	}
+    }
+
+    return NULL;
+}
+
+/* Park an idle connection, closing the oldest one if the pool is full */
+static void http_pool_put(struct inode *conn, uint32_t ip, uint16_t port)
+{
+    struct http_idle *idle;
+
+    if (!(HttpKeepAlive & HTTP_KEEPALIVE)) {
+	http_drop_conn(conn);
+	return;
+    }
+
+    for (idle = http_pool; idle < &http_pool[HTTP_POOL_SIZE]; idle++) {
+	if (!idle->conn)
+	    break;
+    }
+
+    if (idle == &http_pool[HTTP_POOL_SIZE]) {
+	idle = &http_pool[http_pool_victim++ % HTTP_POOL_SIZE];
+	http_drop_conn(idle->conn);
+    }
+
+    idle->conn = conn;
+    idle->ip = ip;
+    idle->port = port;
+}
+
+/*
+ * Close a file; if its response has been read to the end, the
+ * connection goes back to the pool instead.
+ */
+static void http_close_file(struct inode *inode)
+{
+    struct pxe_pvt_inode *socket = PVT(inode);
+    struct inode *conn;
+
+    if (socket->http_keepalive && !socket->tftp_bytesleft &&
+	socket->tftp_filepos == inode->size) {
+	conn = alloc_inode(inode->fs, 0, sizeof(struct pxe_pvt_inode));
+	if (conn) {
+	    PVT(conn)->ops = &tcp_conn_ops;
+	    http_move_conn(PVT(conn), socket);
+	    http_pool_put(conn, socket->tftp_remoteip,
+			  socket->tftp_remoteport);
+	    return;
+	}
+    }
+
+    if (core_tcp_is_connected(socket))
+	core_tcp_close_file(inode);
+}
+
+/*
+ * A persistent connection doesn't tell us where the body ends, so
+ * stop at Content-Length rather than waiting for the server to close.
+ */
+static void http_fill_buffer(struct inode *inode)
+{
+    struct pxe_pvt_inode *socket = PVT(inode);
+
+    if (socket->tftp_filepos >= inode->size) {
+	socket->tftp_goteof = 1;
+	socket->ops->close(inode);
+	return;
+    }
+
+    core_tcp_fill_buffer(inode);
+}
+
+static const struct pxe_conn_ops http_conn_ops = {
+    .fill_buffer	= http_fill_buffer,
+    .close		= http_close_file,
+    .readdir		= http_readdir,
+};
+
+/* Give the range a connection of its own, from the pool if @pool */
+static int http_range_connect(struct http_ranges *ranges,
+			      struct http_range *range, bool pool)
+{
+    struct pxe_pvt_inode *conn;
+
+    range->conn = pool ? http_pool_get(ranges->ip, ranges->port) : NULL;
+    if (range->conn) {
+	range->reused = true;
+	return 0;
+    }
+
+    range->conn = alloc_inode(ranges->fs, 0, sizeof(struct pxe_pvt_inode));
+    if (!range->conn)
+	return -1;
+    conn = PVT(range->conn);
+    conn->ops = &tcp_conn_ops;
+    range->reused = false;
+    if (core_tcp_open(conn))
+	goto err_free;
+    if (core_tcp_connect(conn, ranges->ip, ranges->port))
+	goto err_close;
+    return 0;
+
+err_close:
+    core_tcp_close_file(range->conn);
+err_free:
+    free_socket(range->conn);
+    range->conn = NULL;
+    return -1;
+}
+
+static int http_range_send(struct http_ranges *ranges,
+			   struct http_range *range,
+			   uint32_t first, uint32_t last)
+{
+    int bytes;
+
+    memcpy(header_buf, ranges->request, ranges->request_len);
+    bytes = ranges->request_len;
+    bytes += snprintf(header_buf + bytes, header_len - bytes,
+		      "Range: bytes=%u-%u\r\n"
+		      "Connection: keep-alive\r\n"
+		      "\r\n", first, last);
+    if (bytes >= header_len)
+	return -1;
+
+    /* Several requests go out of header_buf back to back */
+    return core_tcp_write(PVT(range->conn), header_buf, bytes, true);
+}
+
+/*
+ * Ask for the range starting at ranges->next.  If the connection is
+ * still busy with a response, this is a pipelined request; otherwise
+ * the connection is reopened first if it can't be reused.  A pipelined
+ * request which can't be sent leaves the connection to finish the
+ * response it has, and the range is asked for again later.
+ */
+static int http_range_request(struct http_ranges *ranges,
+			      struct http_range *range, uint32_t size)
+{
+    bool busy = range->header || range->left;
+    uint32_t last;
+
+    if (!busy && range->conn &&
+	(!range->keep_alive || PVT(range->conn)->tftp_goteof)) {
+	http_drop_conn(range->conn);
+	range->conn = NULL;
+    }
+
+    if (!range->conn) {
+	if (http_range_connect(ranges, range, true))
+	    return -1;
+    } else if (!busy) {
+	range->reused = true;
+    }
+
+    last = min(ranges->next + HTTP_RANGE_SIZE, size) - 1;
+    if (http_range_send(ranges, range, ranges->next, last)) {
+	if (busy) {
+	    range->keep_alive = false;
+	} else {
+	    http_drop_conn(range->conn);
+	    range->conn = NULL;
+	}
+	return -1;
+    }
+
+    if (busy) {
+	range->next_start = ranges->next;
+	range->next_len = last + 1 - ranges->next;
+    } else {
+	range->start = ranges->next;
+	range->left = last + 1 - ranges->next;
+	range->header = true;
+    }
+    ranges->next = last + 1;
+    return 0;
+}
+
+/*
+ * The server may well have closed a connection which sat idle, or
+ * which it only meant to use for so many requests; ask again for the
+ * same range, once, on a fresh one.
+ */
+static int http_range_retry(struct http_ranges *ranges,
+			    struct http_range *range)
+{
+    http_drop_conn(range->conn);
+    range->conn = NULL;
+
+    if (http_range_connect(ranges, range, false) ||
+	http_range_send(ranges, range, range->start,
+			range->start + range->left - 1)) {
+	if (range->conn)
+	    http_drop_conn(range->conn);
+	range->conn = NULL;
+	return -1;
+    }
+
+    range->header = true;
+    return 0;
+}
+
+static int http_range_header(struct http_range *range)
+{
+    struct http_response resp;
+    size_t response_size;
+
+    range->header = false;
+    if (http_get_response(range->conn, &resp, &response_size) != 206 ||
+	resp.range_start != range->start ||
+	resp.content_length != range->left)
+	return -1;
+
+    range->keep_alive = resp.keep_alive;
+    return 0;
+}
+
+static void http_ranges_close(struct inode *inode)
+{
+    struct pxe_pvt_inode *socket = PVT(inode);
+    struct http_ranges *ranges = socket->ranges;
+    struct http_range *range;
+
+    if (!ranges)
+	return;
+
+    for (range = ranges->range; range < &ranges->range[ranges->nconn];
+	 range++) {
+	if (!range->conn)
+	    continue;
+	if (range->keep_alive && !range->header && !range->left &&
+	    !range->next_len && !PVT(range->conn)->tftp_goteof &&
+	    !PVT(range->conn)->tftp_bytesleft)
+	    http_pool_put(range->conn, ranges->ip, ranges->port);
+	else
+	    http_drop_conn(range->conn);
+    }
+
+    free(ranges->request);
+    free(ranges);
+    socket->ranges = NULL;
+}
+
+/*
+ * Hand out the next piece of the current range, moving on to the next
+ * connection, and asking for another range on this one, when it ends.
+ */
+static void http_ranges_fill_buffer(struct inode *inode)
+{
+    struct pxe_pvt_inode *socket = PVT(inode);
+    struct http_ranges *ranges = socket->ranges;
+    struct http_range *range;
+    struct pxe_pvt_inode *conn;
+    uint32_t len;
+
+    while (socket->tftp_filepos < inode->size) {
+	range = &ranges->range[ranges->cur];
+
+	if (range->header) {
+	    if (http_range_header(range) &&
+		(!range->reused || http_range_retry(ranges, range) ||
+		 http_range_header(range)))
+		break;
+	    if ((HttpKeepAlive & HTTP_PIPELINE) && range->keep_alive &&
+		ranges->next < inode->size)
+		http_range_request(ranges, range, inode->size);
+	}
+
+	if (!range->left) {
+	    if (range->next_len) {
+		range->start = range->next_start;
+		range->left = range->next_len;
+		range->next_len = 0;
+		range->header = true;
+		range->reused = true;
+	    } else if (ranges->next < inode->size &&
+		       http_range_request(ranges, range, inode->size)) {
+		break;
+	    }
+	    ranges->cur = (ranges->cur + 1) % ranges->nconn;
+	    continue;
+	}
+
+	conn = PVT(range->conn);
+	if (!conn->tftp_bytesleft) {
+	    if (conn->tftp_goteof)
+		break;
+	    conn->ops->fill_buffer(range->conn);
+	    continue;
+	}
+
+	len = min(conn->tftp_bytesleft, range->left);
+	socket->tftp_dataptr = conn->tftp_dataptr;
+	socket->tftp_bytesleft = len;
+	socket->tftp_filepos += len;
+	conn->tftp_dataptr += len;
+	conn->tftp_bytesleft -= len;
+	range->left -= len;
+	return;
+    }
+
+    /* Leave the size alone, so the caller sees a read error */
+    if (socket->tftp_filepos < inode->size)
+	printf("HTTP: range request at %u failed\n",
+	       ranges->range[ranges->cur].start);
+    socket->tftp_goteof = 1;
+    http_ranges_close(inode);
+}
+
+static const struct pxe_conn_ops http_ranges_ops = {
+    .fill_buffer	= http_ranges_fill_buffer,
+    .close		= http_ranges_close,
+    .readdir		= http_readdir,
+};
+
+/*
+ * The server answered our first range; the connection it came in on
+ * becomes the first of the set, and the others are opened now.
+ */
+static int http_start_ranges(struct inode *inode, struct url_info *url,
+			     size_t request_len,
+			     const struct http_response *resp)
+{
+    struct pxe_pvt_inode *socket = PVT(inode);
+    struct http_ranges *ranges;
+    struct http_range *range;
+    int nconn;
+
+    ranges = zalloc(sizeof *ranges);
+    if (!ranges)
+	return -1;
+
+    ranges->request = malloc(request_len);
+    ranges->range[0].conn = alloc_inode(inode->fs, 0,
+					sizeof(struct pxe_pvt_inode));
+    if (!ranges->request || !ranges->range[0].conn) {
+	free(ranges->request);
+	if (ranges->range[0].conn)
+	    free_inode(ranges->range[0].conn);
+	free(ranges);
+	return -1;
+    }
+
+    memcpy(ranges->request, header_buf, request_len);
+    ranges->request_len = request_len;
+    ranges->fs = inode->fs;
+    ranges->ip = url->ip;
+    ranges->port = url->port;
+    ranges->next = resp->content_length;
+
+    /* Move the connection, and whatever body data we have, over */
+    PVT(ranges->range[0].conn)->ops = &tcp_conn_ops;
+    http_move_conn(PVT(ranges->range[0].conn), socket);
+    socket->tftp_filepos = 0;
+
+    ranges->range[0].left = resp->content_length;
+    ranges->range[0].keep_alive = resp->keep_alive;
+    ranges->nconn = 1;
+    socket->ranges = ranges;
+    socket->ops = &http_ranges_ops;
+
+    nconn = min(HttpRanges, HTTP_RANGE_MAX);
+    for (range = &ranges->range[1]; range < &ranges->range[nconn]; range++) {
+	if (ranges->next >= inode->size ||
+	    http_range_request(ranges, range, inode->size))
+	    break;
+	ranges->nconn++;
+    }
+
+    /*
+     * The first connection is past its header already; if pipelining
+     * fails, its next range is simply asked for once this one is done.
+     */
+    range = &ranges->range[0];
+    if ((HttpKeepAlive & HTTP_PIPELINE) && range->keep_alive &&
+	ranges->next < inode->size)
+	http_range_request(ranges, range, inode->size);
+
+    return 0;
+}
+
+void http_open(struct url_info *url, int flags, struct inode *inode,
+	       const char **redir)
+{
+    struct pxe_pvt_inode *socket = PVT(inode);
+    struct http_response resp;
+    struct inode *conn;
+    int header_bytes, request_len;
+    size_t response_size;
+    bool want_ranges, keep_alive;
+    int status;
+    int err;
+
+    if (!header_buf)
+	return;			/* http is broken... */
+
+    /* This is a straightforward TCP connection after headers */
+    socket->ops = &http_conn_ops;
+
+    if (!url->port)
+	url->port = HTTP_PORT;
+
+    socket->tftp_remoteip = url->ip;
+    socket->tftp_remoteport = url->port;
+
+    strcpy(header_buf, "GET /");
+    header_bytes = 5;
+    header_bytes += url_escape_unsafe(header_buf+5, url->path,
+				      header_len - 5);
+    if (header_bytes >= header_len)
+	return;			/* Buffer overflow */
+    header_bytes += snprintf(header_buf + header_bytes,
+			     header_len - header_bytes,
+			     " HTTP/1.0\r\n"
+			     "Host: %s\r\n"
+			     "User-Agent: Syslinux/" VERSION_STR "\r\n"
+			     "%s",
+			     url->host, cookie_buf ? cookie_buf : "");
+    if (header_bytes >= header_len)
+	return;			/* Buffer overflow */
+    request_len = header_bytes;
+
+    /*
+     * If we are going to split the file into ranges, ask for the
+     * first one straight away; a server which doesn't do ranges just
+     * sends us the whole file.
+     */
+    want_ranges = HttpRanges > 1 && !(flags & O_DIRECTORY);
+    keep_alive = want_ranges || (HttpKeepAlive & HTTP_KEEPALIVE);
+    if (want_ranges)
+	header_bytes += snprintf(header_buf + header_bytes,
+				 header_len - header_bytes,
+				 "Range: bytes=0-%u\r\n", HTTP_RANGE_SIZE - 1);
+    header_bytes += snprintf(header_buf + header_bytes,
+			     header_len - header_bytes,
+			     "Connection: %s\r\n"
+			     "\r\n", keep_alive ? "keep-alive" : "close");
+    if (header_bytes >= header_len)
+	return;			/* Buffer overflow */
+
+    /* Reset all of the variables */
+    inode->size = -1;
+
+    /* Start the http connection, or pick up an idle one */
+    conn = http_pool_get(url->ip, url->port);
+    if (conn) {
+	http_move_conn(socket, PVT(conn));
+	free_socket(conn);
+    } else {
+	err = core_tcp_open(socket);
+	if (err)
+	    return;
+
+	err = core_tcp_connect(socket, url->ip, url->port);
+	if (err)
+	    goto fail;
+    }
+
+    for (;;) {
+	err = core_tcp_write(socket, header_buf, header_bytes, false);
+
+	/* Parse the HTTP header */
+	status = err ? 0 : http_get_response(inode, &resp, &response_size);
+	if (status || !conn)
+	    break;
+
+	/*
+	 * The server may well have closed an idle connection since we
+	 * last used it; try again once on a fresh one.
+	 */
+	if (core_tcp_is_connected(socket))
+	    core_tcp_close_file(inode);
+	socket->tftp_goteof = 0;
+	socket->tftp_bytesleft = 0;
+	socket->tftp_filepos = 0;
+	conn = NULL;
+
+	err = core_tcp_open(socket);
+	if (err)
+	    return;
+
+	err = core_tcp_connect(socket, url->ip, url->port);
+	if (err)
+	    goto fail;
+    }
+
+    /* Only a response of known length can leave the connection usable */
+    socket->http_keepalive = resp.keep_alive &&
+	resp.content_length != (uint32_t)-1;
 
     switch (status) {
+    case 206:
+	/* Ranges, as we asked for */
+	if (!want_ranges || resp.range_start != 0 ||
+	    resp.range_total == (uint32_t)-1 ||
+	    resp.content_length == (uint32_t)-1)
+	    goto fail;
+	socket->tftp_filepos -= response_size;
+	inode->size = resp.range_total;
+	if (resp.content_length >= resp.range_total)
+	    break;		/* That was all of it */
+	if (http_start_ranges(inode, url, request_len, &resp))
+	    goto fail;
+	break;
     case 200:
 	/*
 	 * All OK, need to mark header data consumed and set up a file
@@ -370,6 +961,8 @@ void http_open(struct url_info *url, int flags, struct inode *inode,
 	 */
 	/* Treat the remainder of the bytes as data */
 	socket->tftp_filepos -= response_size;
+	if (resp.content_length != (uint32_t)-1)
+	    inode->size = resp.content_length;
 	break;
     case 301:
     case 302:
@@ -387,6 +980,7 @@ void http_open(struct url_info *url, int flags, struct inode *inode,
     return;
 fail:
     inode->size = 0;
-    core_tcp_close_file(inode);
+    socket->http_keepalive = 0;
+    socket->ops->close(inode);
     return;
 }
@@ -23,6 +23,9 @@ char path_prefix[256];		   /* From DHCP */
 
 bool have_uuid = false;
 
+__export uint32_t TcpWindow = 0;   /* TCP receive window, 0 = default */
+__export uint32_t TcpOptions = TCP_OPT_WSCALE | TCP_OPT_SACK;
+
 /*
  * Allocate a local UDP port structure and assign it a local port number.
  * Return the inode pointer if success, or null if failure
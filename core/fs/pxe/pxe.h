@@ -108,6 +108,7 @@ struct bootp_t {
 struct netconn;
 struct netbuf;
 struct efi_binding;
+struct http_ranges;
 
 /*
  * Our inode private information -- this includes the packet buffer!
@@ -136,15 +137,21 @@ union net_private {
 struct pxe_pvt_inode {
     union net_private net;	  /* Network stack private data */
     uint16_t tftp_remoteport;     /* Remote port number */
+    uint32_t tftp_remoteip;       /* Remote IP address (for HTTP) */
     uint32_t tftp_filepos;        /* bytes downloaded (including buffer) */
     uint32_t tftp_blksize;        /* Block size for this connection(*) */
     uint16_t tftp_bytesleft;      /* Unclaimed data bytes */
     uint16_t tftp_lastpkt;        /* Sequence number of last packet (HBO) */
+    uint16_t tftp_lastack;        /* Sequence number of last ACK sent (HBO) */
+    uint16_t tftp_windowsize;     /* Packets per ACK (RFC 7440) */
     char    *tftp_dataptr;        /* Pointer to available data */
     uint8_t  tftp_goteof;         /* 1 if the EOF packet received */
-    uint8_t  tftp_unused[3];      /* Currently unused */
+    uint8_t  tftp_resync;         /* 1 if we ACKed an out-of-order packet */
+    uint8_t  http_keepalive;      /* The connection may be reused */
+    uint8_t  tftp_unused[1];      /* Currently unused */
     char    *tftp_pktbuf;         /* Packet buffer */
     struct inode *ctl;	          /* Control connection (for FTP) */
+    struct http_ranges *ranges;   /* Parallel range state (for HTTP) */
     const struct pxe_conn_ops *ops;
 };
 
@@ -166,6 +173,13 @@ extern uint8_t MAC_type;
 extern uint8_t  DHCPMagic;
 extern uint32_t RebootTime;
 
+/* TcpOptions bits */
+#define TCP_OPT_WSCALE	1	/* Window scaling (RFC 7323) */
+#define TCP_OPT_SACK	2	/* Selective acknowledgements (RFC 2018) */
+
+extern uint32_t TcpWindow;
+extern uint32_t TcpOptions;
+
 extern char boot_file[];
 extern char path_prefix[];
 extern char LocalDomain[];
@@ -17,6 +17,8 @@ struct tftp_packet {
 static void tftp_error(struct inode *file, uint16_t errnum,
 		       const char *errstr);
 
+extern uint16_t TFTPBlkSize;
+
 static void tftp_close_file(struct inode *inode)
 {
     struct pxe_pvt_inode *socket = PVT(inode);
@@ -69,11 +71,17 @@ static void ack_packet(struct inode *inode, uint16_t ack_num)
     ack_packet_buf[1]     = htons(ack_num);
 
     core_udp_send(socket, ack_packet_buf, 4);
+    socket->tftp_lastack = ack_num;
 }
 
 /*
  * Get a fresh packet if the buffer is drained, and we haven't hit
  * EOF yet.  The buffer should be filled immediately after draining!
+ *
+ * With a window size above one (RFC 7440) the server sends a whole
+ * window of packets before waiting for an ACK, and we only ACK the
+ * last packet of each window.  If a packet goes missing we ACK the
+ * last one we got in order, and the server restarts from there.
  */
 static void tftp_get_packet(struct inode *inode)
 {
@@ -90,16 +98,18 @@ static void tftp_get_packet(struct inode *inode)
     uint32_t src_ip;
     int err;
 
-    /*
-     * Start by ACKing the previous packet; this should cause
-     * the next packet to be sent.
-     */
     timeout_ptr = TimeoutTable;
     timeout = *timeout_ptr++;
     oldtime = jiffies();
 
- ack_again:
-    ack_packet(inode, socket->tftp_lastpkt);
+    /*
+     * Start by ACKing the previous packet if it completed a window;
+     * this should cause the next window to be sent.
+     */
+    last_pkt = socket->tftp_lastpkt;
+    if ((uint16_t)(last_pkt - socket->tftp_lastack) >= socket->tftp_windowsize)
+	ack_packet(inode, last_pkt);
+    last_pkt++;
 
     while (timeout) {
 	buf_len = socket->tftp_blksize + 4;
@@ -113,7 +123,8 @@ static void tftp_get_packet(struct inode *inode)
 		timeout = *timeout_ptr++;
 		if (!timeout)
 		    break;
-		goto ack_again;
+		socket->tftp_resync = 0;
+		ack_packet(inode, socket->tftp_lastpkt);
 	    }
             continue;
 	}
@@ -125,39 +136,40 @@ static void tftp_get_packet(struct inode *inode)
         if (pkt->opcode != TFTP_DATA)    /* Not a data packet */
             continue;
 
-        /* If goes here, recevie OK, break */
-        break;
-    }
+	serial = ntohs(pkt->serial);
+	if (serial == last_pkt)
+	    break;		/* It's the packet we want */
 
-    /* time runs out */
-    if (timeout == 0)
-	kaboom();
-
-    last_pkt = socket->tftp_lastpkt;
-    last_pkt++;
-    serial = ntohs(pkt->serial);
-    if (serial != last_pkt) {
         /*
-         * Wrong packet, ACK the packet and try again.
-         * This is presumably because the ACK got lost,
-         * so the server just resent the previous packet.
+         * Wrong packet: either a resend of one we already have,
+         * presumably because an ACK got lost, or one past a packet
+         * that went missing.  ACK the last packet we have in order,
+         * but only once, or the rest of the window would make the
+         * server start over again for every packet.
          */
 #if 0
-	printf("Wrong packet, wanted %04x, got %04x\n", \
-               htons(last_pkt), htons(*(uint16_t *)(data+2)));
+	printf("Wrong packet, wanted %04x, got %04x\n", last_pkt, serial);
 #endif
-        goto ack_again;
+	if (!socket->tftp_resync) {
+	    socket->tftp_resync = 1;
+	    ack_packet(inode, socket->tftp_lastpkt);
+	}
     }
 
+    /* time runs out */
+    if (timeout == 0)
+	kaboom();
+
     /* It's the packet we want.  We're also EOF if the size < blocksize */
     socket->tftp_lastpkt = last_pkt;    /* Update last packet number */
+    socket->tftp_resync = 0;
     buffersize = buf_len - 4;		/* Skip TFTP header */
     socket->tftp_dataptr = socket->tftp_pktbuf + 4;
     socket->tftp_filepos += buffersize;
     socket->tftp_bytesleft = buffersize;
     if (buffersize < socket->tftp_blksize) {
         /* it's the last block, ACK packet immediately */
-        ack_packet(inode, serial);
+        ack_packet(inode, last_pkt);
 
         /* Make sure we know we are at end of file */
         inode->size 		= socket->tftp_filepos;
@@ -166,6 +178,40 @@ static void tftp_get_packet(struct inode *inode)
     }
 }
 
+/*
+ * Pick the block size to ask for: whatever fits in one link frame,
+ * unless TFTPBlkSize says IP fragmentation is fine, in which case
+ * it is the upper limit instead.
+ */
+static unsigned int tftp_want_blksize(void)
+{
+    size_t maxlen = core_udp_maxlen(TFTPBlkSize != 0);
+    unsigned int blksize;
+
+    if (maxlen <= 4)
+	return TFTP_BLKSIZE_SAFE;
+
+    blksize = min(maxlen - 4, TFTP_BLKSIZE_MAX);
+    if (TFTPBlkSize)
+	blksize = min(blksize, TFTPBlkSize);
+
+    return max(blksize, TFTP_BLOCKSIZE);
+}
+
+/*
+ * Blocks that span several frames fill the receive queues that much
+ * faster, so shrink the window to keep about as many frames in flight.
+ */
+static unsigned int tftp_want_windowsize(unsigned int blksize)
+{
+    size_t framelen = core_udp_maxlen(false);
+
+    if (!framelen || blksize + 4 <= framelen)
+	return TFTP_WINDOWSIZE;
+
+    return max(TFTP_WINDOWSIZE * framelen / (blksize + 4), 1);
+}
+
 const struct pxe_conn_ops tftp_conn_ops = {
     .fill_buffer	= tftp_get_packet,
     .close		= tftp_close_file,
@@ -191,12 +237,14 @@ void tftp_open(struct url_info *url, int flags, struct inode *inode,
     char *p;
     char *options;
     char *data;
-    static const char rrq_tail[] = "octet\0""tsize\0""0\0""blksize\0""1408";
-    char rrq_packet_buf[2+2*FILENAME_MAX+sizeof rrq_tail];
+    static const char rrq_tail[] = "octet\0""tsize\0""0\0""blksize";
+    static const char rrq_opts[] = "65464\0""windowsize\0""65535"; /* Longest */
+    char rrq_packet_buf[2+2*FILENAME_MAX+sizeof rrq_tail+sizeof rrq_opts];
     char reply_packet_buf[PKTBUF_SIZE];
     int err;
     int buffersize;
     int rrq_len;
+    unsigned int blksize, windowsize;
     const uint8_t  *timeout_ptr;
     jiffies_t timeout;
     jiffies_t oldtime;
@@ -234,6 +282,12 @@ void tftp_open(struct url_info *url, int flags, struct inode *inode,
     memcpy(buf, rrq_tail, sizeof rrq_tail);
     buf += sizeof rrq_tail;
 
+    blksize = tftp_want_blksize();
+    windowsize = tftp_want_windowsize(blksize);
+    buf += sprintf(buf, "%u", blksize) + 1;
+    buf = stpcpy(buf, "windowsize") + 1;
+    buf += sprintf(buf, "%u", windowsize) + 1;
+
     rrq_len = buf - rrq_packet_buf;
 
     timeout_ptr = TimeoutTable;   /* Reset timeout */
@@ -271,6 +325,7 @@ wait_pkt:
     /* filesize <- -1 == unknown */
     inode->size = -1;
     socket->tftp_blksize = TFTP_BLOCKSIZE;
+    socket->tftp_windowsize = 1;	/* Lock-step unless negotiated */
     buffersize = buf_len - 2;	  /* bytes after opcode */
 
     /*
@@ -381,6 +436,9 @@ wait_pkt:
 		inode->size = opdata;
 	    else if (!strcmp(opt, "blksize"))
 		socket->tftp_blksize = opdata;
+	    else if (!strcmp(opt, "windowsize") &&
+		     opdata && opdata <= windowsize)
+		socket->tftp_windowsize = opdata; /* May shrink, not grow */
 	    else
 		goto err_reply; /* Non-negotitated option returned,
 				   no idea what it means ...*/
@@ -388,7 +446,7 @@ wait_pkt:
 
 	}
 
-	if (socket->tftp_blksize < 64 || socket->tftp_blksize > PKTBUF_SIZE)
+	if (socket->tftp_blksize < 64 || socket->tftp_blksize > blksize)
 	    goto err_reply;
 
 	/* Parsing successful, allocate buffer */
@@ -412,5 +470,8 @@ done:
     if (!inode->size)
 	core_udp_close(socket);
 
+    /* Make sure the first fill ACKs the OACK or the first DATA packet */
+    socket->tftp_lastack = socket->tftp_lastpkt - socket->tftp_windowsize;
+
     return;
 }
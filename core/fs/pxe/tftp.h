@@ -28,6 +28,20 @@
 #define TFTP_BLOCKSIZE_LG2 9
 #define TFTP_BLOCKSIZE  (1 << TFTP_BLOCKSIZE_LG2)
 
+/*
+ * Block size we ask for when the link MTU is unknown, and the largest
+ * one RFC 2348 lets us ask for.
+ */
+#define TFTP_BLKSIZE_SAFE	1408
+#define TFTP_BLKSIZE_MAX	65464
+
+/*
+ * Largest TFTP window size we ask for (RFC 7440).  The rest of a
+ * window waits in the UDP receive mailbox while we consume one packet
+ * at a time, so this has to stay below DEFAULT_UDP_RECVMBOX_SIZE.
+ */
+#define TFTP_WINDOWSIZE	8
+
 /*
  * TFTP operation codes
  */
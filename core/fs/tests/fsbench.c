@@ -0,0 +1,624 @@
+/*
+ * fsbench.c
+ *
+ * Run the core filesystem drivers against a disk image on the host,
+ * going through the same searchdir() and getfssec() paths as the boot
+ * loader, and report how they behave: lookup latency, read throughput,
+ * block cache hit ratio and the number of firmware disk calls made.
+ *
+ * The image is read by a stand-in for the BIOS EDD code which splits
+ * requests into maxtransfer-sized pieces and counts each piece as one
+ * firmware call, so the call counts are those a real boot would see.
+ * The timings are host timings; on real hardware each firmware call
+ * costs far more than a pread() of a cached image.
+ *
+ * Usage: fsbench [-t fstype] [-s sectorsize] [-m maxtransfer]
+ *		  [-n repeat] [-r readsize] [-x xfsdircache] [-d dir]
+ *		  image [path...]
+ *
+ * With no paths, every regular file reachable from the root directory
+ * is benchmarked.  The CRC-32 of what was read is printed for each
+ * file; with -d, each file is also compared with the same path under
+ * dir on the host, typically the tree the image was made from.  Any
+ * file which is missing, isn't a regular file, or reads back short or
+ * wrong makes the exit status nonzero.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <zlib.h>
+#include <minmax.h>
+#include <ilog2.h>
+#include <fs.h>
+#include <disk.h>
+#include <cache.h>
+#include <dcache.h>
+#include <codepage.h>
+#include <syslinux/firmware.h>
+#include "../iso9660/iso9660_fs.h"
+
+#define MAX_DEPTH	16
+
+static unsigned int opt_sector_size;
+static unsigned int opt_maxtransfer = 127;	/* As for EBIOS */
+static unsigned int opt_repeat = 100;
+static size_t opt_readsize = 65536;
+static const char *opt_hostdir;
+static const char *image_name;
+
+/* The XFS headers don't stand on their own */
+extern uint32_t XfsDirCache;
+void xfs_dir2_dirblks_stats(void);
+
+/*
+ * Things the rest of the core would provide
+ */
+volatile jiffies_t __jiffies, __ms_timer;
+char CurrentDirName[FILENAME_MAX] = "/";
+char SubvolName[FILENAME_MAX];
+char core_xfer_buf[65536];
+struct file_info __file_info[NFILES];
+const struct input_dev __file_dev;
+struct iso_boot_info iso_boot_info;
+
+/*
+ * The real codepage is generated at build time; Latin-1 will do here
+ */
+#define CP_UPPER(c)	((c) >= 'a' && (c) <= 'z' ? (c) - 0x20 : (c))
+#define CP_LOWER(c)	((c) >= 'A' && (c) <= 'Z' ? (c) + 0x20 : (c))
+#define CP_OTHER(c)	((c) >= 'a' && (c) <= 'z' ? (c) - 0x20 : CP_LOWER(c))
+#define CP_SELF(c)	(c)
+#define CP4(f, c)	f(c), f((c)+1), f((c)+2), f((c)+3)
+#define CP16(f, c)	CP4(f, c), CP4(f, (c)+4), CP4(f, (c)+8), CP4(f, (c)+12)
+#define CP64(f, c)	CP16(f, c), CP16(f, (c)+16), CP16(f, (c)+32), \
+			CP16(f, (c)+48)
+#define CP256(f)	CP64(f, 0), CP64(f, 64), CP64(f, 128), CP64(f, 192)
+
+const struct codepage codepage = {
+    .magic = CODEPAGE_MAGIC,
+    .upper = { CP256(CP_UPPER) },
+    .lower = { CP256(CP_LOWER) },
+    .uni   = { { CP256(CP_SELF) }, { CP256(CP_OTHER) } },
+};
+
+void _kaboom(void)
+{
+    fprintf(stderr, "fsbench: kaboom!\n");
+    abort();
+}
+
+void *zalloc(size_t size)
+{
+    return calloc(1, size);
+}
+
+int opendev(const struct input_dev *dev, const struct output_dev *output,
+	    int fileflags)
+{
+    (void)dev;
+    (void)output;
+    (void)fileflags;
+    return -1;
+}
+
+void sysappend_set_fs_uuid(void)
+{
+}
+
+/*
+ * Host clock, in microseconds since startup.  The core's millisecond
+ * timer is kept in step with it, so the disk and stream statistics
+ * the core gathers itself come out right.
+ */
+static uint64_t start_us;
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    uint64_t us;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    us = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    __ms_timer = (us - start_us) / 1000;
+    return us;
+}
+
+/*
+ * The disk image, standing in for the firmware
+ */
+struct image {
+    int fd;
+};
+
+static int image_rdwr_sectors(struct disk *disk, void *buf, sector_t lba,
+			      size_t count, bool is_write)
+{
+    struct image *img = disk->private;
+    int sector_shift = disk->sector_shift;
+    struct disk_xfer_class *xc;
+    char *ptr = buf;
+    size_t chunk, bytes, done = 0;
+    mstime_t t0;
+    ssize_t rv;
+
+    if (is_write)
+	return 0;
+
+    lba += disk->part_start;
+    while (count) {
+	chunk = min(count, (size_t)disk->maxtransfer);
+	bytes = chunk << sector_shift;
+
+	now_us();
+	t0 = ms_timer();
+	rv = pread(img->fd, ptr, bytes, (off_t)lba << sector_shift);
+	if (rv < 0) {
+	    disk->stats.errors++;
+	    break;
+	}
+
+	/* Anything past the end of the image reads as zero */
+	if ((size_t)rv < bytes)
+	    memset(ptr + rv, 0, bytes - rv);
+
+	now_us();
+	disk->stats.calls++;
+	disk->stats.bytes += bytes;
+	xc = &disk->xfer[min(ilog2(chunk), DISK_XFER_CLASSES-1)];
+	xc->calls++;
+	xc->ms += ms_timer() - t0;
+
+	ptr   += bytes;
+	lba   += chunk;
+	count -= chunk;
+	done  += chunk;
+    }
+
+    return done;
+}
+
+static struct disk *image_disk_init(void *private)
+{
+    static struct disk disk;
+    struct image *img = private;
+
+    disk.sector_size	  = opt_sector_size;
+    disk.sector_shift	  = ilog2(opt_sector_size);
+    disk.maxtransfer	  = opt_maxtransfer;
+    disk.hard_maxtransfer = opt_maxtransfer;
+    disk.sectors	  = lseek(img->fd, 0, SEEK_END) >> disk.sector_shift;
+    disk.rdwr_sectors	  = image_rdwr_sectors;
+    disk.private	  = private;
+
+    return &disk;
+}
+
+static struct firmware image_firmware = {
+    .disk_init = image_disk_init,
+};
+
+struct firmware *firmware = &image_firmware;
+
+/*
+ * Filesystems, in the order ldlinux probes them; iso9660 is only ever
+ * used by isolinux, so it has to be asked for.  fs_init() spins forever
+ * when nothing matches, so end the list with one that bails.
+ */
+extern const struct fs_ops vfat_fs_ops, ext2_fs_ops, ntfs_fs_ops,
+    xfs_fs_ops, btrfs_fs_ops, ufs_fs_ops, iso_fs_ops;
+
+static int none_fs_init(struct fs_info *fs)
+{
+    (void)fs;
+    fprintf(stderr, "fsbench: %s: no filesystem found\n", image_name);
+    exit(1);
+}
+
+static const struct fs_ops none_fs_ops = {
+    .fs_name	= "none",
+    .fs_flags	= FS_NODEV,
+    .fs_init	= none_fs_init,
+};
+
+static const struct fs_ops *all_fs_ops[] = {
+    &vfat_fs_ops,
+    &ext2_fs_ops,
+    &ntfs_fs_ops,
+    &xfs_fs_ops,
+    &btrfs_fs_ops,
+    &ufs_fs_ops,
+    &none_fs_ops,
+    NULL
+};
+
+/*
+ * Measurements
+ */
+struct counters {
+    uint64_t us;
+    uint32_t calls;		/* Firmware calls */
+    uint64_t bytes;		/* Bytes read from the disk */
+};
+
+static struct {
+    unsigned int files, missing, failed;
+    uint64_t bytes;
+    struct counters cold;	/* First lookup of each file */
+    uint64_t warm_us;		/* Repeated lookups */
+    unsigned int warm;
+    struct counters read;
+} total;
+
+static void snapshot(struct counters *c)
+{
+    const struct disk *disk = this_fs->fs_dev ? this_fs->fs_dev->disk : NULL;
+
+    c->us    = now_us();
+    c->calls = disk ? disk->stats.calls : 0;
+    c->bytes = disk ? disk->stats.bytes : 0;
+}
+
+static void since(struct counters *c, const struct counters *start)
+{
+    struct counters end;
+
+    snapshot(&end);
+    c->us    += end.us - start->us;
+    c->calls += end.calls - start->calls;
+    c->bytes += end.bytes - start->bytes;
+}
+
+static double mb_per_s(uint64_t bytes, uint64_t us)
+{
+    return us ? (double)bytes / us : 0.0;
+}
+
+static int lookup(const char *path)
+{
+    char mangled[FILENAME_MAX];
+
+    /* As open_file() does */
+    mangle_name(mangled, path);
+    return searchdir(mangled, 0);
+}
+
+/*
+ * The copy of a file on the host, if we were given somewhere to look
+ */
+static FILE *open_host_file(const char *path)
+{
+    char hostpath[FILENAME_MAX];
+    FILE *f;
+
+    if (!opt_hostdir)
+	return NULL;
+
+    if (snprintf(hostpath, sizeof hostpath, "%s/%s", opt_hostdir,
+		 path) >= (int)sizeof hostpath) {
+	printf("  %s: host path too long\n", path);
+	return NULL;
+    }
+
+    f = fopen(hostpath, "rb");
+    if (!f)
+	printf("  %s: %s: %s\n", path, hostpath, strerror(errno));
+    return f;
+}
+
+static void fail(const char *path, const char *why)
+{
+    printf("  %s: %s\n", path, why);
+    total.failed++;
+}
+
+/*
+ * Look a file up once cold and then repeatedly, then read it all,
+ * checking what comes back against the host copy.
+ */
+static void bench_file(const char *path)
+{
+    static char *buf, *hostbuf;
+    struct counters c0, cold, rd;
+    struct file *file;
+    FILE *host;
+    uint64_t warm_us, size, bytes = 0, bad = -1;
+    uint32_t crc;
+    unsigned int i;
+    int handle, sectors, n;
+    bool have_more;
+
+    if (!buf) {
+	buf = malloc(opt_readsize);
+	hostbuf = malloc(opt_readsize);
+    }
+
+    memset(&cold, 0, sizeof cold);
+    snapshot(&c0);
+    handle = lookup(path);
+    since(&cold, &c0);
+
+    if (handle < 0) {
+	printf("  %s: not found\n", path);
+	total.missing++;
+	return;
+    }
+
+    file = handle_to_file(handle);
+    if (file->inode->mode != DT_REG) {
+	_close_file(file);
+	fail(path, "not a regular file");
+	return;
+    }
+    size = file->inode->size;
+    _close_file(file);
+
+    warm_us = now_us();
+    for (i = 0; i < opt_repeat; i++) {
+	handle = lookup(path);
+	if (handle >= 0)
+	    _close_file(handle_to_file(handle));
+    }
+    warm_us = now_us() - warm_us;
+
+    handle = lookup(path);
+    if (handle < 0) {
+	fail(path, "lookup failed on a second try");
+	return;
+    }
+    file = handle_to_file(handle);
+
+    host = open_host_file(path);
+    if (opt_hostdir && !host)
+	total.failed++;
+
+    /* Only the getfssec() calls are timed, not the checking */
+    memset(&rd, 0, sizeof rd);
+    sectors = opt_readsize >> SECTOR_SHIFT(this_fs);
+    crc = crc32(0, NULL, 0);
+    do {
+	have_more = false;
+	snapshot(&c0);
+	n = this_fs->fs_ops->getfssec(file, buf, sectors, &have_more);
+	since(&rd, &c0);
+
+	crc = crc32(crc, (const Bytef *)buf, n);
+	if (host && bad == (uint64_t)-1) {
+	    if (fread(hostbuf, 1, n, host) != (size_t)n) {
+		bad = bytes;
+	    } else if (memcmp(buf, hostbuf, n)) {
+		for (i = 0; buf[i] == hostbuf[i]; i++)
+		    ;
+		bad = bytes + i;
+	    }
+	}
+	bytes += n;
+    } while (have_more);
+    _close_file(file);
+
+    if (host) {
+	if (bad == (uint64_t)-1 && fgetc(host) != EOF)
+	    bad = bytes;
+	fclose(host);
+    }
+
+    if (bytes != size) {
+	printf("  %s: read %llu bytes, expected %llu\n", path,
+	       (unsigned long long)bytes, (unsigned long long)size);
+	total.failed++;
+    }
+    if (bad != (uint64_t)-1) {
+	printf("  %s: differs from the host copy at byte %llu\n", path,
+	       (unsigned long long)bad);
+	total.failed++;
+    }
+
+    printf("  %s: %llu bytes, crc %08x, lookup %llu us (%u calls) cold, "
+	   "%.2f us warm, read %llu us (%.1f MB/s, %u calls)\n",
+	   path, (unsigned long long)size, crc,
+	   (unsigned long long)cold.us, cold.calls,
+	   opt_repeat ? (double)warm_us / opt_repeat : 0.0,
+	   (unsigned long long)rd.us, mb_per_s(bytes, rd.us), rd.calls);
+
+    total.files++;
+    total.bytes += bytes;
+    total.cold.us += cold.us;
+    total.cold.calls += cold.calls;
+    total.cold.bytes += cold.bytes;
+    total.warm_us += warm_us;
+    total.warm += opt_repeat;
+    total.read.us += rd.us;
+    total.read.calls += rd.calls;
+    total.read.bytes += rd.bytes;
+}
+
+static void walk(const char *dir, int depth)
+{
+    char path[FILENAME_MAX];
+    struct dirent *de;
+    DIR *dd;
+
+    dd = opendir(dir);
+    if (!dd) {
+	printf("  %s: can't open directory\n", dir);
+	return;
+    }
+
+    while ((de = readdir(dd))) {
+	/* ext2 hands back unused slots with no name */
+	if (!de->d_name[0] ||
+	    !strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+	    continue;
+
+	if (snprintf(path, sizeof path, "%s%s%s", dir,
+		     dir[strlen(dir)-1] == '/' ? "" : "/",
+		     de->d_name) >= (int)sizeof path)
+	    continue;
+
+	if (de->d_type == DT_DIR) {
+	    if (depth < MAX_DEPTH)
+		walk(path, depth + 1);
+	} else if (de->d_type == DT_REG || de->d_type == DT_UNKNOWN) {
+	    bench_file(path);
+	}
+    }
+
+    closedir(dd);
+}
+
+static void report(void)
+{
+    const struct device *dev = this_fs->fs_dev;
+    const struct disk *disk = dev ? dev->disk : NULL;
+    unsigned int n = total.files;
+    int i;
+
+    printf("%s: %u files, %llu bytes, %u not found, %u failed\n",
+	   this_fs->fs_ops->fs_name, n, (unsigned long long)total.bytes,
+	   total.missing, total.failed);
+    if (n) {
+	printf("lookup: %.1f us cold (%.1f calls, %.1f KiB), "
+	       "%.2f us warm\n",
+	       (double)total.cold.us / n, (double)total.cold.calls / n,
+	       (double)total.cold.bytes / n / 1024,
+	       total.warm ? (double)total.warm_us / total.warm : 0.0);
+	printf("read: %llu us, %.1f MB/s, %u calls, %.1f KiB per call\n",
+	       (unsigned long long)total.read.us,
+	       mb_per_s(total.bytes, total.read.us), total.read.calls,
+	       total.read.calls ?
+	       (double)total.read.bytes / total.read.calls / 1024 : 0.0);
+    }
+
+    if (disk) {
+	printf("disk: %u calls, %llu bytes, %u errors, "
+	       "%llu stream bytes in %u ms\n",
+	       disk->stats.calls, (unsigned long long)disk->stats.bytes,
+	       disk->stats.errors,
+	       (unsigned long long)disk->stats.stream_bytes,
+	       disk->stats.stream_ms);
+	for (i = 0; i < DISK_XFER_CLASSES; i++) {
+	    if (disk->xfer[i].calls)
+		printf("disk: %3u+ sectors: %u calls, %u ms\n",
+		       1 << i, disk->xfer[i].calls, disk->xfer[i].ms);
+	}
+    }
+
+    if (dev && dev->cache_init)
+	cache_stats((struct device *)dev);
+    dcache_stats(this_fs);
+    if (!strcmp(this_fs->fs_ops->fs_name, "xfs"))
+	xfs_dir2_dirblks_stats();
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+	    "Usage: fsbench [-t fstype] [-s sectorsize] [-m maxtransfer]\n"
+	    "               [-n repeat] [-r readsize] [-x xfsdircache]\n"
+	    "               [-d dir] image [path...]\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    static struct image img;
+    static const struct fs_ops *one_fs_ops[] = {
+	NULL, &none_fs_ops, NULL
+    };
+    const struct fs_ops **ops = all_fs_ops;
+    const char *fstype = NULL;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "t:s:m:n:r:x:d:")) != -1) {
+	switch (opt) {
+	case 't':
+	    fstype = optarg;
+	    break;
+	case 's':
+	    opt_sector_size = strtoul(optarg, NULL, 0);
+	    break;
+	case 'm':
+	    opt_maxtransfer = strtoul(optarg, NULL, 0);
+	    break;
+	case 'n':
+	    opt_repeat = strtoul(optarg, NULL, 0);
+	    break;
+	case 'r':
+	    opt_readsize = strtoul(optarg, NULL, 0);
+	    break;
+	case 'x':
+	    XfsDirCache = strtoul(optarg, NULL, 0);
+	    break;
+	case 'd':
+	    opt_hostdir = optarg;
+	    break;
+	default:
+	    usage();
+	}
+    }
+
+    if (fstype) {
+	if (!strcmp(fstype, iso_fs_ops.fs_name)) {
+	    one_fs_ops[0] = &iso_fs_ops;
+	} else {
+	    for (i = 0; all_fs_ops[i] != &none_fs_ops; i++) {
+		if (!strcmp(all_fs_ops[i]->fs_name, fstype))
+		    break;
+	    }
+	    one_fs_ops[0] = all_fs_ops[i];
+	}
+	if (one_fs_ops[0] == &none_fs_ops) {
+	    fprintf(stderr, "fsbench: unknown filesystem %s\n", fstype);
+	    exit(1);
+	}
+	ops = one_fs_ops;
+    }
+
+    /* Like isolinux, assume a CD-ROM for iso9660 */
+    if (!opt_sector_size)
+	opt_sector_size = ops[0] == &iso_fs_ops ? 2048 : 512;
+
+    if (optind >= argc || opt_sector_size < 512 ||
+	opt_sector_size & (opt_sector_size - 1) || !opt_maxtransfer ||
+	opt_readsize < opt_sector_size)
+	usage();
+
+    image_name = argv[optind++];
+    img.fd = open(image_name, O_RDONLY);
+    if (img.fd < 0) {
+	perror(image_name);
+	exit(1);
+    }
+
+    /* isolinux trusts the El Torito boot; don't feed it garbage */
+    if (ops[0] == &iso_fs_ops) {
+	char id[5];
+
+	if (pread(img.fd, id, sizeof id, 16 * 2048 + 1) != sizeof id ||
+	    memcmp(id, "CD001", sizeof id)) {
+	    fprintf(stderr, "fsbench: %s: no iso9660 volume descriptor\n",
+		    image_name);
+	    exit(1);
+	}
+    }
+
+    start_us = now_us();
+    fs_init(ops, &img);
+    printf("%s: %s, %d-byte blocks, %d-byte sectors, init %llu us\n",
+	   image_name, this_fs->fs_ops->fs_name, BLOCK_SIZE(this_fs),
+	   SECTOR_SIZE(this_fs), (unsigned long long)(now_us() - start_us));
+
+    if (optind < argc) {
+	for (i = optind; i < argc; i++)
+	    bench_file(argv[i]);
+    } else {
+	walk("/", 0);
+    }
+
+    report();
+    close(img.fd);
+    return total.missing || total.failed;
+}
@@ -0,0 +1,67 @@
+/*
+ * hostfs.h
+ *
+ * Force-included ahead of every core/fs source when building the
+ * host-side benchmark.  The core headers are used unmodified; this
+ * only papers over the places where they disagree with the host C
+ * library, and pulls in the few com32 headers that the host has its
+ * own, different, version of.
+ */
+
+#ifndef _HOSTFS_H_
+#define _HOSTFS_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* The core's dirent and file structures, not the host's */
+#include "../../../com32/include/dirent.h"
+#include "../../../com32/lib/sys/file.h"
+
+/* Pulled in from the host by the above; some drivers define their own */
+#undef S_IFMT
+#undef S_IFSOCK
+#undef S_IFLNK
+#undef S_IFREG
+#undef S_IFBLK
+#undef S_IFDIR
+#undef S_IFCHR
+#undef S_IFIFO
+#undef S_ISUID
+#undef S_ISGID
+#undef S_ISVTX
+
+/* Core functions whose names clash with libc ones */
+#define getchar		core_getchar
+#define realpath	core_realpath
+
+#undef FILENAME_MAX
+
+/* Only meaningful in the real memory layout */
+#define __bss16
+
+#define container_of(p, c, m) ((c *)((char *)(p) - offsetof(c,m)))
+
+/* From the com32 <byteswap.h>; we are always little endian here */
+typedef struct { uint16_t x; } __attribute__((packed)) __ua_uint16_t;
+typedef struct { uint32_t x; } __attribute__((packed)) __ua_uint32_t;
+typedef struct { uint64_t x; } __attribute__((packed)) __ua_uint64_t;
+
+static inline uint16_t get_le16(const uint16_t *p)
+{
+    return ((const __ua_uint16_t *)p)->x;
+}
+
+static inline uint32_t get_le32(const uint32_t *p)
+{
+    return ((const __ua_uint32_t *)p)->x;
+}
+
+static inline uint64_t get_le64(const uint64_t *p)
+{
+    return ((const __ua_uint64_t *)p)->x;
+}
+
+#endif /* _HOSTFS_H_ */
@@ -48,7 +48,7 @@ scan_set_nblocks(const uint8_t *map, uint32_t index, uint32_t addr_shift,
      */
     if (nblocks) {
 	uint32_t skip = blk ? FRAGMENTS_PER_BLK : 0;
-	uint32_t next = blk + skip;
+	uint64_t next = blk + skip;
 	size_t   cnt = 1;
 
 	/* Get address of starting blk pointer */
@@ -80,33 +80,61 @@ scan_set_nblocks(const uint8_t *map, uint32_t index, uint32_t addr_shift,
 }
 
 /*
- * The actual indirect block map handling - the block passed in should
- * be relative to the beginning of the particular block hierarchy.
+ * The actual indirect block map handling - top is the address of the
+ * topmost indirect block of a hierarchy of the given levels, which
+ * maps the file blocks from base on.
  *
- * @shft_per_blk: shift to get nr. of addresses in a block.
- * @mask_per_blk: mask to limit the max nr. of addresses in a block.
- * @addr_count:   nr. of addresses in a block.
+ * The indirect block used at each level is remembered in the inode, so
+ * the next lookup - usually for the block right after - starts from
+ * the lowest one still covering it, normally the last level itself.
+ * That's one get_cache() per lookup, rather than one per level.
  */
 static uint64_t
-bmap_indirect(struct fs_info *fs, uint64_t start, uint32_t block,
-	      int levels, size_t *nblocks)
+bmap_indirect(struct inode *inode, uint64_t top, uint64_t base,
+	      uint64_t block, int levels, size_t *nblocks)
 {
+    struct fs_info *fs = inode->fs;
+    struct ufs_indir *indir = PVT(inode)->indir;
     uint32_t shft_per_blk = fs->block_shift - UFS_SB(fs)->addr_shift;
     uint32_t addr_count = (1 << shft_per_blk);
-    uint32_t mask_per_blk = addr_count - 1;
-    const uint8_t *blk = NULL;
-    uint32_t index = 0;
+    const uint8_t *blk;
+    uint64_t addr = top, start = base, span;
+    uint32_t index;
+    int level;
+
+    /* Lowest remembered indirect block covering block, if any */
+    for (level = 0; level < levels; level++) {
+	if (indir[level].addr &&
+	    block >= indir[level].start && block < indir[level].end) {
+	    addr = indir[level].addr;
+	    start = indir[level].start;
+	    break;
+	}
+    }
+    if (level == levels)
+	level = levels - 1;
 
-    while (levels--) {
-	if (!start) {
+    while (1) {
+	span = (uint64_t)addr_count << (level * shft_per_blk);
+	if (!addr) {
+	    /* A hole, up to the end of what this block would map */
 	    if (nblocks)
-		*nblocks = addr_count << (levels * shft_per_blk);
+		*nblocks = start + span - block;
 	    return 0;
 	}
 
-	blk = get_cache(fs->fs_dev, frag_to_blk(fs, start));
-	index = (block >> (levels * shft_per_blk)) & mask_per_blk;
-	start = get_blkaddr(blk, index, UFS_SB(fs)->addr_shift);
+	indir[level].addr = addr;
+	indir[level].start = start;
+	indir[level].end = start + span;
+
+	blk = get_cache(fs->fs_dev, frag_to_blk(fs, addr));
+	index = (block - start) >> (level * shft_per_blk);
+	if (!level)
+	    break;
+
+	addr = get_blkaddr(blk, index, UFS_SB(fs)->addr_shift);
+	start += (uint64_t)index << (level * shft_per_blk);
+	level--;
     }
 
     return scan_set_nblocks(blk, index, UFS_SB(fs)->addr_shift,
@@ -120,8 +148,9 @@ bmap_indirect(struct fs_info *fs, uint64_t start, uint32_t block,
 uint64_t ufs_bmap (struct inode *inode, block_t block, size_t *nblocks)
 {
     uint32_t shft_per_blk, ptrs_per_blk;
-    static uint32_t indir_blks, double_blks, triple_blks;
+    static uint64_t indir_blks, double_blks, triple_blks;
     struct fs_info *fs = inode->fs;
+    uint64_t base;
 
     /* Initialize static values */
     if (!indir_blks) {
@@ -129,7 +158,7 @@ uint64_t ufs_bmap (struct inode *inode, block_t block, size_t *nblocks)
 	ptrs_per_blk = fs->block_size >> UFS_SB(fs)->addr_shift;
 
 	indir_blks = ptrs_per_blk;
-	double_blks = ptrs_per_blk << shft_per_blk;
+	double_blks = (uint64_t)ptrs_per_blk << shft_per_blk;
 	triple_blks = double_blks << shft_per_blk;
     }
 
@@ -144,22 +173,22 @@ uint64_t ufs_bmap (struct inode *inode, block_t block, size_t *nblocks)
 				UFS_DIRECT_BLOCKS - block, nblocks);
 
     /* indirect blocks */
-    block -= UFS_DIRECT_BLOCKS;
-    if (block < indir_blks)
-	return bmap_indirect(fs, PVT(inode)->indirect_blk_ptr,
-			     block, 1, nblocks);
+    base = UFS_DIRECT_BLOCKS;
+    if (block < base + indir_blks)
+	return bmap_indirect(inode, PVT(inode)->indirect_blk_ptr,
+			     base, block, 1, nblocks);
 
     /* double indirect blocks */
-    block -= indir_blks;
-    if (block < double_blks)
-	return bmap_indirect(fs, PVT(inode)->double_indirect_blk_ptr,
-			     block, 2, nblocks);
+    base += indir_blks;
+    if (block < base + double_blks)
+	return bmap_indirect(inode, PVT(inode)->double_indirect_blk_ptr,
+			     base, block, 2, nblocks);
 
     /* triple indirect blocks */
-    block -= double_blks;
-    if (block < triple_blks)
-	return bmap_indirect(fs, PVT(inode)->triple_indirect_blk_ptr,
-			     block, 3, nblocks);
+    base += double_blks;
+    if (block < base + triple_blks)
+	return bmap_indirect(inode, PVT(inode)->triple_indirect_blk_ptr,
+			     base, block, 3, nblocks);
 
     /* This can't happen... */
     return 0;
@@ -168,6 +197,10 @@ uint64_t ufs_bmap (struct inode *inode, block_t block, size_t *nblocks)
 /*
  * Next extent for getfssec
  * "Remaining sectors" means (lstart & blkmask).
+ *
+ * Runs of blocks that happen to be physically contiguous (or are all
+ * holes) are returned as a single extent, even if they span several
+ * indirect blocks.
  */
 int ufs_next_extent(struct inode *inode, uint32_t lstart)
 {
@@ -175,13 +208,31 @@ int ufs_next_extent(struct inode *inode, uint32_t lstart)
     int blktosec =  BLOCK_SHIFT(fs) - SECTOR_SHIFT(fs);
     int frag_shift = BLOCK_SHIFT(fs) - UFS_SB(fs)->c_blk_frag_shift;
     int blkmask = (1 << blktosec) - 1;
-    block_t block;
-    size_t nblocks = 0;
+    uint32_t lblock = lstart >> blktosec;
+    uint64_t end_block, max_blocks;
+    uint64_t block, next;
+    size_t nblocks = 0, more;
 
     ufs_debug("ufs_next_extent:\n");
-    block = ufs_bmap(inode, lstart >> blktosec, &nblocks);
+    block = ufs_bmap(inode, lblock, &nblocks);
     ufs_debug("blk: %u\n", block);
 
+    end_block = (inode->size + BLOCK_SIZE(fs) - 1) >> BLOCK_SHIFT(fs);
+    max_blocks = (UINT32_MAX >> 1) >> blktosec;
+    if (end_block > lblock && end_block - lblock < max_blocks)
+	max_blocks = end_block - lblock;
+
+    while (nblocks && nblocks < max_blocks) {
+	more = 0;
+	next = ufs_bmap(inode, lblock + nblocks, &more);
+	if (!more ||
+	    next != (block ? block + nblocks * FRAGMENTS_PER_BLK : 0))
+	    break;
+	nblocks += more;
+    }
+    if (nblocks > max_blocks)
+	nblocks = max_blocks;
+
     if (!block) // Sparse block
 	inode->next_extent.pstart = EXTENT_ZERO;
     else
@@ -199,4 +250,4 @@ int ufs_next_extent(struct inode *inode, uint32_t lstart)
      */
     inode->next_extent.len = (nblocks << blktosec) - (lstart & blkmask);
     return 0;
-}
\ No newline at end of file
+}
@@ -22,6 +22,7 @@
 #include <string.h>
 #include <sys/dirent.h>
 #include <cache.h>
+#include <dcache.h>
 #include <disk.h>
 #include <fs.h>
 #include <minmax.h>
@@ -269,12 +270,18 @@ static struct inode *
 ufs_iget(const char *dname, struct inode *parent)
 {
     const struct ufs_dir_entry *dir;
+    const struct dentry *dc;
     struct fs_info *fs = parent->fs;
 
+    dc = dcache_lookup(parent, dname);
+    if (dc)
+	return UFS_SB(fs)->ufs_iget_by_inr(fs, dc->ino);
+
     dir = ufs_find_entry(fs, parent, dname);
     if (!dir)
 	return NULL;
 
+    dcache_insert(parent, dname, dir->inode_value, NULL, 0);
     return UFS_SB(fs)->ufs_iget_by_inr(fs, dir->inode_value);
 }
 
@@ -207,11 +207,24 @@ struct ufs2_inode {
 
 #define PVT(p) ((struct ufs_inode_pvt *) p->pvt)
 
+/*
+ * Indirect block last used at some level of the block map, see
+ * bmap_indirect().  Level 0 holds data block addresses.
+ */
+struct ufs_indir {
+    uint64_t addr;	/* Fragment address of the indirect block, 0 = none */
+    uint64_t start;	/* First file block it maps... */
+    uint64_t end;	/* ...and the one past the last */
+};
+
+#define UFS_INDIR_LEVELS 3
+
 struct ufs_inode_pvt {
     uint64_t direct_blk_ptr[12];
     uint64_t indirect_blk_ptr;
     uint64_t double_indirect_blk_ptr;
     uint64_t triple_indirect_blk_ptr;
+    struct ufs_indir indir[UFS_INDIR_LEVELS];
 };
 
 struct ufs_dir_entry {
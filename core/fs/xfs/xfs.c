@@ -20,6 +20,7 @@
 #include <string.h>
 #include <sys/dirent.h>
 #include <cache.h>
+#include <dcache.h>
 #include <core.h>
 #include <disk.h>
 #include <fs.h>
@@ -34,6 +35,7 @@
 #include "misc.h"
 #include "xfs.h"
 #include "xfs_dinode.h"
+#include "xfs_bmap.h"
 #include "xfs_dir2.h"
 #include "xfs_readdir.h"
 
@@ -92,17 +94,6 @@ static int xfs_next_extent(struct inode *inode, uint32_t lstart)
 {
     struct fs_info *fs = inode->fs;
     xfs_dinode_t *core = NULL;
-    xfs_bmbt_irec_t rec;
-    block_t bno;
-    xfs_bmdr_block_t *rblock;
-    int fsize;
-    xfs_bmbt_ptr_t *pp;
-    xfs_btree_block_t *blk;
-    uint16_t nextents;
-    block_t nextbno;
-    uint32_t index;
-
-    (void)lstart;
 
     xfs_debug("inode %p lstart %lu", inode, lstart);
 
@@ -113,65 +104,8 @@ static int xfs_next_extent(struct inode *inode, uint32_t lstart)
     }
 
     /* The data fork contains the file's data extents */
-    if (XFS_PVT(inode)->i_cur_extent == be32_to_cpu(core->di_nextents))
-        goto out;
-
-    if (core->di_format == XFS_DINODE_FMT_EXTENTS) {
-	bmbt_irec_get(&rec, (xfs_bmbt_rec_t *)&core->di_literal_area[0] +
-						XFS_PVT(inode)->i_cur_extent++);
-
-	bno = fsblock_to_bytes(fs, rec.br_startblock) >> BLOCK_SHIFT(fs);
-
-	XFS_PVT(inode)->i_offset = rec.br_startoff;
-
-	inode->next_extent.pstart = bno << BLOCK_SHIFT(fs) >> SECTOR_SHIFT(fs);
-	inode->next_extent.len = ((rec.br_blockcount << BLOCK_SHIFT(fs)) +
-				  SECTOR_SIZE(fs) - 1) >> SECTOR_SHIFT(fs);
-    } else if (core->di_format == XFS_DINODE_FMT_BTREE) {
-        xfs_debug("XFS_DINODE_FMT_BTREE");
-        index = XFS_PVT(inode)->i_cur_extent++;
-        rblock = (xfs_bmdr_block_t *)&core->di_literal_area[0];
-        fsize = XFS_DFORK_SIZE(core, fs, XFS_DATA_FORK);
-        pp = XFS_BMDR_PTR_ADDR(rblock, 1, xfs_bmdr_maxrecs(fsize, 0));
-        bno = fsblock_to_bytes(fs, be64_to_cpu(pp[0])) >> BLOCK_SHIFT(fs);
-
-        /* Find the leaf */
-        for (;;) {
-            blk = (xfs_btree_block_t *)get_cache(fs->fs_dev, bno);
-            if (be16_to_cpu(blk->bb_level) == 0)
-                break;
-
-            pp = XFS_BMBT_PTR_ADDR(fs, blk, 1,
-                    xfs_bmdr_maxrecs(XFS_INFO(fs)->blocksize, 0));
-            bno = fsblock_to_bytes(fs, be64_to_cpu(pp[0])) >> BLOCK_SHIFT(fs);
-        }
-
-        /* Find the right extent among threaded leaves */
-        for (;;) {
-            nextbno = be64_to_cpu(blk->bb_u.l.bb_rightsib);
-            nextents = be16_to_cpu(blk->bb_numrecs);
-            if (nextents - index > 0) {
-                bmbt_irec_get(&rec, XFS_BMDR_REC_ADDR(blk, index + 1));
-
-                bno = fsblock_to_bytes(fs, rec.br_startblock)
-						>> BLOCK_SHIFT(fs);
-
-                XFS_PVT(inode)->i_offset = rec.br_startoff;
-
-                inode->next_extent.pstart = bno << BLOCK_SHIFT(fs)
-                                                >> SECTOR_SHIFT(fs);
-                inode->next_extent.len = ((rec.br_blockcount
-                                            << BLOCK_SHIFT(fs))
-                                            + SECTOR_SIZE(fs) - 1)
-                                            >> SECTOR_SHIFT(fs);
-                break;
-            }
-
-            index -= nextents;
-            bno = fsblock_to_bytes(fs, nextbno) >> BLOCK_SHIFT(fs);
-            blk = (xfs_btree_block_t *)get_cache(fs->fs_dev, bno);
-        }
-    }
+    if (xfs_bmap(inode, core, lstart, &inode->next_extent))
+	goto out;
 
     return 0;
 
@@ -209,14 +143,56 @@ static inline struct inode *xfs_fmt_btree_find_entry(const char *dname,
     return xfs_dir2_node_find_entry(dname, parent, core);
 }
 
+/* Build the inode for a directory entry found in the lookup cache */
+static struct inode *xfs_iget_by_ino(struct fs_info *fs, xfs_ino_t ino)
+{
+    xfs_dinode_t *core;
+    struct inode *inode;
+
+    core = xfs_dinode_get_core(fs, ino);
+    if (!core) {
+        xfs_error("Failed to get dinode from disk (ino 0x%llx)", ino);
+        return NULL;
+    }
+
+    inode = xfs_new_inode(fs);
+    fill_xfs_inode_pvt(fs, inode, ino);
+
+    inode->ino = ino;
+    inode->size = be64_to_cpu(core->di_size);
+
+    switch (be16_to_cpu(core->di_mode) & S_IFMT) {
+    case S_IFDIR:
+	inode->mode = DT_DIR;
+	break;
+    case S_IFREG:
+	inode->mode = DT_REG;
+	break;
+    case S_IFLNK:
+	inode->mode = DT_LNK;
+	break;
+    }
+
+    return inode;
+}
+
 static struct inode *xfs_iget(const char *dname, struct inode *parent)
 {
     struct fs_info *fs = parent->fs;
     xfs_dinode_t *core = NULL;
     struct inode *inode = NULL;
+    const struct dentry *dc;
 
     xfs_debug("dname %s parent %p parent ino %lu", dname, parent, parent->ino);
 
+    dc = dcache_lookup(parent, dname);
+    if (dc) {
+	inode = xfs_iget_by_ino(fs, dc->ino);
+	if (!inode)
+	    goto out;
+	goto found;
+    }
+
     core = xfs_dinode_get_core(fs, parent->ino);
     if (!core) {
         xfs_error("Failed to get dinode from disk (ino 0x%llx)", parent->ino);
@@ -236,10 +212,10 @@ static struct inode *xfs_iget(const char *dname, struct inode *parent)
 	goto out;
     }
 
-    if (inode->mode == DT_REG) {
-	XFS_PVT(inode)->i_offset = 0;
-	XFS_PVT(inode)->i_cur_extent = 0;
-    } else if (inode->mode == DT_DIR) {
+    dcache_insert(parent, dname, inode->ino, NULL, 0);
+
+found:
+    if (inode->mode == DT_DIR) {
 	XFS_PVT(inode)->i_btree_offset = 0;
 	XFS_PVT(inode)->i_leaf_ent_offset = 0;
     }
@@ -376,12 +376,16 @@ typedef struct xfs_dinode {
                 XFS_DFORK_DSIZE(dip, fs) : \
                 XFS_DFORK_ASIZE(dip, fs))
 
+/* xfs_inode.i_bmap, see xfs_bmap.c */
+#define XFS_BMAP_UNKNOWN	0	/* Not loaded yet */
+#define XFS_BMAP_COMPLETE	1	/* Holds every extent */
+#define XFS_BMAP_PARTIAL	2	/* Too many extents to hold them all */
+
 struct xfs_inode {
     xfs_agblock_t 	i_agblock;
     block_t		i_ino_blk;
     uint64_t		i_block_offset;
-    uint64_t		i_offset;
-    uint32_t		i_cur_extent;
+    uint8_t		i_bmap;		/* State of the extent map */
     uint32_t		i_btree_offset;
     uint16_t		i_leaf_ent_offset;
 };
@@ -754,4 +758,18 @@ xfs_bmdr_maxrecs(int blocklen, int leaf)
     return blocklen / (sizeof(xfs_bmdr_key_t) + sizeof(xfs_bmdr_ptr_t));
 }
 
+/*
+ * Calculate number of records in a bmap btree block.
+ */
+static inline int
+xfs_bmbt_maxrecs(int blocklen, int leaf)
+{
+    blocklen -= XFS_BMBT_BLOCK_LEN(fs);
+
+    if (leaf)
+        return blocklen / sizeof(xfs_bmbt_rec_t);
+
+    return blocklen / (sizeof(xfs_bmbt_key_t) + sizeof(xfs_bmbt_ptr_t));
+}
+
 #endif /* XFS_H_ */
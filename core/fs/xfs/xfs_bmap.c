@@ -0,0 +1,270 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it would be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write the Free Software Foundation,
+ * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Mapping of file blocks to disk blocks.
+ *
+ * The first time a block of an inode is mapped, the whole extent list
+ * of its data fork - kept in the inode itself, or in the leaves of a
+ * bmap btree - is decoded into the inode's extent map (see getfssec.c),
+ * sorted by file offset and with adjacent extents merged.  File reads
+ * and directory lookups then binary search the map rather than walk
+ * the extent records again for every block.
+ */
+
+#include <minmax.h>
+#include <cache.h>
+#include <core.h>
+#include <fs.h>
+
+#include "xfs_types.h"
+#include "xfs_sb.h"
+#include "xfs_ag.h"
+#include "misc.h"
+#include "xfs.h"
+#include "xfs_bmap.h"
+
+/* Shift from filesystem blocks to sectors */
+#define XFS_BB_SHIFT(fs) (BLOCK_SHIFT(fs) - SECTOR_SHIFT(fs))
+
+static inline xfs_btree_block_t *xfs_bmap_get_block(struct fs_info *fs,
+						    xfs_fsblock_t fsbno)
+{
+    return (xfs_btree_block_t *)get_cache(fs->fs_dev,
+			fsblock_to_bytes(fs, fsbno) >> BLOCK_SHIFT(fs));
+}
+
+/* Convert an extent record to sectors; false if it's out of reach */
+static bool xfs_bmap_irec_to_extent(struct fs_info *fs,
+				    const xfs_bmbt_irec_t *rec,
+				    struct extent *ext)
+{
+    int shift = XFS_BB_SHIFT(fs);
+
+    if ((rec->br_startoff + rec->br_blockcount) >> (32 - shift))
+	return false;
+
+    ext->lstart = rec->br_startoff << shift;
+    ext->len = rec->br_blockcount << shift;
+    if (rec->br_state == XFS_EXT_UNWRITTEN)
+	ext->pstart = EXTENT_ZERO;	/* Preallocated, reads as zeroes */
+    else
+	ext->pstart = fsblock_to_bytes(fs, rec->br_startblock) >>
+	    SECTOR_SHIFT(fs);
+
+    return true;
+}
+
+static bool xfs_bmap_add_recs(struct inode *inode, const xfs_bmbt_rec_t *xp,
+			      int nrecs)
+{
+    xfs_bmbt_irec_t rec;
+    struct extent ext;
+
+    while (nrecs--) {
+	bmbt_irec_get(&rec, xp++);
+	if (!xfs_bmap_irec_to_extent(inode->fs, &rec, &ext) ||
+	    !extent_map_insert(inode, &ext))
+	    return false;
+    }
+
+    return true;
+}
+
+/*
+ * Decode the whole data fork into the extent map.  If it doesn't fit,
+ * the map is left partial and xfs_bmap_search() handles what is missing.
+ */
+static void xfs_bmap_load(struct inode *inode, xfs_dinode_t *core)
+{
+    struct fs_info *fs = inode->fs;
+    xfs_bmdr_block_t *rblock;
+    xfs_btree_block_t *blk;
+    xfs_bmbt_ptr_t *pp;
+    xfs_fsblock_t fsbno;
+    int fsize;
+
+    XFS_PVT(inode)->i_bmap = XFS_BMAP_PARTIAL;
+
+    if (core->di_format == XFS_DINODE_FMT_EXTENTS) {
+	if (!xfs_bmap_add_recs(inode,
+			       (xfs_bmbt_rec_t *)&core->di_literal_area[0],
+			       be32_to_cpu(core->di_nextents)))
+	    return;
+    } else if (core->di_format == XFS_DINODE_FMT_BTREE) {
+	/* Down the left edge of the tree... */
+	rblock = (xfs_bmdr_block_t *)&core->di_literal_area[0];
+	fsize = XFS_DFORK_SIZE(core, fs, XFS_DATA_FORK);
+	pp = XFS_BMDR_PTR_ADDR(rblock, 1, xfs_bmdr_maxrecs(fsize, 0));
+	blk = xfs_bmap_get_block(fs, be64_to_cpu(pp[0]));
+	while (be16_to_cpu(blk->bb_level)) {
+	    pp = XFS_BMBT_PTR_ADDR(fs, blk, 1,
+				   xfs_bmbt_maxrecs(XFS_INFO(fs)->blocksize, 0));
+	    blk = xfs_bmap_get_block(fs, be64_to_cpu(pp[0]));
+	}
+
+	/* ... and along the threaded leaves */
+	for (;;) {
+	    if (!xfs_bmap_add_recs(inode, XFS_BMBT_REC_ADDR(fs, blk, 1),
+				   be16_to_cpu(blk->bb_numrecs)))
+		return;
+	    fsbno = be64_to_cpu(blk->bb_u.l.bb_rightsib);
+	    if (fsbno == NULLFSBLOCK)
+		break;
+	    blk = xfs_bmap_get_block(fs, fsbno);
+	}
+    } else {
+	return;
+    }
+
+    XFS_PVT(inode)->i_bmap = XFS_BMAP_COMPLETE;
+}
+
+static xfs_fsblock_t
+select_child(xfs_dfiloff_t off,
+             xfs_bmbt_key_t *kp,
+             xfs_bmbt_ptr_t *pp,
+             int nrecs)
+{
+    int i;
+
+    for (i = 0; i < nrecs; i++) {
+        if (be64_to_cpu(kp[i].br_startoff) == off)
+            return be64_to_cpu(pp[i]);
+        if (be64_to_cpu(kp[i].br_startoff) > off) {
+            if (i == 0)
+                return be64_to_cpu(pp[i]);
+            else
+                return be64_to_cpu(pp[i-1]);
+        }
+    }
+
+    return be64_to_cpu(pp[nrecs - 1]);
+}
+
+/*
+ * Find the extent record covering file block off the slow way, for
+ * files whose extents didn't all fit in the map.
+ */
+static int xfs_bmap_search(struct fs_info *fs, xfs_dinode_t *core,
+			   xfs_fileoff_t off, xfs_bmbt_irec_t *irec)
+{
+    uint32_t idx;
+    xfs_fsblock_t nextbno;
+    xfs_bmdr_block_t *rblock;
+    int fsize;
+    int nextents;
+    xfs_bmbt_ptr_t *pp;
+    xfs_bmbt_key_t *kp;
+    xfs_btree_block_t *blk;
+    xfs_bmbt_rec_t *xp;
+
+    if (core->di_format == XFS_DINODE_FMT_EXTENTS) {
+        xp = (xfs_bmbt_rec_t *)&core->di_literal_area[0];
+        for (idx = 0; idx < be32_to_cpu(core->di_nextents); idx++) {
+            bmbt_irec_get(irec, xp + idx);
+            if (off >= irec->br_startoff &&
+                off < irec->br_startoff + irec->br_blockcount)
+                return 0;
+        }
+    } else if (core->di_format == XFS_DINODE_FMT_BTREE) {
+        rblock = (xfs_bmdr_block_t *)&core->di_literal_area[0];
+        fsize = XFS_DFORK_SIZE(core, fs, XFS_DATA_FORK);
+        pp = XFS_BMDR_PTR_ADDR(rblock, 1, xfs_bmdr_maxrecs(fsize, 0));
+        kp = XFS_BMDR_KEY_ADDR(rblock, 1);
+        blk = xfs_bmap_get_block(fs,
+                  select_child(off, kp, pp, be16_to_cpu(rblock->bb_numrecs)));
+
+        /* Find the leaf */
+        while (be16_to_cpu(blk->bb_level)) {
+            pp = XFS_BMBT_PTR_ADDR(fs, blk, 1,
+                     xfs_bmbt_maxrecs(XFS_INFO(fs)->blocksize, 0));
+            kp = XFS_BMBT_KEY_ADDR(fs, blk, 1);
+            blk = xfs_bmap_get_block(fs,
+                      select_child(off, kp, pp, be16_to_cpu(blk->bb_numrecs)));
+        }
+
+        /* Find the records among leaves */
+        for (;;) {
+            nextbno = be64_to_cpu(blk->bb_u.l.bb_rightsib);
+            nextents = be16_to_cpu(blk->bb_numrecs);
+            xp = XFS_BMBT_REC_ADDR(fs, blk, 1);
+            for (idx = 0; idx < nextents; idx++) {
+                bmbt_irec_get(irec, xp + idx);
+                if (off >= irec->br_startoff &&
+                    off < irec->br_startoff + irec->br_blockcount)
+                    return 0;
+                if (irec->br_startoff > off)
+                    return -1;
+            }
+            if (nextbno == NULLFSBLOCK)
+                break;
+            blk = xfs_bmap_get_block(fs, nextbno);
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Map the file, from sector lstart on, to disk.  On success *ext holds
+ * the extent starting at lstart: a hole maps to EXTENT_ZERO, up to the
+ * next extent or the end of the file.
+ */
+int xfs_bmap(struct inode *inode, xfs_dinode_t *core, uint32_t lstart,
+	     struct extent *ext)
+{
+    struct fs_info *fs = inode->fs;
+    const struct extent *e;
+    xfs_bmbt_irec_t irec;
+    uint64_t end;
+    uint32_t delta;
+
+    if (XFS_PVT(inode)->i_bmap == XFS_BMAP_UNKNOWN)
+	xfs_bmap_load(inode, core);
+
+    e = extent_map_find(inode, lstart);
+    if (e && e->lstart <= lstart) {
+	delta = lstart - e->lstart;
+	ext->lstart = lstart;
+	ext->pstart = EXTENT_SPECIAL(e->pstart) ? e->pstart : e->pstart + delta;
+	ext->len = e->len - delta;
+	return 0;
+    }
+
+    if (XFS_PVT(inode)->i_bmap == XFS_BMAP_COMPLETE) {
+	/* A hole */
+	end = (inode->size + SECTOR_SIZE(fs) - 1) >> SECTOR_SHIFT(fs);
+	if (e)
+	    end = e->lstart;
+	if (end <= lstart)
+	    return -1;
+	ext->lstart = lstart;
+	ext->pstart = EXTENT_ZERO;
+	ext->len = min(end - lstart, (uint64_t)UINT32_MAX);
+	return 0;
+    }
+
+    if (xfs_bmap_search(fs, core, lstart >> XFS_BB_SHIFT(fs), &irec) ||
+	!xfs_bmap_irec_to_extent(fs, &irec, ext))
+	return -1;
+
+    delta = lstart - ext->lstart;
+    ext->lstart = lstart;
+    if (!EXTENT_SPECIAL(ext->pstart))
+	ext->pstart += delta;
+    ext->len -= delta;
+    return 0;
+}
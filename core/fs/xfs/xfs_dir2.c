@@ -15,9 +15,11 @@
  * Inc.,  51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#include <stdio.h>
 #include <cache.h>
 #include <core.h>
 #include <fs.h>
+#include <linux/list.h>
 
 #include "xfs_types.h"
 #include "xfs_sb.h"
@@ -25,19 +27,39 @@
 #include "misc.h"
 #include "xfs.h"
 #include "xfs_dinode.h"
+#include "xfs_bmap.h"
 
 #include "xfs_dir2.h"
 
-#define XFS_DIR2_DIRBLKS_CACHE_SIZE 128
-
-struct xfs_dir2_dirblks_cache {
-    block_t        dc_startblock;
-    xfs_filblks_t  dc_blkscount;
-    void          *dc_area;
+/*
+ * Directory blocks spanning several filesystem blocks are copied into
+ * one buffer, and kept on an LRU list up to a memory budget of
+ * XfsDirCache KiB (the XFSDIRCACHE configuration option).  The
+ * XFS_DIR2_DIRBLKS_KEEP most recent ones are never evicted, as lookups
+ * hold on to a node, a leaf and a data block at the same time.
+ */
+__export uint32_t XfsDirCache = 256;
+#define XFS_DIR2_DIRBLKS_KEEP	4
+#define XFS_DIR2_DIRBLKS_HASH	64		/* Must be a power of 2 */
+
+struct xfs_dir2_dirblks {
+    struct list_head		 db_lru;
+    struct xfs_dir2_dirblks	*db_hash_next;
+    block_t			 db_startblock;
+    xfs_filblks_t		 db_blkscount;
+    uint32_t			 db_size;
+    uint8_t			 db_data[0];
 };
 
-static struct xfs_dir2_dirblks_cache dirblks_cache[XFS_DIR2_DIRBLKS_CACHE_SIZE];
-static unsigned char                 dirblks_cached_count = 0;
+static struct {
+    struct list_head		 lru;	/* Least recently used first */
+    struct xfs_dir2_dirblks	*hash[XFS_DIR2_DIRBLKS_HASH];
+    unsigned int		 count;
+    uint32_t			 bytes;
+    uint32_t			 hits, misses, direct;
+} dirblks_cache = {
+    .lru = LIST_HEAD_INIT(dirblks_cache.lru),
+};
 
 uint32_t xfs_dir2_da_hashname(const uint8_t *name, int namelen)
 {
@@ -66,106 +88,95 @@ uint32_t xfs_dir2_da_hashname(const uint8_t *name, int namelen)
     }
 }
 
-static void *get_dirblks(struct fs_info *fs, block_t startblock,
-			 xfs_filblks_t c)
+static inline struct xfs_dir2_dirblks **dirblks_bucket(block_t startblock)
 {
-    int count = c << XFS_INFO(fs)->dirblklog;
-    uint8_t *p;
-    uint8_t *buf;
-    off_t offset = 0;
+    return &dirblks_cache.hash[startblock & (XFS_DIR2_DIRBLKS_HASH - 1)];
+}
 
-    buf = malloc(c * XFS_INFO(fs)->dirblksize);
-    if (!buf)
-        malloc_error("buffer memory");
+static void dirblks_evict(struct xfs_dir2_dirblks *db)
+{
+    struct xfs_dir2_dirblks **pp = dirblks_bucket(db->db_startblock);
 
-    memset(buf, 0, XFS_INFO(fs)->dirblksize);
+    while (*pp != db)
+	pp = &(*pp)->db_hash_next;
+    *pp = db->db_hash_next;
 
-    while (count--) {
-        p = (uint8_t *)get_cache(fs->fs_dev, startblock++);
-        memcpy(buf + offset, p,  BLOCK_SIZE(fs));
-        offset += BLOCK_SIZE(fs);
-    }
-
-    return buf;
+    list_del(&db->db_lru);
+    dirblks_cache.count--;
+    dirblks_cache.bytes -= db->db_size;
+    free(db);
 }
 
+/*
+ * Return c directory blocks starting at filesystem block startblock.
+ * The data stays valid until the next few calls.
+ */
 const void *xfs_dir2_dirblks_get_cached(struct fs_info *fs, block_t startblock,
 					xfs_filblks_t c)
 {
-    unsigned char i;
-    void *buf;
+    xfs_filblks_t count = c << XFS_INFO(fs)->dirblklog;
+    struct xfs_dir2_dirblks *db, **bucket;
+    uint32_t size;
 
     xfs_debug("fs %p startblock %llu (0x%llx) blkscount %lu", fs, startblock,
 	      startblock, c);
 
-    if (!dirblks_cached_count) {
-	buf = get_dirblks(fs, startblock, c);
-
-	dirblks_cache[dirblks_cached_count].dc_startblock = startblock;
-	dirblks_cache[dirblks_cached_count].dc_blkscount = c;
-	dirblks_cache[dirblks_cached_count].dc_area = buf;
-
-	return dirblks_cache[dirblks_cached_count++].dc_area;
-    } else if (dirblks_cached_count == XFS_DIR2_DIRBLKS_CACHE_SIZE) {
-	for (i = 0; i < XFS_DIR2_DIRBLKS_CACHE_SIZE / 2; i++) {
-	    unsigned char k = XFS_DIR2_DIRBLKS_CACHE_SIZE - (i + 1);
+    /* A single filesystem block can be used straight from the cache */
+    if (count == 1) {
+	dirblks_cache.direct++;
+	return get_cache(fs->fs_dev, startblock);
+    }
 
-	    free(dirblks_cache[i].dc_area);
-	    dirblks_cache[i] = dirblks_cache[k];
-	    memset(&dirblks_cache[k], 0, sizeof(dirblks_cache[k]));
+    bucket = dirblks_bucket(startblock);
+    for (db = *bucket; db; db = db->db_hash_next) {
+	if (db->db_startblock == startblock && db->db_blkscount == c) {
+	    dirblks_cache.hits++;
+	    list_move_tail(&db->db_lru, &dirblks_cache.lru);
+	    return db->db_data;
 	}
+    }
 
-	buf = get_dirblks(fs, startblock, c);
-
-	dirblks_cache[XFS_DIR2_DIRBLKS_CACHE_SIZE / 2].dc_startblock =
-	    startblock;
-	dirblks_cache[XFS_DIR2_DIRBLKS_CACHE_SIZE / 2].dc_blkscount = c;
-	dirblks_cache[XFS_DIR2_DIRBLKS_CACHE_SIZE / 2].dc_area = buf;
-
-	dirblks_cached_count = XFS_DIR2_DIRBLKS_CACHE_SIZE / 2;
-
-	return dirblks_cache[dirblks_cached_count++].dc_area;
-    } else {
-	block_t block;
-	xfs_filblks_t count;
-
-	block = dirblks_cache[dirblks_cached_count - 1].dc_startblock;
-	count = dirblks_cache[dirblks_cached_count - 1].dc_blkscount;
-
-	if (block == startblock && count == c) {
-	    return dirblks_cache[dirblks_cached_count - 1].dc_area;
-	} else {
-	    for (i = 0; i < dirblks_cached_count; i++) {
-		block = dirblks_cache[i].dc_startblock;
-		count = dirblks_cache[i].dc_blkscount;
+    dirblks_cache.misses++;
 
-		if (block == startblock && count == c)
-		    return dirblks_cache[i].dc_area;
-	    }
+    size = count << BLOCK_SHIFT(fs);
+    db = malloc(sizeof *db + size);
+    if (!db)
+	malloc_error("buffer memory");
 
-	    buf = get_dirblks(fs, startblock, c);
+    cache_read(fs, db->db_data, (uint64_t)startblock << BLOCK_SHIFT(fs), size);
+    db->db_startblock = startblock;
+    db->db_blkscount = c;
+    db->db_size = size;
 
-	    dirblks_cache[dirblks_cached_count].dc_startblock = startblock;
-	    dirblks_cache[dirblks_cached_count].dc_blkscount = c;
-	    dirblks_cache[dirblks_cached_count].dc_area = buf;
+    db->db_hash_next = *bucket;
+    *bucket = db;
+    list_add_tail(&db->db_lru, &dirblks_cache.lru);
+    dirblks_cache.count++;
+    dirblks_cache.bytes += size;
 
-	    return dirblks_cache[dirblks_cached_count++].dc_area;
-	}
-    }
+    while (dirblks_cache.bytes > (XfsDirCache << 10) &&
+	   dirblks_cache.count > XFS_DIR2_DIRBLKS_KEEP)
+	dirblks_evict(list_first_entry(&dirblks_cache.lru,
+				       struct xfs_dir2_dirblks, db_lru));
 
-    return NULL;
+    return db->db_data;
 }
 
 void xfs_dir2_dirblks_flush_cache(void)
 {
-    unsigned char i;
-
-    for (i = 0; i < dirblks_cached_count; i++) {
-	free(dirblks_cache[i].dc_area);
-	memset(&dirblks_cache[i], 0, sizeof(dirblks_cache[i]));
-    }
+    while (!list_empty(&dirblks_cache.lru))
+	dirblks_evict(list_first_entry(&dirblks_cache.lru,
+				       struct xfs_dir2_dirblks, db_lru));
+}
 
-    dirblks_cached_count = 0;
+/*
+ * Print the directory block cache counters.
+ */
+void xfs_dir2_dirblks_stats(void)
+{
+    printf("xfs: %u dir blocks cached (%u bytes), %u hits, %u misses, "
+	   "%u uncopied\n", dirblks_cache.count, dirblks_cache.bytes,
+	   dirblks_cache.hits, dirblks_cache.misses, dirblks_cache.direct);
 }
 
 struct inode *xfs_dir2_local_find_entry(const char *dname, struct inode *parent,
@@ -489,104 +500,22 @@ failed:
     return ip;
 }
 
-static xfs_fsblock_t
-select_child(xfs_dfiloff_t off,
-             xfs_bmbt_key_t *kp,
-             xfs_bmbt_ptr_t *pp,
-             int nrecs)
-{
-    int i;
-
-    for (i = 0; i < nrecs; i++) {
-        if (be64_to_cpu(kp[i].br_startoff) == off)
-            return be64_to_cpu(pp[i]);
-        if (be64_to_cpu(kp[i].br_startoff) > off) {
-            if (i == 0)
-                return be64_to_cpu(pp[i]);
-            else
-                return be64_to_cpu(pp[i-1]);
-        }
-    }
-
-    return be64_to_cpu(pp[nrecs - 1]);
-}
-
-block_t xfs_dir2_get_right_blk(struct fs_info *fs, xfs_dinode_t *core,
+block_t xfs_dir2_get_right_blk(struct inode *inode, xfs_dinode_t *core,
 			       block_t fsblkno, int *error)
 {
-    uint32_t idx;
-    xfs_bmbt_irec_t irec;
-    block_t bno;
-    block_t nextbno;
-    xfs_bmdr_block_t *rblock;
-    int fsize;
-    int nextents;
-    xfs_bmbt_ptr_t *pp;
-    xfs_bmbt_key_t *kp;
-    xfs_btree_block_t *blk;
-    xfs_bmbt_rec_t *xp;
+    struct fs_info *fs = inode->fs;
+    int shift = BLOCK_SHIFT(fs) - SECTOR_SHIFT(fs);
+    struct extent ext;
 
     *error = 0;
-    if (core->di_format == XFS_DINODE_FMT_EXTENTS) {
-        xfs_debug("XFS_DINODE_FMT_EXTENTS");
-        for (idx = 0; idx < be32_to_cpu(core->di_nextents); idx++) {
-            bmbt_irec_get(&irec,
-                          ((xfs_bmbt_rec_t *)&core->di_literal_area[0]) + idx);
-            if (fsblkno >= irec.br_startoff &&
-                fsblkno < irec.br_startoff + irec.br_blockcount)
-                break;
-        }
-    } else if (core->di_format == XFS_DINODE_FMT_BTREE) {
-        xfs_debug("XFS_DINODE_FMT_BTREE");
-        bno = NULLFSBLOCK;
-        rblock = (xfs_bmdr_block_t *)&core->di_literal_area[0];
-        fsize = XFS_DFORK_SIZE(core, fs, XFS_DATA_FORK);
-        pp = XFS_BMDR_PTR_ADDR(rblock, 1, xfs_bmdr_maxrecs(fsize, 0));
-        kp = XFS_BMDR_KEY_ADDR(rblock, 1);
-        bno = fsblock_to_bytes(fs,
-                  select_child(fsblkno, kp, pp,
-                      be16_to_cpu(rblock->bb_numrecs))) >> BLOCK_SHIFT(fs);
-
-        /* Find the leaf */
-        for (;;) {
-            blk = (xfs_btree_block_t *)get_cache(fs->fs_dev, bno);
-            if (be16_to_cpu(blk->bb_level) == 0)
-                break;
-            pp = XFS_BMBT_PTR_ADDR(fs, blk, 1,
-                     xfs_bmdr_maxrecs(XFS_INFO(fs)->blocksize, 0));
-            kp = XFS_BMBT_KEY_ADDR(fs, blk, 1);
-            bno = fsblock_to_bytes(fs,
-                      select_child(fsblkno, kp, pp,
-                          be16_to_cpu(blk->bb_numrecs))) >> BLOCK_SHIFT(fs);
-        }
-
-        /* Find the records among leaves */
-        for (;;) {
-            nextbno = be64_to_cpu(blk->bb_u.l.bb_rightsib);
-            nextents = be16_to_cpu(blk->bb_numrecs);
-            xp = (xfs_bmbt_rec_t *)XFS_BMBT_REC_ADDR(fs, blk, 1);
-            for (idx = 0; idx < nextents; idx++) {
-                bmbt_irec_get(&irec, xp + idx);
-                if (fsblkno >= irec.br_startoff &&
-                    fsblkno < irec.br_startoff + irec.br_blockcount) {
-                    nextbno = NULLFSBLOCK;
-                    break;
-                }
-            }
-            if (nextbno == NULLFSBLOCK)
-                break;
-            bno = fsblock_to_bytes(fs, nextbno) >> BLOCK_SHIFT(fs);
-            blk = (xfs_btree_block_t *)get_cache(fs->fs_dev, bno);
-        }
+    if ((fsblkno >> (32 - shift)) ||
+	xfs_bmap(inode, core, fsblkno << shift, &ext) ||
+	EXTENT_SPECIAL(ext.pstart)) {
+	*error = 1;
+	return 0;
     }
 
-    if (fsblkno < irec.br_startoff ||
-        fsblkno >= irec.br_startoff + irec.br_blockcount)
-        *error = 1;
-
-    return fsblock_to_bytes(fs,
-                fsblkno - irec.br_startoff + irec.br_startblock) >>
-                BLOCK_SHIFT(fs);
+    return ext.pstart >> shift;
 }
 
 struct inode *xfs_dir2_node_find_entry(const char *dname, struct inode *parent,
@@ -612,15 +541,22 @@ struct inode *xfs_dir2_node_find_entry(const char *dname, struct inode *parent,
     int high;
     int mid = 0;
     uint32_t newdb, curdb = -1;
+    uint32_t address;
+    block_t leafblk, datablk = 0;
     xfs_intino_t ino;
     xfs_dinode_t *ncore;
     const uint8_t *buf = NULL;
 
     xfs_debug("dname %s parent %p core %p", dname, parent, core);
 
+    /*
+     * Blocks come straight from the block cache, so reading one may
+     * push out another we still point into: the inode core, the leaf
+     * or the data block.  Look each up again after reading others.
+     */
     hashwant = xfs_dir2_da_hashname((uint8_t *)dname, strlen(dname));
 
-    fsblkno = xfs_dir2_get_right_blk(parent->fs, core,
+    fsblkno = xfs_dir2_get_right_blk(parent, core,
                   xfs_dir2_byte_to_db(parent->fs, XFS_DIR2_LEAF_OFFSET),
                   &error);
     if (error) {
@@ -674,7 +610,10 @@ struct inode *xfs_dir2_node_find_entry(const char *dname, struct inode *parent,
         else
             fsblkno = be32_to_cpu(node->btree[probe].before);
 
-        fsblkno = xfs_dir2_get_right_blk(parent->fs, core, fsblkno, &error);
+        core = xfs_dinode_get_core(parent->fs, parent->ino);
+        if (!core)
+            goto out;
+        fsblkno = xfs_dir2_get_right_blk(parent, core, fsblkno, &error);
         if (error) {
             xfs_error("Cannot find right rec!");
             goto out;
@@ -684,6 +623,7 @@ struct inode *xfs_dir2_node_find_entry(const char *dname, struct inode *parent,
 							       fsblkno, 1);
     } while(be16_to_cpu(node->hdr.info.magic) == XFS_DA_NODE_MAGIC);
 
+    leafblk = fsblkno;
     leaf = (xfs_dir2_leaf_t*)node;
     if (be16_to_cpu(leaf->hdr.info.magic) != XFS_DIR2_LEAFN_MAGIC) {
         xfs_error("Leaf's magic number does not match!");
@@ -714,23 +654,31 @@ struct inode *xfs_dir2_node_find_entry(const char *dname, struct inode *parent,
     while (mid > 0 && be32_to_cpu(lep[mid - 1].hashval) == hashwant)
         mid--;
 
-    for (lep = &leaf->ents[mid];
-         mid < be16_to_cpu(leaf->hdr.count) &&
-         be32_to_cpu(lep->hashval) == hashwant;
-         lep++, mid++) {
+    for (;; mid++) {
+        leaf = (xfs_dir2_leaf_t *)xfs_dir2_dirblks_get_cached(parent->fs,
+                                                              leafblk, 1);
+        lep = &leaf->ents[mid];
+        if (mid >= be16_to_cpu(leaf->hdr.count) ||
+            be32_to_cpu(lep->hashval) != hashwant)
+            break;
+
         /* Skip over stale leaf entries. */
-        if (be32_to_cpu(lep->address) == XFS_DIR2_NULL_DATAPTR)
+        address = be32_to_cpu(lep->address);
+        if (address == XFS_DIR2_NULL_DATAPTR)
             continue;
 
-        newdb = xfs_dir2_dataptr_to_db(parent->fs, be32_to_cpu(lep->address));
+        newdb = xfs_dir2_dataptr_to_db(parent->fs, address);
         if (newdb != curdb) {
-            fsblkno = xfs_dir2_get_right_blk(parent->fs, core, newdb, &error);
+            core = xfs_dinode_get_core(parent->fs, parent->ino);
+            if (!core)
+                goto out;
+            datablk = xfs_dir2_get_right_blk(parent, core, newdb, &error);
             if (error) {
                 xfs_error("Cannot find data block!");
                 goto out;
             }
 
-            buf = xfs_dir2_dirblks_get_cached(parent->fs, fsblkno, 1);
+            buf = xfs_dir2_dirblks_get_cached(parent->fs, datablk, 1);
             data_hdr = (xfs_dir2_data_hdr_t *)buf;
             if (be32_to_cpu(data_hdr->magic) != XFS_DIR2_DATA_MAGIC) {
                 xfs_error("Leaf directory's data magic No. does not match!");
@@ -738,10 +686,12 @@ struct inode *xfs_dir2_node_find_entry(const char *dname, struct inode *parent,
             }
 
             curdb = newdb;
+        } else {
+            buf = xfs_dir2_dirblks_get_cached(parent->fs, datablk, 1);
         }
 
         dep = (xfs_dir2_data_entry_t *)((char *)buf +
-               xfs_dir2_dataptr_to_off(parent->fs, be32_to_cpu(lep->address)));
+               xfs_dir2_dataptr_to_off(parent->fs, address));
 
         start_name = &dep->name[0];
         end_name = start_name + dep->namelen;
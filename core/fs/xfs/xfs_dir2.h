@@ -26,10 +26,11 @@
 const void *xfs_dir2_dirblks_get_cached(struct fs_info *fs, block_t startblock,
 					xfs_filblks_t c);
 void xfs_dir2_dirblks_flush_cache(void);
+void xfs_dir2_dirblks_stats(void);
 
 uint32_t xfs_dir2_da_hashname(const uint8_t *name, int namelen);
 
-block_t xfs_dir2_get_right_blk(struct fs_info *fs, xfs_dinode_t *core,
+block_t xfs_dir2_get_right_blk(struct inode *inode, xfs_dinode_t *core,
 			       block_t fsblkno, int *error);
 
 struct inode *xfs_dir2_local_find_entry(const char *dname, struct inode *parent,
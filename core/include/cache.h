@@ -11,14 +11,17 @@ struct cache {
     block_t block;
     struct cache *prev;
     struct cache *next;
+    struct cache *hash_next;	/* Next block in the same hash bucket */
     void *data;
 };
 
 /* functions defined in cache.c */
 void cache_init(struct device *, int);
 const void *get_cache(struct device *, block_t);
+const void *get_cache_ahead(struct device *, block_t, unsigned int);
 struct cache *_get_cache_block(struct device *, block_t);
 void cache_lock_block(struct cache *);
+void cache_stats(struct device *);
 size_t cache_read(struct fs_info *, void *, uint64_t, size_t);
 
 #endif /* cache.h */
@@ -0,0 +1,31 @@
+#ifndef _DCACHE_H
+#define _DCACHE_H
+
+#include <stdint.h>
+#include <linux/list.h>
+#include "fs.h"
+
+/*
+ * A cached directory entry: the result of looking up NAME in the
+ * directory with inode number DIR.  Drivers may attach a small blob
+ * of private data, e.g. the raw on-disk directory entry, so they can
+ * rebuild the inode without scanning the directory again.
+ */
+struct dentry {
+    struct dentry *hash_next;
+    struct list_head lru;
+    uint64_t dir;		/* Inode number of the parent directory */
+    uint64_t ino;		/* Inode number of the entry */
+    uint32_t hash;
+    uint16_t data_len;		/* Bytes of private data */
+    const char *name;		/* Stored right after the private data */
+    uint64_t data[0];		/* Private data, 8-byte aligned */
+};
+
+/* functions defined in dcache.c */
+const struct dentry *dcache_lookup(struct inode *, const char *);
+void dcache_insert(struct inode *, const char *, uint64_t,
+		   const void *, size_t);
+void dcache_stats(struct fs_info *);
+
+#endif /* dcache.h */
@@ -5,6 +5,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <core.h>
+#include <syslinux/diskprof.h>
 
 typedef uint64_t sector_t;
 typedef uint64_t block_t;
@@ -23,14 +24,24 @@ struct disk {
     unsigned int sector_size;	/* gener512B or 2048B */
     unsigned int sector_shift;
     unsigned int maxtransfer;	/* Max sectors per transfer */
+    unsigned int hard_maxtransfer; /* Upper bound for maxtransfer */
     
     unsigned int h, s;		/* CHS geometry */
     unsigned int secpercyl;	/* h*s */
     unsigned int _pad;
 
     sector_t part_start;   /* the start address of this partition(in sectors) */
+    sector_t sectors;	   /* Size of the whole medium, 0 if unknown */
 
     int (*rdwr_sectors)(struct disk *, void *, sector_t, size_t, bool);
+
+    struct disk_stats stats;
+
+    /* Learned I/O profile, see diskio_bios.c */
+    unsigned int good_maxtransfer; /* Largest transfer seen succeeding */
+    unsigned int fail_maxtransfer; /* Smallest transfer seen too large */
+    unsigned int good_streak;	/* Full-size transfers since last change */
+    struct disk_xfer_class xfer[DISK_XFER_CLASSES];
 };
 
 extern void read_sectors(char *, sector_t, int);
@@ -36,6 +36,7 @@ struct fs_info {
     int block_shift, block_size;
     struct inode *root, *cwd;	   	/* Root and current directories */
     char cwd_name[CURRENTDIR_MAX];	/* Current directory by name */
+    struct dcache *dcache;		/* Path component lookup cache */
 };
 
 extern struct fs_info *this_fs;
@@ -94,6 +95,16 @@ struct extent {
 
 #define EXTENT_SPECIAL(x)	((x) >= EXTENT_VOID)
 
+/*
+ * Per-inode cache of the extents returned by ->next_extent(), sorted
+ * by logical start and non-overlapping.
+ */
+struct extent_map {
+    uint32_t count;		/* Extents in use */
+    uint32_t size;		/* Extents allocated */
+    struct extent ext[0];
+};
+
 /* 
  * The inode structure, including the detail file information 
  */
@@ -113,6 +124,7 @@ struct inode {
     uint32_t     flags;
     uint32_t     file_acl;
     struct extent this_extent, next_extent;
+    struct extent_map *extent_map; /* Extents seen so far, see getfssec.c */
     char         pvt[0]; /* Private filesystem data */
 };
 
@@ -120,6 +132,9 @@ struct file {
     struct fs_info *fs;
     uint32_t offset;            /* for next read */
     struct inode *inode;        /* The file-specific information */
+    uint32_t start_ms;		/* ms_timer() when this run of reads began */
+    uint32_t start_offset;	/* offset where this run of reads began */
+    uint32_t end_offset;	/* offset after the previous read */
 };
 
 /*
@@ -136,9 +151,19 @@ struct device {
     uint8_t cache_init; /* cache initialized state */
     char *cache_data;
     struct cache *cache_head;
+    struct cache **cache_hash;	/* Block number -> cache descriptor */
     uint16_t cache_block_size;
     uint16_t cache_entries;
+    uint16_t cache_hash_mask;
     uint32_t cache_size;
+    uint32_t cache_hits, cache_misses;
+
+    /* read-ahead state, see get_cache_ahead() */
+    char *cache_ra_buf;		/* Staging buffer for multi-block reads */
+    uint16_t cache_ra_bufblks;	/* Size of cache_ra_buf in blocks */
+    uint16_t cache_ra_window;	/* Current read-ahead window in blocks */
+    block_t cache_ra_next;	/* Block following the last fill */
+    uint32_t cache_ra_reads, cache_ra_blocks;
 };
 
 /*
@@ -155,6 +180,7 @@ static inline bool not_whitespace(char c)
 struct inode *alloc_inode(struct fs_info *fs, uint32_t ino, size_t data);
 static inline void free_inode(struct inode * inode)
 {
+    free(inode->extent_map);
     free(inode);
 }
 
@@ -248,6 +274,9 @@ void generic_close_file(struct file *file);
 /* getfssec.c */
 uint32_t generic_getfssec(struct file *file, char *buf,
 			  int sectors, bool *have_more);
+const struct extent *extent_map_find(const struct inode *inode,
+				     uint32_t lstart);
+bool extent_map_insert(struct inode *inode, const struct extent *new);
 
 /* nonextextent.c */
 int no_next_extent(struct inode *, uint32_t);
@@ -26,6 +26,8 @@ void core_udp_send(struct pxe_pvt_inode *socket,
 void core_udp_sendto(struct pxe_pvt_inode *socket, const void *data, size_t len,
 		     uint32_t ip, uint16_t port);
 
+size_t core_udp_maxlen(bool frag);
+
 void probe_undi(void);
 void pxe_init_isr(void);
 
@@ -146,6 +146,21 @@ void core_udp_send(struct pxe_pvt_inode *socket, const void *data, size_t len)
     lfree(lbuf);
 }
 
+/**
+ * Largest UDP payload we can receive
+ *
+ * @param:frag, whether IP fragmentation is acceptable
+ *
+ * @out: payload size in bytes, 0 if the link MTU is not known
+ *
+ * The PXE UDP API doesn't tell us the MTU, and whatever the stack
+ * does about fragments, the datagram has to fit our buffer.
+ */
+size_t core_udp_maxlen(bool frag)
+{
+    return frag ? PKTBUF_SIZE : 0;
+}
+
 /**
  * Send a UDP packet to a destination
  *
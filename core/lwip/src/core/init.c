@@ -99,8 +99,17 @@
 #if (LWIP_TCP && (MEMP_NUM_TCP_PCB<=0))
   #error "If you want to use TCP, you have to define MEMP_NUM_TCP_PCB>=1 in your lwipopts.h"
 #endif
-#if (LWIP_TCP && (TCP_WND > 0xffff))
-  #error "If you want to use TCP, TCP_WND must fit in an u16_t, so, you have to reduce it in your lwipopts.h"
+#if (LWIP_TCP && !LWIP_WND_SCALE && ((TCP_WND > 0xffff) || (TCP_WND_LIMIT > 0xffff)))
+  #error "If you want to use TCP, TCP_WND and TCP_WND_LIMIT must fit in an u16_t (or define LWIP_WND_SCALE), so, you have to reduce them in your lwipopts.h"
+#endif
+#if (LWIP_TCP && LWIP_WND_SCALE && (TCP_WND_LIMIT > (0xffffUL << 14)))
+  #error "TCP_WND_LIMIT is larger than the window scale option allows, reduce it in your lwipopts.h"
+#endif
+#if (LWIP_TCP && (TCP_WND > TCP_WND_LIMIT))
+  #error "TCP_WND must not be larger than TCP_WND_LIMIT"
+#endif
+#if (LWIP_TCP_SACK_OUT && !TCP_QUEUE_OOSEQ)
+  #error "LWIP_TCP_SACK_OUT needs TCP_QUEUE_OOSEQ"
 #endif
 #if (LWIP_TCP && (TCP_SND_QUEUELEN > 0xffff))
   #error "If you want to use TCP, TCP_SND_QUEUELEN must fit in an u16_t, so, you have to reduce it in your lwipopts.h"
@@ -230,8 +239,8 @@ lwip_sanity_check(void)
     LWIP_PLATFORM_DIAG(("lwip_sanity_check: WARNING: TCP_SNDLOWAT must be less than TCP_SND_BUF.\n"));
   if (TCP_SNDQUEUELOWAT >= TCP_SND_QUEUELEN)
     LWIP_PLATFORM_DIAG(("lwip_sanity_check: WARNING: TCP_SNDQUEUELOWAT must be less than TCP_SND_QUEUELEN.\n"));
-  if (TCP_WND > (PBUF_POOL_SIZE*PBUF_POOL_BUFSIZE))
-    LWIP_PLATFORM_DIAG(("lwip_sanity_check: WARNING: TCP_WND is larger than space provided by PBUF_POOL_SIZE*PBUF_POOL_BUFSIZE\n"));
+  if (TCP_WND_LIMIT > (PBUF_POOL_SIZE*PBUF_POOL_BUFSIZE))
+    LWIP_PLATFORM_DIAG(("lwip_sanity_check: WARNING: TCP_WND_LIMIT is larger than space provided by PBUF_POOL_SIZE*PBUF_POOL_BUFSIZE\n"));
   if (TCP_WND < TCP_MSS)
     LWIP_PLATFORM_DIAG(("lwip_sanity_check: WARNING: TCP_WND is smaller than MSS\n"));
 #endif /* LWIP_TCP */
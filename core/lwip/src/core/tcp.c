@@ -76,6 +76,10 @@ const u8_t tcp_backoff[13] =
  /* Times per slowtmr hits */
 const u8_t tcp_persist_backoff[7] = { 3, 6, 12, 24, 48, 96, 120 };
 
+/* Receive window for new connections, and the options we offer with it */
+static tcpwnd_size_t tcp_rcv_wnd = TCP_WND;
+u8_t tcp_rcv_opts = TCP_RCV_WND_SCALE | TCP_RCV_SACK;
+
 /* The TCP PCB lists. */
 
 /** List of all TCP PCBs bound but not yet (connected || listening) */
@@ -140,7 +144,7 @@ tcp_close_shutdown(struct tcp_pcb *pcb, u8_t rst_on_unacked_data)
   err_t err;
 
   if (rst_on_unacked_data && (pcb->state != LISTEN)) {
-    if ((pcb->refused_data != NULL) || (pcb->rcv_wnd != TCP_WND)) {
+    if ((pcb->refused_data != NULL) || (pcb->rcv_wnd != TCP_WND_MAX(pcb))) {
       /* Not all data received by application, send RST to tell the remote
          side about this. */
       LWIP_ASSERT("pcb->flags & TF_RXCLOSED", pcb->flags & TF_RXCLOSED);
@@ -544,7 +548,7 @@ u32_t tcp_update_rcv_ann_wnd(struct tcp_pcb *pcb)
 {
   u32_t new_right_edge = pcb->rcv_nxt + pcb->rcv_wnd;
 
-  if (TCP_SEQ_GEQ(new_right_edge, pcb->rcv_ann_right_edge + LWIP_MIN((TCP_WND / 2), pcb->mss))) {
+  if (TCP_SEQ_GEQ(new_right_edge, pcb->rcv_ann_right_edge + LWIP_MIN((TCP_WND_MAX(pcb) / 2), pcb->mss))) {
     /* we can advertise more window */
     pcb->rcv_ann_wnd = pcb->rcv_wnd;
     return new_right_edge - pcb->rcv_ann_right_edge;
@@ -556,8 +560,8 @@ u32_t tcp_update_rcv_ann_wnd(struct tcp_pcb *pcb)
     } else {
       /* keep the right edge of window constant */
       u32_t new_rcv_ann_wnd = pcb->rcv_ann_right_edge - pcb->rcv_nxt;
-      LWIP_ASSERT("new_rcv_ann_wnd <= 0xffff", new_rcv_ann_wnd <= 0xffff);
-      pcb->rcv_ann_wnd = (u16_t)new_rcv_ann_wnd;
+      LWIP_ASSERT("new_rcv_ann_wnd <= TCP_WND_MAX", new_rcv_ann_wnd <= TCP_WND_MAX(pcb));
+      pcb->rcv_ann_wnd = (tcpwnd_size_t)new_rcv_ann_wnd;
     }
     return 0;
   }
@@ -577,11 +581,11 @@ tcp_recved(struct tcp_pcb *pcb, u16_t len)
   int wnd_inflation;
 
   LWIP_ASSERT("tcp_recved: len would wrap rcv_wnd\n",
-              len <= 0xffff - pcb->rcv_wnd );
+              len <= (tcpwnd_size_t)~0U - pcb->rcv_wnd );
 
   pcb->rcv_wnd += len;
-  if (pcb->rcv_wnd > TCP_WND) {
-    pcb->rcv_wnd = TCP_WND;
+  if (pcb->rcv_wnd > TCP_WND_MAX(pcb)) {
+    pcb->rcv_wnd = TCP_WND_MAX(pcb);
   }
 
   wnd_inflation = tcp_update_rcv_ann_wnd(pcb);
@@ -595,9 +599,45 @@ tcp_recved(struct tcp_pcb *pcb, u16_t len)
     tcp_output(pcb);
   }
 
-  LWIP_DEBUGF(TCP_DEBUG, ("tcp_recved: recveived %"U16_F" bytes, wnd %"U16_F" (%"U16_F").\n",
-         len, pcb->rcv_wnd, TCP_WND - pcb->rcv_wnd));
+  LWIP_DEBUGF(TCP_DEBUG, ("tcp_recved: recveived %"U16_F" bytes, wnd %"TCPWNDSIZE_F" (%"TCPWNDSIZE_F").\n",
+         len, pcb->rcv_wnd, TCP_WND_MAX(pcb) - pcb->rcv_wnd));
+}
+
+/**
+ * Set the receive window for connections created from now on, and
+ * the options offered in their SYN.  The window is limited to
+ * TCP_WND_LIMIT, or to 64K for a connection where the other end
+ * doesn't agree to window scaling; 0 means TCP_WND.
+ *
+ * @param wnd receive window in bytes
+ * @param opts TCP_RCV_WND_SCALE and/or TCP_RCV_SACK
+ */
+void
+tcp_set_rcv_wnd(u32_t wnd, u8_t opts)
+{
+  if (wnd == 0) {
+    wnd = TCP_WND;
+  }
+  tcp_rcv_wnd = (tcpwnd_size_t)LWIP_MAX(LWIP_MIN(wnd, TCP_WND_LIMIT), 2 * TCP_MSS);
+  tcp_rcv_opts = opts;
+}
+
+#if LWIP_WND_SCALE
+/**
+ * The shift count we use for the windows we send: the smallest that
+ * lets the full receive window of the pcb fit in 16 bits.
+ */
+u8_t
+tcp_rcv_wnd_shift(struct tcp_pcb *pcb)
+{
+  u8_t shift = 0;
+
+  while ((pcb->rcv_wnd_max >> shift) > 0xffff && shift < 14) {
+    shift++;
+  }
+  return shift;
 }
+#endif /* LWIP_WND_SCALE */
 
 /**
  * A nastly hack featuring 'goto' statements that allocates a
@@ -705,8 +745,8 @@ tcp_connect(struct tcp_pcb *pcb, ip_addr_t *ipaddr, u16_t port,
   pcb->snd_nxt = iss;
   pcb->lastack = iss - 1;
   pcb->snd_lbb = iss - 1;
-  pcb->rcv_wnd = TCP_WND;
-  pcb->rcv_ann_wnd = TCP_WND;
+  pcb->rcv_wnd = TCPWND16(pcb->rcv_wnd_max);
+  pcb->rcv_ann_wnd = TCPWND16(pcb->rcv_wnd_max);
   pcb->rcv_ann_right_edge = pcb->rcv_nxt;
   pcb->snd_wnd = TCP_WND;
   /* As initial send MSS, we use TCP_MSS but limit it to 536.
@@ -750,7 +790,7 @@ void
 tcp_slowtmr(void)
 {
   struct tcp_pcb *pcb, *prev;
-  u16_t eff_wnd;
+  tcpwnd_size_t eff_wnd;
   u8_t pcb_remove;      /* flag if a PCB should be removed */
   u8_t pcb_reset;       /* flag if a RST should be sent when removing */
   err_t err;
@@ -820,8 +860,8 @@ tcp_slowtmr(void)
             pcb->ssthresh = (pcb->mss << 1);
           }
           pcb->cwnd = pcb->mss;
-          LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_slowtmr: cwnd %"U16_F
-                                       " ssthresh %"U16_F"\n",
+          LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_slowtmr: cwnd %"TCPWNDSIZE_F
+                                       " ssthresh %"TCPWNDSIZE_F"\n",
                                        pcb->cwnd, pcb->ssthresh));
  
           /* The following needs to be called AFTER cwnd is set to one
@@ -1210,8 +1250,9 @@ tcp_alloc(u8_t prio)
     pcb->prio = prio;
     pcb->snd_buf = TCP_SND_BUF;
     pcb->snd_queuelen = 0;
-    pcb->rcv_wnd = TCP_WND;
-    pcb->rcv_ann_wnd = TCP_WND;
+    pcb->rcv_wnd_max = tcp_rcv_wnd;
+    pcb->rcv_wnd = TCPWND16(pcb->rcv_wnd_max);
+    pcb->rcv_ann_wnd = TCPWND16(pcb->rcv_wnd_max);
     pcb->tos = 0;
     pcb->ttl = TCP_TTL;
     /* As initial send MSS, we use TCP_MSS but limit it to 536.
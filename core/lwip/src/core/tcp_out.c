@@ -103,7 +103,7 @@ tcp_output_alloc_header(struct tcp_pcb *pcb, u16_t optlen, u16_t datalen,
     tcphdr->seqno = seqno_be;
     tcphdr->ackno = htonl(pcb->rcv_nxt);
     TCPH_HDRLEN_FLAGS_SET(tcphdr, (5 + optlen / 4), TCP_ACK);
-    tcphdr->wnd = htons(pcb->rcv_ann_wnd);
+    tcphdr->wnd = htons(TCPWND16(RCV_WND_SCALE(pcb, pcb->rcv_ann_wnd)));
     tcphdr->chksum = 0;
     tcphdr->urgp = 0;
 
@@ -735,6 +735,19 @@ tcp_enqueue_flags(struct tcp_pcb *pcb, u8_t flags)
 
   if (flags & TCP_SYN) {
     optflags = TF_SEG_OPTS_MSS;
+#if LWIP_WND_SCALE
+    /* In a SYN-ACK, only if the other end offered it in the SYN */
+    if ((tcp_rcv_opts & TCP_RCV_WND_SCALE) &&
+        (pcb->state != SYN_RCVD || (pcb->flags & TF_WND_SCALE))) {
+      optflags |= TF_SEG_OPTS_WND_SCALE;
+    }
+#endif /* LWIP_WND_SCALE */
+#if LWIP_TCP_SACK_OUT
+    if ((tcp_rcv_opts & TCP_RCV_SACK) &&
+        (pcb->state != SYN_RCVD || (pcb->flags & TF_SACK))) {
+      optflags |= TF_SEG_OPTS_SACK_PERM;
+    }
+#endif /* LWIP_TCP_SACK_OUT */
   }
 #if LWIP_TCP_TIMESTAMPS
   if ((pcb->flags & TF_TIMESTAMP)) {
@@ -828,6 +841,60 @@ tcp_build_timestamp_option(struct tcp_pcb *pcb, u32_t *opts)
 }
 #endif
 
+#if LWIP_TCP_SACK_OUT
+/** Collect SACK blocks for the out-of-sequence data on pcb->ooseq,
+ * merging adjacent segments.  RFC 2018 wants the block holding the
+ * most recently received segment first; the rest follow in sequence
+ * order for as long as there is room.
+ *
+ * @param pcb tcp_pcb
+ * @param sacks where to store the left and right edge of each block
+ * @param max maximum number of blocks
+ * @return number of blocks stored
+ */
+static u8_t
+tcp_build_sack_blocks(struct tcp_pcb *pcb, u32_t *sacks, u8_t max)
+{
+  struct tcp_seg *seg = pcb->ooseq;
+  u32_t left, right;
+  u8_t n = 1;           /* sacks[0..1] is kept for the most recent block */
+  u8_t have_recent = 0;
+  u8_t i;
+
+  while (seg != NULL && (n < max || !have_recent)) {
+    left = seg->tcphdr->seqno;
+    right = left + TCP_TCPLEN(seg);
+    for (seg = seg->next; seg != NULL && seg->tcphdr->seqno == right;
+         seg = seg->next) {
+      right += TCP_TCPLEN(seg);
+    }
+    if (TCP_SEQ_LEQ(right, pcb->rcv_nxt)) {
+      continue;
+    }
+    if (TCP_SEQ_LT(left, pcb->rcv_nxt)) {
+      left = pcb->rcv_nxt;
+    }
+    if (!have_recent && TCP_SEQ_BETWEEN(pcb->sack_recent, left, right - 1)) {
+      sacks[0] = left;
+      sacks[1] = right;
+      have_recent = 1;
+    } else if (n < max) {
+      sacks[2 * n] = left;
+      sacks[2 * n + 1] = right;
+      n++;
+    }
+  }
+  if (!have_recent) {
+    /* Close the gap at the front */
+    n--;
+    for (i = 0; i < 2 * n; i++) {
+      sacks[i] = sacks[i + 2];
+    }
+  }
+  return n;
+}
+#endif /* LWIP_TCP_SACK_OUT */
+
 /** Send an ACK without data.
  *
  * @param pcb Protocol control block for the TCP connection to send the ACK
@@ -837,13 +904,26 @@ tcp_send_empty_ack(struct tcp_pcb *pcb)
 {
   struct pbuf *p;
   struct tcp_hdr *tcphdr;
+  u32_t *opts;
   u8_t optlen = 0;
+#if LWIP_TCP_SACK_OUT
+  u32_t sacks[2 * 4];   /* at most 4 blocks fit in the 40 bytes of options */
+  u8_t num_sacks = 0;
+  u8_t i;
+#endif
 
 #if LWIP_TCP_TIMESTAMPS
   if (pcb->flags & TF_TIMESTAMP) {
     optlen = LWIP_TCP_OPT_LENGTH(TF_SEG_OPTS_TS);
   }
 #endif
+#if LWIP_TCP_SACK_OUT
+  if ((pcb->flags & TF_SACK) && pcb->ooseq != NULL) {
+    num_sacks = tcp_build_sack_blocks(pcb, sacks,
+                                      (40 - optlen - 4) / 8);
+    optlen += LWIP_TCP_SACK_LENGTH(num_sacks);
+  }
+#endif
 
   p = tcp_output_alloc_header(pcb, optlen, 0, htonl(pcb->snd_nxt));
   if (p == NULL) {
@@ -857,13 +937,25 @@ tcp_send_empty_ack(struct tcp_pcb *pcb)
   pcb->flags &= ~(TF_ACK_DELAY | TF_ACK_NOW);
 
   /* NB. MSS option is only sent on SYNs, so ignore it here */
+  opts = (u32_t *)(void *)(tcphdr + 1);
 #if LWIP_TCP_TIMESTAMPS
   pcb->ts_lastacksent = pcb->rcv_nxt;
 
   if (pcb->flags & TF_TIMESTAMP) {
-    tcp_build_timestamp_option(pcb, (u32_t *)(tcphdr + 1));
+    tcp_build_timestamp_option(pcb, opts);
+    opts += 3;
   }
 #endif 
+#if LWIP_TCP_SACK_OUT
+  if (num_sacks) {
+    /* Two NOPs, then kind 5 and the length */
+    *opts++ = htonl(0x01010500 | (2 + 8 * num_sacks));
+    for (i = 0; i < 2 * num_sacks; i++) {
+      *opts++ = htonl(sacks[i]);
+    }
+  }
+#endif
+  LWIP_UNUSED_ARG(opts);
 
 #if CHECKSUM_GEN_TCP
   tcphdr->chksum = inet_chksum_pseudo(p, &(pcb->local_ip), &(pcb->remote_ip),
@@ -935,13 +1027,13 @@ tcp_output(struct tcp_pcb *pcb)
 #endif /* TCP_OUTPUT_DEBUG */
 #if TCP_CWND_DEBUG
   if (seg == NULL) {
-    LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_output: snd_wnd %"U16_F
-                                 ", cwnd %"U16_F", wnd %"U32_F
+    LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_output: snd_wnd %"TCPWNDSIZE_F
+                                 ", cwnd %"TCPWNDSIZE_F", wnd %"U32_F
                                  ", seg == NULL, ack %"U32_F"\n",
                                  pcb->snd_wnd, pcb->cwnd, wnd, pcb->lastack));
   } else {
     LWIP_DEBUGF(TCP_CWND_DEBUG, 
-                ("tcp_output: snd_wnd %"U16_F", cwnd %"U16_F", wnd %"U32_F
+                ("tcp_output: snd_wnd %"TCPWNDSIZE_F", cwnd %"TCPWNDSIZE_F", wnd %"U32_F
                  ", effwnd %"U32_F", seq %"U32_F", ack %"U32_F"\n",
                  pcb->snd_wnd, pcb->cwnd, wnd,
                  ntohl(seg->tcphdr->seqno) - pcb->lastack + seg->len,
@@ -965,7 +1057,7 @@ tcp_output(struct tcp_pcb *pcb)
       break;
     }
 #if TCP_CWND_DEBUG
-    LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_output: snd_wnd %"U16_F", cwnd %"U16_F", wnd %"U32_F", effwnd %"U32_F", seq %"U32_F", ack %"U32_F", i %"S16_F"\n",
+    LWIP_DEBUGF(TCP_CWND_DEBUG, ("tcp_output: snd_wnd %"TCPWNDSIZE_F", cwnd %"TCPWNDSIZE_F", wnd %"U32_F", effwnd %"U32_F", seq %"U32_F", ack %"U32_F", i %"S16_F"\n",
                             pcb->snd_wnd, pcb->cwnd, wnd,
                             ntohl(seg->tcphdr->seqno) + seg->len -
                             pcb->lastack,
@@ -1057,7 +1149,15 @@ tcp_output_segment(struct tcp_seg *seg, struct tcp_pcb *pcb)
   seg->tcphdr->ackno = htonl(pcb->rcv_nxt);
 
   /* advertise our receive window size in this TCP segment */
-  seg->tcphdr->wnd = htons(pcb->rcv_ann_wnd);
+#if LWIP_WND_SCALE
+  if (TCPH_FLAGS(seg->tcphdr) & TCP_SYN) {
+    /* The window in a SYN segment is never scaled */
+    seg->tcphdr->wnd = htons(TCPWND16(pcb->rcv_ann_wnd));
+  } else
+#endif /* LWIP_WND_SCALE */
+  {
+    seg->tcphdr->wnd = htons(TCPWND16(RCV_WND_SCALE(pcb, pcb->rcv_ann_wnd)));
+  }
 
   pcb->rcv_ann_right_edge = pcb->rcv_nxt + pcb->rcv_ann_wnd;
 
@@ -1069,6 +1169,20 @@ tcp_output_segment(struct tcp_seg *seg, struct tcp_pcb *pcb)
     TCP_BUILD_MSS_OPTION(*opts);
     opts += 1;
   }
+#if LWIP_WND_SCALE
+  if (seg->flags & TF_SEG_OPTS_WND_SCALE) {
+    /* NOP, then kind 3, length 3 and the shift count */
+    *opts = htonl(0x01030300 | tcp_rcv_wnd_shift(pcb));
+    opts += 1;
+  }
+#endif /* LWIP_WND_SCALE */
+#if LWIP_TCP_SACK_OUT
+  if (seg->flags & TF_SEG_OPTS_SACK_PERM) {
+    /* Two NOPs, then kind 4 and length 2 */
+    *opts = PP_HTONL(0x01010402);
+    opts += 1;
+  }
+#endif /* LWIP_TCP_SACK_OUT */
 #if LWIP_TCP_TIMESTAMPS
   pcb->ts_lastacksent = pcb->rcv_nxt;
 
@@ -1325,7 +1439,7 @@ tcp_rexmit_fast(struct tcp_pcb *pcb)
     /* The minimum value for ssthresh should be 2 MSS */
     if (pcb->ssthresh < 2*pcb->mss) {
       LWIP_DEBUGF(TCP_FR_DEBUG, 
-                  ("tcp_receive: The minimum value for ssthresh %"U16_F
+                  ("tcp_receive: The minimum value for ssthresh %"TCPWNDSIZE_F
                    " should be min 2 mss %"U16_F"...\n",
                    pcb->ssthresh, 2*pcb->mss));
       pcb->ssthresh = 2*pcb->mss;
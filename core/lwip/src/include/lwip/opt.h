@@ -1019,6 +1019,33 @@
 #define LWIP_TCP_TIMESTAMPS             0
 #endif
 
+/**
+ * LWIP_WND_SCALE==1: support the window scale option (RFC 7323), so
+ * that receive windows larger than 64K can be announced.
+ */
+#ifndef LWIP_WND_SCALE
+#define LWIP_WND_SCALE                  0
+#endif
+
+/**
+ * TCP_WND_LIMIT: The largest receive window tcp_set_rcv_wnd() can set
+ * for new connections.  Without LWIP_WND_SCALE this must fit in an u16_t.
+ * The pbuf pool has to be sized for it, as for TCP_WND.
+ */
+#ifndef TCP_WND_LIMIT
+#define TCP_WND_LIMIT                   (TCP_WND)
+#endif
+
+/**
+ * LWIP_TCP_SACK_OUT==1: offer the SACK-permitted option (RFC 2018) and
+ * report the out-of-sequence data we hold in SACK blocks on the ACKs we
+ * send, so that the other end only retransmits the missing segments.
+ * Needs TCP_QUEUE_OOSEQ.
+ */
+#ifndef LWIP_TCP_SACK_OUT
+#define LWIP_TCP_SACK_OUT               0
+#endif
+
 /**
  * TCP_WND_UPDATE_THRESHOLD: difference in window to trigger an
  * explicit window update
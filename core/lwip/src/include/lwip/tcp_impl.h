@@ -71,6 +71,12 @@ void             tcp_rexmit  (struct tcp_pcb *pcb);
 void             tcp_rexmit_rto  (struct tcp_pcb *pcb);
 void             tcp_rexmit_fast (struct tcp_pcb *pcb);
 u32_t            tcp_update_rcv_ann_wnd(struct tcp_pcb *pcb);
+#if LWIP_WND_SCALE
+u8_t             tcp_rcv_wnd_shift(struct tcp_pcb *pcb);
+#endif /* LWIP_WND_SCALE */
+
+/* Options offered in our SYNs (TCP_RCV_WND_SCALE, TCP_RCV_SACK) */
+extern u8_t tcp_rcv_opts;
 
 /**
  * This is the Nagle algorithm: try to combine user data to send as few TCP
@@ -116,6 +122,23 @@ u32_t            tcp_update_rcv_ann_wnd(struct tcp_pcb *pcb);
 #define TCP_TMR_INTERVAL       250  /* The TCP timer interval in milliseconds. */
 #endif /* TCP_TMR_INTERVAL */
 
+/* Window fields in the header are 16 bits, scaled by a shift count on
+   either side once the window scale option has been agreed (never in
+   SYN segments).  A pcb opens its receive window up to rcv_wnd_max, or
+   to 64K if the other end doesn't do window scaling. */
+#if LWIP_WND_SCALE
+#define TCPWND16(x)             ((u16_t)LWIP_MIN((x), 0xFFFF))
+#define RCV_WND_SCALE(pcb, wnd) ((wnd) >> (pcb)->rcv_scale)
+#define SND_WND_SCALE(pcb, wnd) ((tcpwnd_size_t)(wnd) << (pcb)->snd_scale)
+#define TCP_WND_MAX(pcb)        ((tcpwnd_size_t)(((pcb)->flags & TF_WND_SCALE) ? \
+                                 (pcb)->rcv_wnd_max : TCPWND16((pcb)->rcv_wnd_max)))
+#else /* LWIP_WND_SCALE */
+#define TCPWND16(x)             (x)
+#define RCV_WND_SCALE(pcb, wnd) (wnd)
+#define SND_WND_SCALE(pcb, wnd) (wnd)
+#define TCP_WND_MAX(pcb)        ((pcb)->rcv_wnd_max)
+#endif /* LWIP_WND_SCALE */
+
 #ifndef TCP_FAST_INTERVAL
 #define TCP_FAST_INTERVAL      TCP_TMR_INTERVAL /* the fine grained timeout in milliseconds */
 #endif /* TCP_FAST_INTERVAL */
@@ -293,12 +316,19 @@ struct tcp_seg {
 #define TF_SEG_OPTS_TS          (u8_t)0x02U /* Include timestamp option. */
 #define TF_SEG_DATA_CHECKSUMMED (u8_t)0x04U /* ALL data (not the header) is
                                                checksummed into 'chksum' */
+#define TF_SEG_OPTS_WND_SCALE   (u8_t)0x08U /* Include window scale option. */
+#define TF_SEG_OPTS_SACK_PERM   (u8_t)0x10U /* Include SACK-permitted option. */
   struct tcp_hdr *tcphdr;  /* the TCP header */
 };
 
 #define LWIP_TCP_OPT_LENGTH(flags)              \
   (flags & TF_SEG_OPTS_MSS ? 4  : 0) +          \
-  (flags & TF_SEG_OPTS_TS  ? 12 : 0)
+  (flags & TF_SEG_OPTS_TS  ? 12 : 0) +          \
+  (flags & TF_SEG_OPTS_WND_SCALE ? 4 : 0) +     \
+  (flags & TF_SEG_OPTS_SACK_PERM ? 4 : 0)
+
+/** SACK option with n blocks, after two NOPs for alignment */
+#define LWIP_TCP_SACK_LENGTH(n) ((n) ? 4 + 8 * (n) : 0)
 
 /** This returns a TCP header option for MSS in an u32_t */
 #define TCP_BUILD_MSS_OPTION(x) (x) = PP_HTONL(((u32_t)2 << 24) |          \
@@ -17,7 +17,7 @@
 #define TCPIP_THREAD_STACKSIZE		32768
 
 #define DEFAULT_UDP_RECVMBOX_SIZE	16
-#define DEFAULT_TCP_RECVMBOX_SIZE	128
+#define DEFAULT_TCP_RECVMBOX_SIZE	512
 #define DEFAULT_ACCEPTMBOX_SIZE		4
 
 #define LWIP_SOCKET			0
@@ -26,14 +26,14 @@
 #define MEMP_MEM_MALLOC			0
 
 #define MEMP_NUM_TCP_PCB		64
-#define MEMP_NUM_TCP_SEG		256
+#define MEMP_NUM_TCP_SEG		512
 #define MEMP_NUM_REASSDATA		32
 #define MEMP_NUM_SYS_TIMEOUT		8
 #define MEMP_NUM_NETCONN		64
 #define MEMP_NUM_TCPIP_MSG_API		64
 #define MEMP_NUM_TCPIP_MSG_INPKT	64
 #define MEMP_NUM_NETBUF			128
-#define PBUF_POOL_SIZE			256
+#define PBUF_POOL_SIZE			512
 #define ARP_TABLE_SIZE			16
 #define IP_REASS_MAX_PBUFS		64
 #define IP_REASS_MAXAGE			10
@@ -48,6 +48,16 @@
 #define TCP_SND_BUF		(4*TCP_MSS)
 #define LWIP_TCP_TIMESTAMPS	1
 
+/*
+ * TCP_WND is only the default; the TCPWINDOW option can set up to
+ * TCP_WND_LIMIT per connection, which needs window scaling.  The pbuf
+ * pool, the segment pool and the receive mailbox above have to hold a
+ * full window.
+ */
+#define LWIP_WND_SCALE		1
+#define TCP_WND_LIMIT		(512*1024)
+#define LWIP_TCP_SACK_OUT	1
+
 /*
  * IANA says to use dynamic port numbers above 49152, but some
  * very high numbers are known to be (ab)used, too.
@@ -33,10 +33,15 @@ static int efi_rdwr_sectors(struct disk *disk, void *buf,
 	else
 		status = read_blocks(bio, disk->disk_number, lba, bytes, buf);
 
-	if (status != EFI_SUCCESS)
+	if (status != EFI_SUCCESS) {
 		Print(L"Failed to %s blocks: 0x%x\n",
 			is_write ? L"write" : L"read",
 			status);
+		disk->stats.errors++;
+	} else {
+		disk->stats.bytes += bytes;
+	}
+	disk->stats.calls++;
 
 	return count << disk->sector_shift;
 }
@@ -68,6 +73,7 @@ struct disk *efi_disk_init(void *private)
     disk.sector_size   = bio->Media->BlockSize;
     disk.rdwr_sectors  = efi_rdwr_sectors;
     disk.sector_shift  = ilog2(disk.sector_size);
+    disk.sectors       = bio->Media->LastBlock + 1;
 
     dprintf("sector_size=%d, disk_number=%d\n", disk.sector_size,
 	    disk.disk_number);
@@ -82,6 +88,7 @@ struct disk *efi_disk_init(void *private)
 
 
     disk.maxtransfer   = MaxTransfer;
+    disk.hard_maxtransfer = MaxTransfer;
 
     dprintf("disk %02x cdrom %d type %d sector %u/%u offset %llu limit %u\n",
 	    media_id, cdrom, ebios, sector_size, disk.sector_shift,
@@ -17,6 +17,7 @@
 #include "version.h"
 
 __export uint16_t PXERetry;
+__export uint16_t TFTPBlkSize;
 __export char copyright_str[] = "Copyright (C) 2011-" YEAR_STR "\n";
 uint8_t SerialNotice = 1;
 __export char syslinux_banner[] = "Syslinux " VERSION_STR " (EFI; " DATE_STR ")\n";
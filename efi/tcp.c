@@ -52,6 +52,7 @@ int core_tcp_connect(struct pxe_pvt_inode *socket, uint32_t ip, uint16_t port)
     EFI_TCP4_CONNECTION_TOKEN token;
     EFI_TCP4_ACCESS_POINT *ap;
     EFI_TCP4_CONFIG_DATA tdata;
+    EFI_TCP4_OPTION opt;
     struct efi_binding *b = socket->net.efi.binding;
     EFI_STATUS status;
     EFI_TCP4 *tcp = (EFI_TCP4 *)b->this;
@@ -69,6 +70,25 @@ int core_tcp_connect(struct pxe_pvt_inode *socket, uint32_t ip, uint16_t port)
 
     tdata.TimeToLive = 64;
 
+    /*
+     * Only pass control options if TCPWINDOW or TCPOPTIONS were set.
+     * The firmware then takes every field from them, so the timeouts
+     * and retries need sensible values too; 0 leaves the receive
+     * buffer at the firmware default.
+     */
+    if (TcpWindow || TcpOptions != (TCP_OPT_WSCALE | TCP_OPT_SACK)) {
+	memset(&opt, 0, sizeof(opt));
+	opt.ReceiveBufferSize = TcpWindow;
+	opt.ConnectionTimeout = 75;
+	opt.DataRetries = 12;
+	opt.FinTimeout = 2;
+	opt.TimeWaitTimeout = 2;
+	opt.EnableTimeStamp = TRUE;
+	opt.EnableWindowScaling = !!(TcpOptions & TCP_OPT_WSCALE);
+	opt.EnableSelectiveAck = !!(TcpOptions & TCP_OPT_SACK);
+	tdata.ControlOption = &opt;
+    }
+
     last = start = jiffies();
     while (unmapped){
 	status = uefi_call_wrapper(tcp->Configure, 2, tcp, &tdata);
@@ -197,7 +217,11 @@ void core_tcp_close_file(struct inode *inode)
     socket->net.efi.binding = NULL;
 }
 
-static char databuf[8192];
+/*
+ * Each socket has its own receive buffer: with several connections
+ * open, one may still hold data while we read from another.
+ */
+#define TCP_BUF_SIZE	8192
 
 void core_tcp_fill_buffer(struct inode *inode)
 {
@@ -211,6 +235,12 @@ void core_tcp_fill_buffer(struct inode *inode)
     void *data;
     size_t len;
 
+    if (!socket->tftp_pktbuf) {
+	socket->tftp_pktbuf = malloc(TCP_BUF_SIZE);
+	if (!socket->tftp_pktbuf)
+	    return;
+    }
+
     memset(&iotoken, 0, sizeof(iotoken));
     memset(&rxdata, 0, sizeof(rxdata));
 
@@ -221,10 +251,10 @@ void core_tcp_fill_buffer(struct inode *inode)
 
     iotoken.Packet.RxData = &rxdata;
     rxdata.FragmentCount = 1;
-    rxdata.DataLength = sizeof(databuf);
+    rxdata.DataLength = TCP_BUF_SIZE;
     frag = &rxdata.FragmentTable[0];
-    frag->FragmentBuffer = databuf;
-    frag->FragmentLength = sizeof(databuf);
+    frag->FragmentBuffer = socket->tftp_pktbuf;
+    frag->FragmentLength = TCP_BUF_SIZE;
 
     status = uefi_call_wrapper(tcp->Receive, 2, tcp, &iotoken);
     if (status == EFI_CONNECTION_FIN) {
@@ -242,8 +272,7 @@ void core_tcp_fill_buffer(struct inode *inode)
     cb_status = -1;
 
     len = frag->FragmentLength;
-    memcpy(databuf, frag->FragmentBuffer, len);
-    data = databuf;
+    data = frag->FragmentBuffer;
 
     socket->tftp_dataptr = data;
     socket->tftp_filepos += len;
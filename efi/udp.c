@@ -18,6 +18,9 @@ extern EFI_GUID Udp4ServiceBindingProtocol, Udp4Protocol;
  */
 static struct efi_binding *udp_reader;
 
+/* Link MTU as reported by the SNP driver below UDP4, 0 if unknown */
+static UINT32 udp_mtu;
+
 /** 
  * Try to configure this UDP socket
  *
@@ -64,6 +67,7 @@ EFI_STATUS core_udp_configure(EFI_UDP4 *udp, EFI_UDP4_CONFIG_DATA *udata,
 int core_udp_open(struct pxe_pvt_inode *socket)
 {
     EFI_UDP4_CONFIG_DATA udata;
+    EFI_SIMPLE_NETWORK_MODE snp;
     struct efi_binding *b;
     EFI_STATUS status;
     EFI_UDP4 *udp;
@@ -94,11 +98,13 @@ int core_udp_open(struct pxe_pvt_inode *socket)
      * number as the TID.
      */
     status = uefi_call_wrapper(udp->GetModeData, 5, udp,
-			       &udata, NULL, NULL, NULL);
+			       &udata, NULL, NULL, &snp);
     if (status != EFI_SUCCESS)
 	Print(L"Failed to get UDP mode data: %d\n", status);
-    else
+    else {
 	socket->net.efi.localport = udata.StationPort;
+	udp_mtu = snp.MaxPacketSize;
+    }
 
     return 0;
 
@@ -214,7 +220,8 @@ int core_udp_recv(struct pxe_pvt_inode *socket, void *buf, uint16_t *buf_len,
     struct efi_binding *b;
     EFI_STATUS status;
     EFI_UDP4 *udp;
-    size_t size;
+    size_t size, len;
+    UINT32 i;
     int rv = -1;
     jiffies_t start;
 
@@ -257,10 +264,15 @@ int core_udp_recv(struct pxe_pvt_inode *socket, void *buf, uint16_t *buf_len,
 	goto bail;
 
     rxdata = token.Packet.RxData;
-    frag = &rxdata->FragmentTable[0];
 
-    size = min(frag->FragmentLength, *buf_len);
-    memcpy(buf, frag->FragmentBuffer, size);
+    /* Large or reassembled datagrams may come in several pieces */
+    size = 0;
+    for (i = 0; i < rxdata->FragmentCount && size < *buf_len; i++) {
+	frag = &rxdata->FragmentTable[i];
+	len = min(frag->FragmentLength, *buf_len - size);
+	memcpy((char *)buf + size, frag->FragmentBuffer, len);
+	size += len;
+    }
     *buf_len = size;
 
     memcpy(src_port, &rxdata->UdpSession.SourcePort, sizeof(*src_port));
@@ -273,6 +285,22 @@ bail:
     return rv;
 }
 
+/**
+ * Largest UDP payload we can receive
+ *
+ * @param:frag, whether IP fragmentation is acceptable
+ *
+ * @out: payload size in bytes, 0 if the link MTU is not known
+ */
+size_t core_udp_maxlen(bool frag)
+{
+    if (udp_mtu <= 28)		/* IPv4 + UDP headers */
+	return 0;
+
+    /* The IP4 driver reassembles fragments for us */
+    return frag ? 0xffff - 28 : udp_mtu - 28;
+}
+
 /**
  * Send a UDP packet.
  *
@@ -203,6 +203,12 @@ CORELIBOBJS = \
 	$(LIBENTRY_OBJS) \
 	$(LIBMODULE_OBJS)
 
+# Linked into the core as a plain archive, so only the variants whose
+# filesystem drivers need it (btrfs) pull it in
+CORELIBZOBJS = \
+	zlib/adler32.o zlib/crc32.o zlib/zutil.o			\
+	zlib/inflate.o zlib/inftrees.o zlib/inffast.o
+
 LDFLAGS	= -m elf_$(ARCH) --hash-style=gnu -T $(com32)/lib/$(ARCH)/elf.ld
 
 .SUFFIXES: .c .o .a .so .lo .i .S .s .ls .ss .lss